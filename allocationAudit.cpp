@@ -0,0 +1,166 @@
+#include "allocationAudit.h"
+
+#ifdef HIKBRIDGE_ALLOCATION_AUDIT
+
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+
+// Threads are never forgotten, since a short-lived one that allocated is worth seeing too. Any
+// beyond this are counted together.
+#define MAX_AUDITED_THREADS 256
+
+// glibc's own entry points, which everything below forwards to.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+}
+
+namespace {
+
+struct AuditedThread {
+    std::atomic<long> tid;
+    std::atomic<long> allocations;
+    // As the thread was named when it first allocated; renamed threads are looked up again.
+    char name[16];
+};
+
+const char *const STAGE_NAMES[] = {
+    "other", "capture", "voice-callback", "alarm-callback", "event-handler", "announcement", "recorder",
+};
+static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == (size_t) AllocationStage::count, "Every stage needs a name.");
+
+// All of this is constant-initialized, so it's usable from the very first malloc.
+std::atomic<long> stageAllocations[(size_t) AllocationStage::count];
+AuditedThread threads[MAX_AUDITED_THREADS];
+std::atomic<int> threadCount {0};
+std::atomic<long> overflowAllocations {0};
+std::atomic<long> frees {0};
+
+// Initial-exec TLS in the executable itself, so reading it can't call back into malloc.
+__thread int threadSlot = -1;
+__thread int currentStage = 0;
+
+void countAllocation() {
+    stageAllocations[currentStage].fetch_add(1, std::memory_order_relaxed);
+    if (threadSlot < 0) {
+        int slot = threadCount.fetch_add(1, std::memory_order_relaxed);
+        if (slot < MAX_AUDITED_THREADS) {
+            prctl(PR_GET_NAME, threads[slot].name);
+            threads[slot].tid.store(syscall(SYS_gettid), std::memory_order_release);
+        }
+        threadSlot = slot;
+    }
+    if (threadSlot < MAX_AUDITED_THREADS) {
+        threads[threadSlot].allocations.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        overflowAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+std::string threadName(const AuditedThread &thread, long tid) {
+    std::ifstream comm("/proc/self/task/" + std::to_string(tid) + "/comm");
+    std::string name;
+    if (std::getline(comm, name) && !name.empty()) {
+        return name;
+    }
+    return std::string(thread.name);
+}
+
+}
+
+extern "C" {
+
+void *malloc(size_t size) {
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    countAllocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    countAllocation();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **result, size_t alignment, size_t size) {
+    countAllocation();
+    void *ptr = __libc_memalign(alignment, size);
+    if (ptr == nullptr) {
+        return ENOMEM;
+    }
+    *result = ptr;
+    return 0;
+}
+
+void free(void *ptr) {
+    if (ptr != nullptr) {
+        frees.fetch_add(1, std::memory_order_relaxed);
+    }
+    __libc_free(ptr);
+}
+
+}
+
+AllocationStageScope::AllocationStageScope(AllocationStage stage) : previous((AllocationStage) currentStage) {
+    currentStage = (int) stage;
+}
+
+AllocationStageScope::~AllocationStageScope() {
+    currentStage = (int) previous;
+}
+
+long allocationsInStage(AllocationStage stage) {
+    return stageAllocations[(size_t) stage].load(std::memory_order_relaxed);
+}
+
+std::string renderAllocationAudit() {
+    std::stringstream text;
+    text << "# HELP hikbridge_allocations_total Heap allocations, by the pipeline stage that made them." << std::endl
+         << "# TYPE hikbridge_allocations_total counter" << std::endl;
+    for (size_t stage = 0; stage < (size_t) AllocationStage::count; stage++) {
+        text << "hikbridge_allocations_total{stage=\"" << STAGE_NAMES[stage] << "\"} "
+             << stageAllocations[stage].load(std::memory_order_relaxed) << std::endl;
+    }
+    text << "# HELP hikbridge_frees_total Heap frees." << std::endl
+         << "# TYPE hikbridge_frees_total counter" << std::endl
+         << "hikbridge_frees_total " << frees.load(std::memory_order_relaxed) << std::endl;
+
+    text << "# HELP hikbridge_thread_allocations_total Heap allocations, by the thread that made them." << std::endl
+         << "# TYPE hikbridge_thread_allocations_total counter" << std::endl;
+    int audited = std::min(threadCount.load(std::memory_order_relaxed), MAX_AUDITED_THREADS);
+    for (int slot = 0; slot < audited; slot++) {
+        long tid = threads[slot].tid.load(std::memory_order_acquire);
+        if (tid == 0) {
+            continue;
+        }
+        text << "hikbridge_thread_allocations_total{thread=\"" << threadName(threads[slot], tid) << "\",tid=\"" << tid << "\"} "
+             << threads[slot].allocations.load(std::memory_order_relaxed) << std::endl;
+    }
+    text << "hikbridge_thread_allocations_total{thread=\"unaudited\",tid=\"\"} "
+         << overflowAllocations.load(std::memory_order_relaxed) << std::endl;
+    return text.str();
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef HIKBRIDGE_ALLOCATION_AUDIT_H
+#define HIKBRIDGE_ALLOCATION_AUDIT_H
+
+#include <string>
+
+// The pipeline stages allocations are charged to. Whatever a thread allocates outside a
+// stage's scope goes to other.
+enum class AllocationStage {
+    other,
+    capture,
+    voiceCallback,
+    alarmCallback,
+    eventHandler,
+    announcement,
+    recorder,
+    count,
+};
+
+// Built with -DHIKBRIDGE_ALLOCATION_AUDIT=ON, HikBridge interposes malloc and friends and counts
+// every allocation by thread and by stage, which /metrics then reports. The audio and alarm paths
+// are meant to allocate nothing once they're running, so anything counted there is a regression.
+// Without it, stage scopes compile to nothing.
+#ifdef HIKBRIDGE_ALLOCATION_AUDIT
+    class AllocationStageScope {
+    public:
+        explicit AllocationStageScope(AllocationStage stage);
+        AllocationStageScope(const AllocationStageScope &) = delete;
+        AllocationStageScope &operator=(const AllocationStageScope &) = delete;
+        ~AllocationStageScope();
+
+    private:
+        AllocationStage previous;
+    };
+
+    #define ALLOCATION_STAGE(stage) AllocationStageScope allocationStageScope(AllocationStage::stage)
+
+    long allocationsInStage(AllocationStage stage);
+    // Prometheus text, appended to /metrics.
+    std::string renderAllocationAudit();
+#else
+    #define ALLOCATION_STAGE(stage) do {} while (0)
+#endif
+
+#endif //HIKBRIDGE_ALLOCATION_AUDIT_H
@@ -0,0 +1,362 @@
+#include "announcements.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <plog/Log.h>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "eventStream.h"
+#include "heartbeat.h"
+#include "metrics.h"
+#include "resampler.h"
+
+#define ANNOUNCEMENT_TICK_MILLIS 100
+// A mixed clip that capture stops taking frames from is given up on this long after it should
+// have finished.
+#define ANNOUNCEMENT_MIX_GRACE_MILLIS 3000
+
+static Counter &playedClips() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_announcements_played_total",
+        "Announcement clips played to the end."
+    );
+    return counter;
+}
+
+static Counter &abandonedClips() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_announcements_abandoned_total",
+        "Announcement clips given up on because voice talk didn't come up or went down."
+    );
+    return counter;
+}
+
+static Counter &lateFrames() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_announcement_late_frames_total",
+        "Announcement frames sent more than a frame late, after which pacing starts over from now."
+    );
+    return counter;
+}
+
+static uint32_t readLittleEndian32(const unsigned char *bytes) {
+    return (uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+static uint16_t readLittleEndian16(const unsigned char *bytes) {
+    return (uint16_t) (bytes[0] | bytes[1] << 8);
+}
+
+MappedWavFile::MappedWavFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open " + path + ": " + strerror(errno));
+    }
+    struct stat fileStat {};
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size < 12) {
+        close(fd);
+        throw std::runtime_error(path + " is too short to be a WAV file.");
+    }
+    mappingSize = (size_t) fileStat.st_size;
+    mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        throw std::runtime_error("Can't map " + path + ": " + strerror(errno));
+    }
+
+    try {
+        auto *bytes = static_cast<const unsigned char *>(mapping);
+        if (memcmp(bytes, "RIFF", 4) != 0 || memcmp(bytes + 8, "WAVE", 4) != 0) {
+            throw std::runtime_error(path + " isn't a WAV file.");
+        }
+        bool sawFormat = false;
+        // Chunks are padded to an even length, which keeps the samples aligned.
+        for (size_t offset = 12; offset + 8 <= mappingSize;) {
+            const unsigned char *chunk = bytes + offset;
+            size_t chunkSize = readLittleEndian32(chunk + 4);
+            if (chunkSize > mappingSize - offset - 8) {
+                chunkSize = mappingSize - offset - 8;
+            }
+            if (memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 16) {
+                if (readLittleEndian16(chunk + 8) != 1 || readLittleEndian16(chunk + 10) != 1 || readLittleEndian16(chunk + 22) != 16) {
+                    throw std::runtime_error(path + " has to be mono 16-bit PCM.");
+                }
+                rate = readLittleEndian32(chunk + 12);
+                sawFormat = true;
+            } else if (memcmp(chunk, "data", 4) == 0) {
+                if (!sawFormat) {
+                    throw std::runtime_error(path + " has its samples before their format.");
+                }
+                sampleData = reinterpret_cast<const int16_t *>(chunk + 8);
+                samplesInFile = chunkSize / sizeof(int16_t);
+                break;
+            }
+            offset += 8 + chunkSize + (chunkSize & 1);
+        }
+        if (sampleData == nullptr || rate == 0) {
+            throw std::runtime_error(path + " has no samples.");
+        }
+    } catch (...) {
+        munmap(mapping, mappingSize);
+        throw;
+    }
+    madvise(mapping, mappingSize, MADV_WILLNEED);
+}
+
+MappedWavFile::~MappedWavFile() {
+    if (mapping != nullptr) {
+        munmap(mapping, mappingSize);
+    }
+}
+
+bool AnnouncementPlayer::play(const std::string &clip, bool mix) {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (files.find(clip) == files.end() || requests.size() >= MAX_QUEUED_ANNOUNCEMENTS) {
+        return false;
+    }
+    requests.push_back({ clip, mix });
+    cv.notify_all();
+    return true;
+}
+
+bool AnnouncementPlayer::hasClip(const std::string &clip) {
+    std::lock_guard<std::mutex> lk(mutex);
+    return files.find(clip) != files.end();
+}
+
+void AnnouncementPlayer::mixInto(int16_t *samples, size_t count, const CodecProfile &codec) {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!current || !mixing || current->codec != &codec || count != codec.samplesPerFrame) {
+        return;
+    }
+    const int16_t *frame = current->pcm.data() + mixedFrames * count;
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = (int16_t) std::clamp((int32_t) samples[i] + frame[i], -32768, 32767);
+    }
+    if (++mixedFrames == current->frameCount) {
+        current.reset();
+        cv.notify_all();
+    }
+}
+
+void AnnouncementPlayer::prepareClips(EncoderPool &encoderPool, const CodecProfile &codec) {
+    EncoderLease encoder = encoderPool.acquire(codec);
+    if (!encoder) {
+        std::stringstream ss;
+        ss << "Failed to create a " << codec.name << " encoder for the announcements.";
+        throw SubsystemFault(ss.str());
+    }
+
+    std::map<std::string, std::shared_ptr<const PreparedClip>> next;
+    for (const auto &file : files) {
+        auto clip = std::make_shared<PreparedClip>();
+        clip->name = file.first;
+        clip->codec = &codec;
+        const MappedWavFile &wav = *file.second;
+        if (wav.sampleRate() == codec.sampleRate) {
+            clip->pcm.assign(wav.samples(), wav.samples() + wav.sampleCount());
+        } else {
+            PolyphaseResampler resampler(wav.sampleRate(), codec.sampleRate);
+            clip->pcm.resize(resampler.maxOutputFor(wav.sampleCount()));
+            clip->pcm.resize(resampler.process(wav.samples(), wav.sampleCount(), clip->pcm.data()));
+        }
+        clip->frameCount = (clip->pcm.size() + codec.samplesPerFrame - 1) / codec.samplesPerFrame;
+        clip->pcm.resize(clip->frameCount * codec.samplesPerFrame, 0);
+
+        clip->encoded.resize(clip->frameCount * codec.encodedFrameBytes);
+        encoder->reset();
+        for (size_t frame = 0; frame < clip->frameCount; frame++) {
+            if (!encoder->encode(
+                clip->pcm.data() + frame * codec.samplesPerFrame,
+                clip->encoded.data() + frame * codec.encodedFrameBytes
+            )) {
+                throw SubsystemFault("Failed to encode announcement " + clip->name + ".");
+            }
+        }
+        PLOG_INFO << "Announcement " << clip->name << " is " << clip->frameCount << " " << codec.name << " frames.";
+        next[clip->name] = std::move(clip);
+    }
+    encoder->reset();
+
+    std::lock_guard<std::mutex> lk(mutex);
+    prepared = std::move(next);
+}
+
+void AnnouncementPlayer::sendPaced(
+    SupervisedSubsystem &subsystem,
+    const PreparedClip &clip,
+    const std::function<bool(const char *, size_t)> &send
+) {
+    const char *frames = reinterpret_cast<const char *>(clip.encoded.data());
+    size_t frameBytes = clip.codec->encodedFrameBytes;
+    std::chrono::milliseconds frameDuration(clip.codec->frameMillis());
+
+    // Capture brings voice talk up once it sees a clip playing, and the first frame goes out as
+    // soon as it's there.
+    long giveUpAt = heartbeatClockInMillis() + ANNOUNCEMENT_VOICE_TALK_TIMEOUT_MILLIS;
+    while (!send(frames, frameBytes)) {
+        subsystem.checkForFault();
+        if (heartbeatClockInMillis() >= giveUpAt) {
+            PLOG_WARNING << "Voice talk didn't come up for announcement " << clip.name << ". Skipping it.";
+            abandonedClips().increment();
+            return;
+        }
+        std::this_thread::sleep_for(frameDuration);
+    }
+
+    // Deadlines are absolute, so time spent sending doesn't accumulate into drift.
+    auto deadline = std::chrono::steady_clock::now() + frameDuration;
+    for (size_t frame = 1; frame < clip.frameCount; frame++) {
+        std::this_thread::sleep_until(deadline);
+        subsystem.checkForFault();
+        if (!send(frames + frame * frameBytes, frameBytes)) {
+            PLOG_WARNING << "Voice talk went down " << frame << " frames into announcement " << clip.name << ".";
+            abandonedClips().increment();
+            return;
+        }
+        deadline += frameDuration;
+        auto now = std::chrono::steady_clock::now();
+        if (now > deadline) {
+            // Catching up in a burst would only overrun the device's jitter buffer.
+            lateFrames().increment();
+            deadline = now;
+        }
+    }
+    playedClips().increment();
+}
+
+void AnnouncementPlayer::awaitMixed(SupervisedSubsystem &subsystem, const PreparedClip &clip) {
+    long giveUpAt = heartbeatClockInMillis() + ANNOUNCEMENT_MIX_GRACE_MILLIS
+        + (long) (clip.frameCount * clip.codec->frameMillis());
+    std::unique_lock<std::mutex> lk(mutex);
+    while (current) {
+        lk.unlock();
+        subsystem.checkForFault();
+        lk.lock();
+        if (heartbeatClockInMillis() >= giveUpAt) {
+            PLOG_WARNING << "Capture stopped mixing announcement " << clip.name << " after " << mixedFrames << " frames.";
+            abandonedClips().increment();
+            current.reset();
+            return;
+        }
+        cv.wait_for(lk, std::chrono::milliseconds(ANNOUNCEMENT_TICK_MILLIS));
+    }
+    playedClips().increment();
+}
+
+[[noreturn]] void AnnouncementPlayer::run(
+    SupervisedSubsystem &subsystem,
+    const std::string &directory,
+    EncoderPool &encoderPool,
+    const std::function<const CodecProfile *()> &codec,
+    const std::function<bool(const char *frame, size_t size)> &send
+) {
+    std::map<std::string, std::unique_ptr<MappedWavFile>> loaded;
+    if (!directory.empty()) {
+        DIR *dir = opendir(directory.c_str());
+        if (dir == nullptr) {
+            throw SubsystemFault("Can't read the announcements in " + directory + ": " + strerror(errno));
+        }
+        while (dirent *entry = readdir(dir)) {
+            std::string fileName = entry->d_name;
+            if (fileName.size() <= 4 || fileName.compare(fileName.size() - 4, 4, ".wav") != 0) {
+                continue;
+            }
+            try {
+                loaded[fileName.substr(0, fileName.size() - 4)] = std::make_unique<MappedWavFile>(directory + "/" + fileName);
+            } catch (const std::runtime_error &e) {
+                PLOG_WARNING << "Skipping announcement: " << e.what();
+            }
+        }
+        closedir(dir);
+    }
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        files = std::move(loaded);
+        prepared.clear();
+        requests.clear();
+        current.reset();
+        playing = false;
+    }
+    PLOG_INFO << "Loaded " << files.size() << " announcement(s)" << (directory.empty() ? "." : " from " + directory);
+
+    const CodecProfile *preparedFor = nullptr;
+    subsystem.markHealthy();
+    try {
+        while (true) {
+            subsystem.checkForFault();
+            if (codec() != preparedFor) {
+                preparedFor = codec();
+                prepareClips(encoderPool, *preparedFor);
+            }
+
+            std::unique_lock<std::mutex> lk(mutex);
+            cv.wait_for(lk, std::chrono::milliseconds(ANNOUNCEMENT_TICK_MILLIS), [this] { return !requests.empty(); });
+            if (requests.empty()) {
+                continue;
+            }
+            Request request = requests.front();
+            requests.pop_front();
+            std::shared_ptr<const PreparedClip> clip = prepared[request.clip];
+            current = request.mix ? clip : nullptr;
+            mixedFrames = 0;
+            mixing = request.mix;
+            playing = true;
+            lk.unlock();
+
+            PLOG_INFO << (request.mix ? "Mixing" : "Playing") << " announcement " << request.clip;
+            if (request.mix) {
+                awaitMixed(subsystem, *clip);
+            } else {
+                sendPaced(subsystem, *clip, send);
+            }
+            lk.lock();
+            playing = false;
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lk(mutex);
+        current.reset();
+        playing = false;
+        throw;
+    }
+}
+
+void addAnnouncementRoutes(httplib::Server &server, AnnouncementPlayer &player, const std::function<bool()> &defaultMix) {
+    server.Post(R"(/announcements/([A-Za-z0-9_.-]+)/play)", [&player, defaultMix](const httplib::Request &req, httplib::Response &res) {
+        std::string clip = req.matches[1];
+        bool mix = defaultMix();
+        if (req.has_param("mix")) {
+            std::string value = req.get_param_value("mix");
+            if (value != "true" && value != "false") {
+                res.status = 400;
+                res.set_content("{\"error\":\"mix is either true or false.\"}", "application/json");
+                return;
+            }
+            mix = value == "true";
+        }
+
+        if (!player.hasClip(clip)) {
+            res.status = 404;
+            res.set_content("{\"error\":\"No such announcement.\"}", "application/json");
+            return;
+        }
+        if (!player.play(clip, mix)) {
+            res.status = 503;
+            res.set_content("{\"error\":\"Too many announcements are already waiting.\"}", "application/json");
+            return;
+        }
+        std::stringstream json;
+        json << "{\"clip\":\"" << jsonEscape(clip) << "\",\"mix\":" << (mix ? "true" : "false") << "}";
+        res.status = 202;
+        res.set_content(json.str(), "application/json");
+    });
+}
@@ -0,0 +1,105 @@
+#ifndef HIKBRIDGE_ANNOUNCEMENTS_H
+#define HIKBRIDGE_ANNOUNCEMENTS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "codec.h"
+#include "cpp-httplib/httplib.h"
+#include "supervisor.h"
+
+#define ANNOUNCEMENT_SUBSYSTEM "announcements"
+#define MAX_QUEUED_ANNOUNCEMENTS 8
+// How long a clip waits for voice talk to come up before it's given up on.
+#define ANNOUNCEMENT_VOICE_TALK_TIMEOUT_MILLIS 3000
+
+// A mono 16-bit PCM WAV file, mapped read-only for as long as the player runs.
+class MappedWavFile {
+public:
+    // Throws std::runtime_error when the file can't be mapped or isn't mono 16-bit PCM.
+    explicit MappedWavFile(const std::string &path);
+    MappedWavFile(const MappedWavFile &) = delete;
+    MappedWavFile &operator=(const MappedWavFile &) = delete;
+    ~MappedWavFile();
+
+    const int16_t *samples() const { return sampleData; }
+    size_t sampleCount() const { return samplesInFile; }
+    unsigned int sampleRate() const { return rate; }
+
+private:
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+    const int16_t *sampleData = nullptr;
+    size_t samplesInFile = 0;
+    unsigned int rate = 0;
+};
+
+// One clip made ready for a codec: resampled to its rate and padded to whole frames, with every
+// frame already encoded back to back.
+struct PreparedClip {
+    std::string name;
+    const CodecProfile *codec;
+    std::vector<int16_t> pcm;
+    std::vector<unsigned char> encoded;
+    size_t frameCount;
+};
+
+// Plays the *.wav clips in a directory to the visitor over voice talk. Clips are read once and
+// encoded again only when the device's codec changes, so playing one never touches a file or an
+// encoder. A clip either replaces the microphone, sent by the player on a timer of its own, or is
+// mixed into the microphone by capture before it encodes.
+class AnnouncementPlayer {
+public:
+    // False when there's no such clip or too many are already waiting.
+    bool play(const std::string &clip, bool mix);
+    bool hasClip(const std::string &clip);
+
+    // Capture keeps voice talk up while this is true, as though the visitor were talking.
+    bool isPlaying() const { return playing.load(std::memory_order_acquire); }
+    // The microphone's frames aren't sent while a clip replaces it.
+    bool isReplacingMicrophone() const { return playing.load(std::memory_order_acquire) && !mixing.load(); }
+    // Adds the next frame of a mixed clip to samples, which capture is about to encode as codec.
+    void mixInto(int16_t *samples, size_t count, const CodecProfile &codec);
+
+    // send returns false when voice talk isn't up, and codec is the one voice talk expects now.
+    [[noreturn]] void run(
+        SupervisedSubsystem &subsystem,
+        const std::string &directory,
+        EncoderPool &encoderPool,
+        const std::function<const CodecProfile *()> &codec,
+        const std::function<bool(const char *frame, size_t size)> &send
+    );
+
+private:
+    struct Request {
+        std::string clip;
+        bool mix;
+    };
+
+    void prepareClips(EncoderPool &encoderPool, const CodecProfile &codec);
+    void sendPaced(SupervisedSubsystem &subsystem, const PreparedClip &clip, const std::function<bool(const char *, size_t)> &send);
+    void awaitMixed(SupervisedSubsystem &subsystem, const PreparedClip &clip);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Request> requests;
+    std::map<std::string, std::unique_ptr<MappedWavFile>> files;
+    std::map<std::string, std::shared_ptr<const PreparedClip>> prepared;
+    // What capture is mixing, and how far into it it is.
+    std::shared_ptr<const PreparedClip> current;
+    size_t mixedFrames = 0;
+    std::atomic<bool> mixing {false};
+    std::atomic<bool> playing {false};
+};
+
+// POST /announcements/{clip}/play, with an optional mix=true|false overriding defaultMix.
+void addAnnouncementRoutes(httplib::Server &server, AnnouncementPlayer &player, const std::function<bool()> &defaultMix);
+
+#endif //HIKBRIDGE_ANNOUNCEMENTS_H
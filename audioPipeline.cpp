@@ -0,0 +1,85 @@
+#include "audioPipeline.h"
+
+#include <plog/Log.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+bool isSilentMuLawPeriod(const char *period, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (period[i] != (char) 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool isSilentPcmPeriod(const int16_t *samples, size_t count, int threshold) {
+    for (size_t i = 0; i < count; i++) {
+        if (std::abs((int) samples[i]) > threshold) {
+            return false;
+        }
+    }
+    return true;
+}
+
+AudioRelayAction decideAudioRelayAction(
+    RelaySilenceTracker &silenceTracker,
+    bool voiceComActive,
+    bool intercomGotFuckedWith,
+    bool isSilence,
+    long nowInMillis
+) {
+    if (!voiceComActive && !isSilence) {
+        PLOG_INFO << "Detected audio! Going to start relaying audio to Hik device.";
+        return shouldStart;
+    } else if (voiceComActive && intercomGotFuckedWith) {
+        PLOG_INFO << "It looks like intercom got fucked with, so we're going to need to restart voice comms.";
+        return shouldStart;
+    } else if (voiceComActive && silenceTracker.startOfSilence < 0 && isSilence) {
+        PLOG_INFO << "Detected start of silence. If no sound is heard for "
+            << silenceTracker.hangupAfterMillis << " millis we will hang up voice communications.";
+        silenceTracker.startOfSilence = nowInMillis;
+    } else if (voiceComActive && silenceTracker.startOfSilence >= 0 && !isSilence) {
+        PLOG_INFO << "Heard sound. Postponing hang up.";
+        silenceTracker.startOfSilence = -1;
+    } else if (
+        voiceComActive &&
+        nowInMillis - silenceTracker.startOfSilence > silenceTracker.hangupAfterMillis &&
+        isSilence
+    ) {
+        PLOG_INFO << "Observed " << silenceTracker.hangupAfterMillis << " millis of silence. Hanging up.";
+        silenceTracker.startOfSilence = -1;
+        return shouldEnd;
+    }
+    return none;
+}
+
+void AudioHandoff::publish() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        isBufferReady = true;
+    }
+    cv.notify_one();
+}
+
+size_t AudioHandoff::take(char *destination, size_t capacity) {
+    std::unique_lock<std::mutex> lk(mutex);
+    cv.notify_one();
+    cv.wait(lk);
+    size_t size = std::min(capacity, periodSize.load());
+    memcpy(destination, buffer, size);
+    isBufferReady = false;
+    isSenderStalled = false;
+    lk.unlock();
+    cv.notify_one();
+    return size;
+}
+
+void AudioHandoff::wake() {
+    cv.notify_one();
+}
+
+void AudioHandoff::wakeAll() {
+    cv.notify_all();
+}
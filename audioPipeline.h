@@ -0,0 +1,86 @@
+#ifndef HIKBRIDGE_AUDIO_PIPELINE_H
+#define HIKBRIDGE_AUDIO_PIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#define MILLIS_OF_SILENCE_BEFORE_HANGUP 5000
+#define SOUNDCARD_PERIOD_MILLIS 20
+#define SOUNDCARD_PERIOD_BYTES 160
+
+// A mu-law period is silent when every sample sits at the 0xFF zero level.
+bool isSilentMuLawPeriod(const char *period, size_t size);
+// The linear equivalent: every sample stays within threshold of zero.
+bool isSilentPcmPeriod(const int16_t *samples, size_t count, int threshold = 0);
+
+enum AudioRelayAction { shouldStart, shouldEnd, none };
+
+// Tracks how long the capture has been silent while voice talk is up.
+struct RelaySilenceTracker {
+    long startOfSilence = -1;
+    long hangupAfterMillis = MILLIS_OF_SILENCE_BEFORE_HANGUP;
+};
+
+AudioRelayAction decideAudioRelayAction(
+    RelaySilenceTracker &silenceTracker,
+    bool voiceComActive,
+    bool intercomGotFuckedWith,
+    bool isSilence,
+    long nowInMillis
+);
+
+// How long capture waits for a voice talk sender to take its last period before giving up on it.
+#define HANDOFF_STALL_MILLIS (2 * SOUNDCARD_PERIOD_MILLIS)
+
+// The single-period handoff between the capture thread and the SDK's voice talk callback.
+// While voice talk is up the two sides ping-pong on one CV: capture fills the buffer and
+// publishes it, the callback copies it out, and capture waits for that before filling it again.
+class AudioHandoff {
+public:
+    // Fills the buffer once the sender has taken the last period. A sender that hasn't within
+    // timeoutMillis is stalled: its period is dropped without waiting again until it takes one.
+    // False if the period was dropped.
+    template <typename FillPeriod>
+    bool capture(bool senderActive, long timeoutMillis, FillPeriod fillPeriod) {
+        std::unique_lock<std::mutex> lk(mutex);
+        if (isBufferReady && senderActive) {
+            cv.notify_one();
+            if (
+                isSenderStalled ||
+                cv.wait_for(lk, std::chrono::milliseconds(timeoutMillis)) == std::cv_status::timeout
+            ) {
+                isSenderStalled = true;
+                return false;
+            }
+        }
+        isBufferReady = false;
+        fillPeriod(buffer);
+        return true;
+    }
+
+    void publish();
+    // Copies the published period out and returns its length, capped at the destination's capacity.
+    size_t take(char *destination, size_t capacity);
+    void wake();
+    void wakeAll();
+
+    const char *period() const { return buffer; }
+    // Encoded periods vary with the negotiated codec, up to the buffer's capacity.
+    void setPeriodSize(size_t newPeriodSize) { periodSize = newPeriodSize; }
+    size_t getPeriodSize() const { return periodSize; }
+    static constexpr size_t size() { return SOUNDCARD_PERIOD_BYTES; }
+
+private:
+    char buffer[SOUNDCARD_PERIOD_BYTES] {};
+    std::atomic<size_t> periodSize {SOUNDCARD_PERIOD_BYTES};
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool isBufferReady = false;
+    bool isSenderStalled = false;
+};
+
+#endif //HIKBRIDGE_AUDIO_PIPELINE_H
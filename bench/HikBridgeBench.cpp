@@ -0,0 +1,687 @@
+// HikBridgeBench drives the per-frame capture -> VAD -> handoff -> send path with synthetic S16
+// sources and a stub sender standing in for the SDK's voice talk thread, then prints a JSON report
+// so regressions show up whenever the threading model changes. Capture runs the production code:
+// deinterleave, the DSP chain, the encoder and the flight recorder; the sender queues both
+// directions with the conversation recorder. The SDK callback and noteVoiceSend live in main.cpp
+// behind the SDK, so only the HIKBRIDGE_ALLOCATION_AUDIT build counts those. It also times
+// decodeIntercomEvent, and measures the capture resampler against ALSA's linear rate plugin in
+// CPU per second of audio. Once warmed up, none of it may allocate; it exits 1 if any of it
+// does, or if one of the DSP checks fails.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <cxxopts.hpp>
+#include "../audioPipeline.h"
+#include "../codec.h"
+#include "../dsp.h"
+#include "../flightRecorder.h"
+#include "../intercomEvents.h"
+#include "../recorder.h"
+#include "../resampler.h"
+#include "../supervisor.h"
+#include "../voiceChannels.h"
+#ifdef BENCH_WITH_ALSA
+    #ifdef REMOTE
+        #include <alsa/asoundlib.h>
+    #else
+        #include "../alsa-lib-1.2.6.1/include/asoundlib.h"
+    #endif
+#endif
+
+// Periods each session runs before its allocations start counting against the steady state.
+#define WARMUP_PERIODS 50
+// The synthetic card is stereo, so every period goes through deinterleave like a multichannel one.
+#define BENCH_CARD_CHANNELS 2
+
+static std::atomic<long> allocationCount {0};
+static thread_local long threadAllocationCount = 0;
+// Whatever allocated after warming up, by name, to fail the run with.
+static std::vector<std::string> allocatingSteadyStates;
+// DSP behaviour checks that failed, by name.
+static std::vector<std::string> failedChecks;
+
+void *operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    threadAllocationCount++;
+    if (void *ptr = malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, [[maybe_unused]] size_t size) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, [[maybe_unused]] size_t size) noexcept {
+    free(ptr);
+}
+
+long nowInNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+static const CodecProfile &benchCodec = codecProfile(VoiceCodec::g711MuLaw);
+static EncoderPool benchEncoders;
+// The writer thread is left running when the bench exits, so the recorder is never destroyed.
+static ConversationRecorder &benchRecorder = *new ConversationRecorder();
+
+// One second of a 440 Hz tone on every channel of the synthetic card, interleaved as the card
+// delivers it, so "speech" periods are never silent.
+struct SyntheticSpeech {
+    int16_t samples[8000 * BENCH_CARD_CHANNELS] {};
+
+    SyntheticSpeech() {
+        for (int i = 0; i < 8000; i++) {
+            for (int channel = 0; channel < BENCH_CARD_CHANNELS; channel++) {
+                samples[i * BENCH_CARD_CHANNELS + channel] = (int16_t) (8000.0 * sin(2.0 * M_PI * 440.0 * i / 8000.0));
+            }
+        }
+    }
+
+    void fill(int16_t *period, size_t frames, long periodIndex) const {
+        size_t periodSamples = frames * BENCH_CARD_CHANNELS;
+        size_t offset = (periodIndex * periodSamples) % (sizeof(samples) / sizeof(samples[0]));
+        std::copy(samples + offset, samples + offset + periodSamples, period);
+    }
+};
+
+static const SyntheticSpeech syntheticSpeech;
+
+struct BenchScenario {
+    std::string name;
+    unsigned int sessions;
+    std::function<bool(long periodIndex)> isSpeech;
+};
+
+class BenchSession {
+public:
+    explicit BenchSession(long periods)
+        : periods(periods), encoder(benchEncoders.acquire(benchCodec)), dsp(makeDspChain(benchDsp(), benchCodec.sampleRate)) {
+        latenciesInNanos.reserve(periods);
+        handoff.setPeriodSize(benchCodec.encodedFrameBytes);
+    }
+
+    // Periods where the VAD changes its mind log at INFO, and starting or stopping voice talk
+    // spawns or joins the sender thread. Those are transitions rather than the steady state, so
+    // only the periods in between are counted.
+    void run(const std::function<bool(long periodIndex)> &isSpeech) {
+        size_t frameSamples = benchCodec.samplesPerFrame;
+        for (long periodIndex = 0; periodIndex < periods; periodIndex++) {
+            long allocationsBefore = threadAllocationCount;
+            long startOfSilenceBefore = silenceTracker.startOfSilence;
+            // Stands in for snd_pcm_readi on an S16 card.
+            if (isSpeech(periodIndex)) {
+                syntheticSpeech.fill(interleavedPeriod, frameSamples, periodIndex);
+            } else {
+                std::fill(interleavedPeriod, interleavedPeriod + frameSamples * BENCH_CARD_CHANNELS, 0);
+            }
+            deinterleave(interleavedPeriod, frameSamples, BENCH_CARD_CHANNELS, cardPeriod);
+            std::copy(cardPeriod, cardPeriod + frameSamples, processedPeriod);
+            dsp->process(processedPeriod, frameSamples);
+            bool delivered = handoff.capture(senderActive, HANDOFF_STALL_MILLIS, [&](char *buffer) {
+                encoder->encode(processedPeriod, (unsigned char *) buffer);
+            });
+            if (delivered) {
+                lastPublishInNanos = nowInNanos();
+                handoff.publish();
+            } else {
+                stalledPeriods++;
+            }
+            framesCaptured++;
+            flightRecordAudio(cardPeriod, frameSamples, benchCodec.sampleRate);
+
+            bool isSilence = isSilentPcmPeriod(cardPeriod, frameSamples);
+            AudioRelayAction action = decideAudioRelayAction(
+                silenceTracker,
+                senderActive,
+                false,
+                isSilence,
+                periodIndex * SOUNDCARD_PERIOD_MILLIS
+            );
+            bool transition = action != none || silenceTracker.startOfSilence != startOfSilenceBefore;
+            if (periodIndex >= WARMUP_PERIODS && !transition) {
+                steadyStateAllocations += threadAllocationCount - allocationsBefore;
+            }
+            switch (action) {
+                case shouldStart:
+                    encoder->reset();
+                    handoff.wake();
+                    startSender();
+                    break;
+                case shouldEnd:
+                    handoff.wake();
+                    stopSender();
+                    break;
+                default:
+                    handoff.wake();
+            }
+        }
+        stopSender();
+    }
+
+    long periods;
+    long framesCaptured = 0;
+    // Captured periods dropped because the sender hadn't taken the one before in time.
+    long stalledPeriods = 0;
+    long framesSent = 0;
+    long voiceTalkStarts = 0;
+    // Made by the capture loop after warming up, and by the sender once it's taking frames.
+    std::atomic<long> steadyStateAllocations {0};
+    std::vector<long> latenciesInNanos;
+
+private:
+    // Every stage on, so each one runs on every period.
+    static DspConfig benchDsp() {
+        DspConfig config;
+        config.gateThresholdDbfs = -45;
+        return config;
+    }
+
+    // Plays the part of the SDK's voice talk thread calling hikVoiceCommunicationsCallback, which
+    // records what the device heard, takes the period and records it again once it's sent.
+    void startSender() {
+        stopSender();
+        voiceTalkStarts++;
+        senderActive = true;
+        senderDone = false;
+        sender = std::thread([this]() {
+            char sendBuffer[SOUNDCARD_PERIOD_BYTES] {};
+            long allocationsBefore = threadAllocationCount;
+            while (senderActive) {
+                benchRecorder.record(RecordedDirection::incoming, sendBuffer, sizeof(sendBuffer));
+                size_t periodSize = handoff.take(sendBuffer, sizeof(sendBuffer));
+                if (!senderActive) {
+                    break;
+                }
+                if (latenciesInNanos.size() < latenciesInNanos.capacity()) {
+                    latenciesInNanos.push_back(nowInNanos() - lastPublishInNanos);
+                }
+                stubSendChecksum += (unsigned char) sendBuffer[0];
+                benchRecorder.record(RecordedDirection::outgoing, sendBuffer, periodSize);
+                framesSent++;
+            }
+            steadyStateAllocations += threadAllocationCount - allocationsBefore;
+            senderDone = true;
+        });
+    }
+
+    void stopSender() {
+        if (!sender.joinable()) {
+            return;
+        }
+        senderActive = false;
+        while (!senderDone) {
+            handoff.wakeAll();
+            std::this_thread::yield();
+        }
+        sender.join();
+    }
+
+    AudioHandoff handoff;
+    RelaySilenceTracker silenceTracker;
+    EncoderLease encoder;
+    std::unique_ptr<FrameProcessor> dsp;
+    int16_t interleavedPeriod[MAX_CODEC_FRAME_SAMPLES * BENCH_CARD_CHANNELS] {};
+    int16_t cardPeriod[MAX_CODEC_FRAME_SAMPLES * BENCH_CARD_CHANNELS] {};
+    int16_t processedPeriod[MAX_CODEC_FRAME_SAMPLES] {};
+    std::atomic<bool> senderActive {false};
+    std::atomic<bool> senderDone {true};
+    std::atomic<long> lastPublishInNanos {0};
+    unsigned long stubSendChecksum = 0;
+    std::thread sender;
+};
+
+struct ResourceSnapshot {
+    double cpuSeconds;
+    long contextSwitches;
+    long allocations;
+    long wallInNanos;
+
+    static ResourceSnapshot take() {
+        struct rusage usage {};
+        getrusage(RUSAGE_SELF, &usage);
+        return {
+            (double) usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                (double) usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+            usage.ru_nvcsw + usage.ru_nivcsw,
+            allocationCount.load(),
+            nowInNanos()
+        };
+    }
+};
+
+long percentile(const std::vector<long> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, (size_t) (fraction * (double) sorted.size()))];
+}
+
+std::string runScenario(const BenchScenario &scenario, long periods) {
+    std::vector<std::unique_ptr<BenchSession>> sessions;
+    for (unsigned int i = 0; i < scenario.sessions; i++) {
+        sessions.push_back(std::make_unique<BenchSession>(periods));
+    }
+    std::vector<std::thread> captureThreads;
+    captureThreads.reserve(scenario.sessions);
+
+    auto before = ResourceSnapshot::take();
+    for (auto &session : sessions) {
+        captureThreads.emplace_back([&session, &scenario]() { session->run(scenario.isSpeech); });
+    }
+    for (auto &thread : captureThreads) {
+        thread.join();
+    }
+    auto after = ResourceSnapshot::take();
+
+    long frames = 0, stalledPeriods = 0, framesSent = 0, voiceTalkStarts = 0, steadyStateAllocations = 0;
+    std::vector<long> latencies;
+    for (auto &session : sessions) {
+        frames += session->framesCaptured;
+        stalledPeriods += session->stalledPeriods;
+        framesSent += session->framesSent;
+        voiceTalkStarts += session->voiceTalkStarts;
+        steadyStateAllocations += session->steadyStateAllocations;
+        latencies.insert(latencies.end(), session->latenciesInNanos.begin(), session->latenciesInNanos.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    if (steadyStateAllocations > 0) {
+        allocatingSteadyStates.push_back(scenario.name);
+    }
+
+    double wallSeconds = (double) (after.wallInNanos - before.wallInNanos) / 1e9;
+    double cpuSeconds = after.cpuSeconds - before.cpuSeconds;
+    std::stringstream json;
+    json << "    {" << std::endl
+         << "      \"name\": \"" << scenario.name << "\"," << std::endl
+         << "      \"sessions\": " << scenario.sessions << "," << std::endl
+         << "      \"framesCaptured\": " << frames << "," << std::endl
+         << "      \"stalledPeriods\": " << stalledPeriods << "," << std::endl
+         << "      \"framesSent\": " << framesSent << "," << std::endl
+         << "      \"voiceTalkStarts\": " << voiceTalkStarts << "," << std::endl
+         << "      \"wallSeconds\": " << wallSeconds << "," << std::endl
+         << "      \"cpuSeconds\": " << cpuSeconds << "," << std::endl
+         << "      \"framesPerSecond\": " << frames / wallSeconds << "," << std::endl
+         << "      \"framesPerSecondPerCore\": " << (cpuSeconds > 0 ? frames / cpuSeconds : 0) << "," << std::endl
+         << "      \"latencyNanos\": {"
+         << "\"p50\": " << percentile(latencies, 0.50) << ", "
+         << "\"p90\": " << percentile(latencies, 0.90) << ", "
+         << "\"p99\": " << percentile(latencies, 0.99) << ", "
+         << "\"max\": " << (latencies.empty() ? 0 : latencies.back()) << "}," << std::endl
+         << "      \"allocationsPerFrame\": " << (double) (after.allocations - before.allocations) / frames << "," << std::endl
+         << "      \"steadyStateAllocations\": " << steadyStateAllocations << "," << std::endl
+         << "      \"contextSwitchesPerFrame\": " << (double) (after.contextSwitches - before.contextSwitches) / frames << std::endl
+         << "    }";
+    return json.str();
+}
+
+// The alarm callback's half of the alarm path: decoding a bell press straight into its device's
+// queue. The handler's pop follows each one so the queue never fills.
+std::string runAlarmDecode(long alarms) {
+    auto queues = std::make_unique<IntercomEventQueues>();
+    NET_DVR_ALARMER alarmer {};
+    alarmer.byDeviceIPValid = 1;
+    snprintf(alarmer.sDeviceIP, sizeof(alarmer.sDeviceIP), "192.168.1.64");
+    NET_DVR_VIDEO_INTERCOM_ALARM alarm {};
+    alarm.byAlarmType = BELL_PRESSED_ALARM;
+    IntercomEvent event {};
+    long steadyStateAllocations = 0;
+
+    auto before = ResourceSnapshot::take();
+    for (long i = 0; i < alarms; i++) {
+        long allocationsBefore = threadAllocationCount;
+        decodeIntercomEvent(COMM_ALARM_VIDEO_INTERCOM, &alarmer, (const char *) &alarm, i, *queues);
+        queues->forAlarmer(&alarmer).pop(event);
+        if (i >= WARMUP_PERIODS) {
+            steadyStateAllocations += threadAllocationCount - allocationsBefore;
+        }
+    }
+    auto after = ResourceSnapshot::take();
+    if (steadyStateAllocations > 0) {
+        allocatingSteadyStates.push_back("alarm-decode");
+    }
+
+    std::stringstream json;
+    json << "  \"alarmDecode\": {"
+         << "\"alarms\": " << alarms << ", "
+         << "\"nanosPerAlarm\": " << (double) (after.wallInNanos - before.wallInNanos) / (double) alarms << ", "
+         << "\"steadyStateAllocations\": " << steadyStateAllocations << "}";
+    return json.str();
+}
+
+struct ResamplerScenario {
+    unsigned int inputRate;
+    unsigned int outputRate;
+};
+
+std::vector<int16_t> toneAt(unsigned int sampleRate, double frequency, size_t count) {
+    std::vector<int16_t> tone(count);
+    for (size_t i = 0; i < count; i++) {
+        tone[i] = (int16_t) (16000.0 * sin(2.0 * M_PI * frequency * (double) i / sampleRate));
+    }
+    return tone;
+}
+
+// A loud burst and then room noise at about -55 dBFS through a -45 dBFS gate. Once the hold and
+// release have run out, the noise has to come out at the gate's floor rather than at full level.
+bool gateClosesAfterBurst() {
+    DspConfig config;
+    config.highPassHz = 0;
+    config.gateThresholdDbfs = -45;
+    config.agcTargetDbfs = 0;
+    std::unique_ptr<FrameProcessor> gate = makeDspChain(config, 8000);
+    size_t frameSamples = 8000 / (1000 / SOUNDCARD_PERIOD_MILLIS);
+    std::vector<int16_t> burst = toneAt(8000, 440.0, 4000);
+    for (size_t offset = 0; offset + frameSamples <= burst.size(); offset += frameSamples) {
+        gate->process(burst.data() + offset, frameSamples);
+    }
+    std::vector<int16_t> noise = toneAt(8000, 440.0, 8000);
+    int noisePeak = 0;
+    for (auto &sample : noise) {
+        sample = (int16_t) (sample / 275);
+        noisePeak = std::max(noisePeak, std::abs((int) sample));
+    }
+    int lastFramePeak = 0;
+    for (size_t offset = 0; offset + frameSamples <= noise.size(); offset += frameSamples) {
+        gate->process(noise.data() + offset, frameSamples);
+        lastFramePeak = 0;
+        for (size_t i = offset; i < offset + frameSamples; i++) {
+            lastFramePeak = std::max(lastFramePeak, std::abs((int) noise[i]));
+        }
+    }
+    return lastFramePeak <= noisePeak / 4;
+}
+
+// Mean level of the last frame of a talker at amplitude after a loud burst has pulled the AGC's
+// gain down, against the -18 dBFS target. Once it's recovered, it has to sit within 1 dB of it.
+bool agcConvergesAfterBurst(int amplitude) {
+    DspConfig config;
+    config.highPassHz = 0;
+    std::unique_ptr<FrameProcessor> agc = makeDspChain(config, 8000);
+    size_t frameSamples = 8000 / (1000 / SOUNDCARD_PERIOD_MILLIS);
+    std::vector<int16_t> burst = toneAt(8000, 440.0, 4000);
+    for (size_t offset = 0; offset + frameSamples <= burst.size(); offset += frameSamples) {
+        agc->process(burst.data() + offset, frameSamples);
+    }
+    std::vector<int16_t> talker = toneAt(8000, 440.0, 8000 * 3);
+    for (auto &sample : talker) {
+        sample = (int16_t) (sample * amplitude / 16000);
+    }
+    double lastFrameLevel = 0;
+    for (size_t offset = 0; offset + frameSamples <= talker.size(); offset += frameSamples) {
+        agc->process(talker.data() + offset, frameSamples);
+        long sum = 0;
+        for (size_t i = offset; i < offset + frameSamples; i++) {
+            sum += std::abs((int) talker[i]);
+        }
+        lastFrameLevel = (double) sum / (double) frameSamples;
+    }
+    double target = 32767.0 * pow(10.0, config.agcTargetDbfs / 20.0);
+    return std::abs(20 * log10(lastFrameLevel / target)) <= 1.0;
+}
+
+// RMS of the resampled tone in dB relative to the input tone, skipping the filter's warm-up.
+double resampledLevelInDb(const ResamplerScenario &scenario, double frequency) {
+    PolyphaseResampler resampler(scenario.inputRate, scenario.outputRate);
+    std::vector<int16_t> input = toneAt(scenario.inputRate, frequency, scenario.inputRate);
+    std::vector<int16_t> output(resampler.maxOutputFor(input.size()));
+    size_t produced = resampler.process(input.data(), input.size(), output.data());
+    double sumOfSquares = 0;
+    size_t counted = 0;
+    for (size_t i = produced / 10; i < produced; i++) {
+        sumOfSquares += (double) output[i] * output[i];
+        counted++;
+    }
+    double level = 20 * log10(sqrt(sumOfSquares / (double) counted) / (16000.0 / sqrt(2.0)));
+    // Fully rejected tones would print -inf, which isn't valid JSON.
+    return std::max(level, -120.0);
+}
+
+std::string resamplerJson(
+    const std::string &name,
+    long audioSeconds,
+    const ResourceSnapshot &before,
+    const ResourceSnapshot &after,
+    const std::string &extraFields
+) {
+    double cpuSeconds = after.cpuSeconds - before.cpuSeconds;
+    std::stringstream json;
+    json << "    {" << std::endl
+         << "      \"name\": \"" << name << "\"," << std::endl
+         << "      \"audioSeconds\": " << audioSeconds << "," << std::endl
+         << "      \"wallSeconds\": " << (double) (after.wallInNanos - before.wallInNanos) / 1e9 << "," << std::endl
+         << "      \"cpuSeconds\": " << cpuSeconds << "," << std::endl
+         << extraFields
+         << "      \"cpuSecondsPerAudioSecond\": " << cpuSeconds / (double) audioSeconds << "," << std::endl
+         << "      \"allocationsPerAudioSecond\": " << (double) (after.allocations - before.allocations) / audioSeconds << std::endl
+         << "    }";
+    return json.str();
+}
+
+// Converts the card's 20 ms periods the way soundcardReadLoop does.
+std::string runPolyphaseResampler(const ResamplerScenario &scenario, long audioSeconds) {
+    size_t periodFrames = scenario.inputRate / (1000 / SOUNDCARD_PERIOD_MILLIS);
+    std::vector<int16_t> input = toneAt(scenario.inputRate, 440.0, scenario.inputRate);
+    PolyphaseResampler resampler(scenario.inputRate, scenario.outputRate);
+    std::vector<int16_t> output(resampler.maxOutputFor(periodFrames));
+    unsigned long checksum = 0;
+    // The first period sizes the resampler's window, after which it never grows again.
+    resampler.process(input.data(), periodFrames, output.data());
+    resampler.reset();
+
+    auto before = ResourceSnapshot::take();
+    for (long second = 0; second < audioSeconds; second++) {
+        for (size_t offset = 0; offset + periodFrames <= input.size(); offset += periodFrames) {
+            size_t produced = resampler.process(input.data() + offset, periodFrames, output.data());
+            checksum += (unsigned short) output[produced - 1];
+        }
+    }
+    auto after = ResourceSnapshot::take();
+
+    std::stringstream name;
+    name << "polyphase-" << scenario.inputRate << "-to-" << scenario.outputRate;
+    if (after.allocations > before.allocations) {
+        allocatingSteadyStates.push_back(name.str());
+    }
+    std::stringstream extraFields;
+    extraFields << "      \"tapsPerPhase\": " << resampler.getTapsPerPhase() << "," << std::endl
+                << "      \"passbandLevelDb\": " << resampledLevelInDb(scenario, 1000.0) << "," << std::endl
+                << "      \"aliasLevelDb\": " << resampledLevelInDb(scenario, scenario.outputRate * 0.75) << "," << std::endl
+                << "      \"checksum\": " << checksum << "," << std::endl;
+    return resamplerJson(name.str(), audioSeconds, before, after, extraFields.str());
+}
+
+#ifdef BENCH_WITH_ALSA
+// What allowResampling = 1 costs: a rate plugin with the linear converter over a null slave
+// running at the card's rate. The null slave's own cost is negligible next to the conversion.
+std::string runAlsaLinearResampler(const ResamplerScenario &scenario, long audioSeconds) {
+    std::stringstream configText;
+    configText << "pcm.hikbridge_bench_rate { type rate converter \"linear\" "
+               << "slave { pcm { type null } rate " << scenario.inputRate << " format S16_LE } }";
+    std::string configString = configText.str();
+    snd_config_t *config;
+    snd_input_t *configInput;
+    snd_pcm_t *pcm;
+    if (
+        snd_config_top(&config) < 0 ||
+        snd_input_buffer_open(&configInput, configString.c_str(), (ssize_t) configString.size()) < 0
+    ) {
+        return "";
+    }
+    snd_config_load(config, configInput);
+    snd_input_close(configInput);
+    if (
+        snd_pcm_open_lconf(&pcm, "hikbridge_bench_rate", SND_PCM_STREAM_CAPTURE, 0, config) < 0 ||
+        snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, 1, scenario.outputRate, 0, 500000) < 0
+    ) {
+        snd_config_delete(config);
+        return "";
+    }
+
+    size_t periodFrames = scenario.outputRate / (1000 / SOUNDCARD_PERIOD_MILLIS);
+    std::vector<int16_t> output(periodFrames);
+    auto before = ResourceSnapshot::take();
+    for (long period = 0; period < audioSeconds * (1000 / SOUNDCARD_PERIOD_MILLIS); period++) {
+        if (snd_pcm_readi(pcm, output.data(), periodFrames) < 0) {
+            snd_pcm_prepare(pcm);
+        }
+    }
+    auto after = ResourceSnapshot::take();
+    snd_pcm_close(pcm);
+    snd_config_delete(config);
+
+    std::stringstream name;
+    name << "alsa-linear-" << scenario.inputRate << "-to-" << scenario.outputRate;
+    return resamplerJson(name.str(), audioSeconds, before, after, "");
+}
+#endif
+
+int main(int argc, char** argv) {
+    cxxopts::Options options("HikBridgeBench", "Throughput and latency benchmark for the HikBridge audio pipeline.");
+    options.add_options()
+        (
+            "n,periods",
+            "Number of 20 ms periods each session captures per scenario",
+            cxxopts::value<long>()->default_value("50000")
+        )
+        (
+            "s,sessions",
+            "Number of simultaneous sessions in the many-sessions scenario",
+            cxxopts::value<unsigned int>()->default_value("16")
+        )
+        (
+            "r,resample-seconds",
+            "Seconds of card audio each resampler scenario converts",
+            cxxopts::value<long>()->default_value("600")
+        )
+        (
+            "o,output",
+            "Path to write the JSON results to. Printed to stdout if not set.",
+            cxxopts::value<std::string>()->default_value("")
+        );
+    auto result = options.parse(argc, argv);
+    long periods = result["periods"].as<long>();
+    unsigned int manySessions = result["sessions"].as<unsigned int>();
+    long resampleSeconds = result["resample-seconds"].as<long>();
+    std::string outputPath = result["output"].as<std::string>();
+
+    // record() only queues while a writer is running. No recording session is ever begun, so the
+    // writer discards every frame rather than filling the disk.
+    char recordingDirectory[] = "/tmp/hikbridge-bench-XXXXXX";
+    if (mkdtemp(recordingDirectory) == nullptr) {
+        std::cerr << "Couldn't create a directory for the recorder: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    Supervisor &supervisor = *new Supervisor([](const std::string &reason) {
+        std::cerr << reason << std::endl;
+        exit(1);
+    });
+    RecordingConfig recording;
+    recording.directory = recordingDirectory;
+    supervisor.supervise(RECORDER_SUBSYSTEM, { 1000, 30000, 60000, 1 }, [recording](SupervisedSubsystem &subsystem) {
+        benchRecorder.run(subsystem, recording);
+    });
+    while (!supervisor.isHealthy(RECORDER_SUBSYSTEM)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Bursty speech talks for a second, then stays quiet long enough for the hangup to fire.
+    long burstPeriods = 1000 / SOUNDCARD_PERIOD_MILLIS;
+    long quietPeriods = (MILLIS_OF_SILENCE_BEFORE_HANGUP + 1000) / SOUNDCARD_PERIOD_MILLIS;
+    std::vector<BenchScenario> scenarios = {
+        { "idle-silence", 1, [](long) { return false; } },
+        { "continuous-speech", 1, [](long) { return true; } },
+        {
+            "bursty-speech",
+            1,
+            [burstPeriods, quietPeriods](long periodIndex) {
+                return periodIndex % (burstPeriods + quietPeriods) < burstPeriods;
+            }
+        },
+        { "many-sessions", manySessions, [](long) { return true; } },
+    };
+
+    std::stringstream json;
+    json << "{" << std::endl
+         << "  \"benchmark\": \"HikBridgeBench\"," << std::endl
+         << "  \"periodsPerSession\": " << periods << "," << std::endl
+         << "  \"hardwareConcurrency\": " << std::thread::hardware_concurrency() << "," << std::endl
+         << "  \"scenarios\": [" << std::endl;
+    for (size_t i = 0; i < scenarios.size(); i++) {
+        json << runScenario(scenarios[i], periods) << (i + 1 < scenarios.size() ? "," : "") << std::endl;
+    }
+    json << "  ]," << std::endl << "  \"resamplers\": [" << std::endl;
+    std::vector<ResamplerScenario> resamplerScenarios = { { 48000, 8000 }, { 48000, 16000 }, { 44100, 8000 } };
+    std::vector<std::string> resamplerResults;
+    for (auto &scenario : resamplerScenarios) {
+        resamplerResults.push_back(runPolyphaseResampler(scenario, resampleSeconds));
+#ifdef BENCH_WITH_ALSA
+        std::string alsaResult = runAlsaLinearResampler(scenario, resampleSeconds);
+        if (!alsaResult.empty()) {
+            resamplerResults.push_back(alsaResult);
+        }
+#endif
+    }
+    for (size_t i = 0; i < resamplerResults.size(); i++) {
+        json << resamplerResults[i] << (i + 1 < resamplerResults.size() ? "," : "") << std::endl;
+    }
+    json << "  ]," << std::endl << runAlarmDecode(periods) << "," << std::endl;
+
+    bool gateCloses = gateClosesAfterBurst();
+    if (!gateCloses) {
+        failedChecks.push_back("gateClosesAfterBurst");
+    }
+    // A talker the AGC has to turn up and one it has to turn down.
+    bool agcConverges = agcConvergesAfterBurst(2000) && agcConvergesAfterBurst(8000);
+    if (!agcConverges) {
+        failedChecks.push_back("agcConvergesAfterBurst");
+    }
+    json << "  \"checks\": {\"gateClosesAfterBurst\": " << (gateCloses ? "true" : "false")
+         << ", \"agcConvergesAfterBurst\": " << (agcConverges ? "true" : "false") << "}" << std::endl
+         << "}" << std::endl;
+
+    if (outputPath.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream(outputPath) << json.str();
+    }
+    rmdir(recordingDirectory);
+    for (auto &name : allocatingSteadyStates) {
+        std::cerr << name << " allocated after warming up." << std::endl;
+    }
+    for (auto &name : failedChecks) {
+        std::cerr << name << " failed." << std::endl;
+    }
+    return allocatingSteadyStates.empty() && failedChecks.empty() ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+#include "clockDrift.h"
+
+#include <algorithm>
+
+void ClockDriftEstimator::reset() {
+    nextSample = 0;
+    sampleCount = 0;
+    lastSampleAt = -1;
+    driftPpm = 0;
+}
+
+void ClockDriftEstimator::observe(long nowInMillis, long long framePosition) {
+    if (lastSampleAt >= 0 && nowInMillis - lastSampleAt < DRIFT_SAMPLE_INTERVAL_IN_MILLIS) {
+        return;
+    }
+    lastSampleAt = nowInMillis;
+    samples[nextSample] = { nowInMillis, framePosition };
+    nextSample = (nextSample + 1) % DRIFT_WINDOW_SAMPLES;
+    sampleCount = std::min(sampleCount + 1, (size_t) DRIFT_WINDOW_SAMPLES);
+    if (hasEstimate()) {
+        refit();
+    }
+}
+
+// Least squares over the window, relative to its oldest sample so the sums stay small. A single
+// position read is only good to the card's pointer granularity, but the fit over minutes of
+// samples averages that down to a few ppm.
+void ClockDriftEstimator::refit() {
+    const Sample &oldest = samples[sampleCount < DRIFT_WINDOW_SAMPLES ? 0 : nextSample];
+    double sumT = 0, sumY = 0, sumTT = 0, sumTY = 0;
+    for (size_t i = 0; i < sampleCount; i++) {
+        double t = (double) (samples[i].atMillis - oldest.atMillis) / 1000.0;
+        double y = (double) (samples[i].framePosition - oldest.framePosition);
+        sumT += t;
+        sumY += y;
+        sumTT += t * t;
+        sumTY += t * y;
+    }
+    double n = (double) sampleCount;
+    double denominator = n * sumTT - sumT * sumT;
+    if (denominator <= 0) {
+        return;
+    }
+    double framesPerSecond = (n * sumTY - sumT * sumY) / denominator;
+    driftPpm = (framesPerSecond / nominalRate - 1.0) * 1e6;
+}
+
+DriftCorrection DriftCompensator::decide(double driftPpm, long backlogFrames, bool lastPeriodWasSilent) {
+    if (backlogFrames > maxBacklogFrames) {
+        return DriftCorrection::forcedDropFrame;
+    }
+    if (driftPpm < 0) {
+        owedFrames -= driftPpm * 1e-6 * (double) framesPerPeriod;
+    }
+    if (!lastPeriodWasSilent) {
+        return DriftCorrection::none;
+    }
+    if (backlogFrames >= targetBacklogFrames + framesPerPeriod) {
+        return DriftCorrection::dropFrame;
+    }
+    if (owedFrames >= (double) framesPerPeriod && backlogFrames <= targetBacklogFrames) {
+        owedFrames -= (double) framesPerPeriod;
+        return DriftCorrection::insertFrame;
+    }
+    return DriftCorrection::none;
+}
@@ -0,0 +1,67 @@
+#ifndef HIKBRIDGE_CLOCK_DRIFT_H
+#define HIKBRIDGE_CLOCK_DRIFT_H
+
+#include <array>
+#include <cstddef>
+
+// The SDK paces voice talk callbacks off the host clock, while capture is paced by the card's
+// crystal. The estimator fits the card's frame position against the host clock over a sliding
+// window; the slope's departure from the nominal rate is the drift between the two.
+#define DRIFT_SAMPLE_INTERVAL_IN_MILLIS 1000
+#define DRIFT_WINDOW_SAMPLES 300
+#define DRIFT_MIN_SAMPLES_FOR_ESTIMATE 30
+
+class ClockDriftEstimator {
+public:
+    explicit ClockDriftEstimator(unsigned int nominalRate) : nominalRate(nominalRate) {}
+
+    // framePosition is every frame the card has produced: frames read plus frames waiting.
+    void observe(long nowInMillis, long long framePosition);
+    void reset();
+
+    bool hasEstimate() const { return sampleCount >= DRIFT_MIN_SAMPLES_FOR_ESTIMATE; }
+    // Positive when the card runs fast relative to the host.
+    double getDriftPpm() const { return driftPpm; }
+
+private:
+    struct Sample {
+        long atMillis;
+        long long framePosition;
+    };
+
+    void refit();
+
+    unsigned int nominalRate;
+    std::array<Sample, DRIFT_WINDOW_SAMPLES> samples {};
+    size_t nextSample = 0;
+    size_t sampleCount = 0;
+    long lastSampleAt = -1;
+    double driftPpm = 0;
+};
+
+enum class DriftCorrection { none, dropFrame, forcedDropFrame, insertFrame };
+
+// Holds the card's capture backlog at its target depth while voice talk is up. A fast card shows
+// up directly as a growing backlog, so frames are dropped once it's a period over target. A slow
+// card can't push the backlog below zero (capture just blocks and the SDK callback waits), so the
+// estimated drift is accumulated instead and a frame is inserted for every period it owes.
+// Both only happen during silence, unless the backlog is about to overrun.
+class DriftCompensator {
+public:
+    DriftCompensator(long framesPerPeriod, long targetBacklogFrames, long maxBacklogFrames)
+        : framesPerPeriod(framesPerPeriod),
+          targetBacklogFrames(targetBacklogFrames),
+          maxBacklogFrames(maxBacklogFrames) {}
+
+    // Called once per captured period.
+    DriftCorrection decide(double driftPpm, long backlogFrames, bool lastPeriodWasSilent);
+    void reset() { owedFrames = 0; }
+
+private:
+    long framesPerPeriod;
+    long targetBacklogFrames;
+    long maxBacklogFrames;
+    double owedFrames = 0;
+};
+
+#endif //HIKBRIDGE_CLOCK_DRIFT_H
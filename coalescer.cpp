@@ -0,0 +1,15 @@
+#include "coalescer.h"
+
+CoalescedEvent EventCoalescer::admit(std::string_view deviceKey, int alarmType, long windowMillis, long nowInMillis) {
+    std::lock_guard<std::mutex> lk(mutex);
+    auto device = windows.find(deviceKey);
+    if (device == windows.end()) {
+        device = windows.emplace(std::string(deviceKey), std::map<int, Window>()).first;
+    }
+    auto window = device->second.find(alarmType);
+    if (window == device->second.end() || nowInMillis - window->second.openedAt >= windowMillis) {
+        device->second[alarmType] = { nowInMillis, 1 };
+        return { true, 1 };
+    }
+    return { false, ++window->second.occurrences };
+}
@@ -0,0 +1,34 @@
+#ifndef HIKBRIDGE_COALESCER_H
+#define HIKBRIDGE_COALESCER_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+struct CoalescedEvent {
+    // True for the first event of a window, which goes out right away.
+    bool dispatch;
+    // How many times the event has fired in this window, the dispatched one included.
+    unsigned int occurrences;
+};
+
+// Folds repeats of an alarm into the first one. Windows are kept per device and alarm type and
+// run from the event that opened them, so someone leaning on the bell still gets a ring through
+// once per window.
+class EventCoalescer {
+public:
+    CoalescedEvent admit(std::string_view deviceKey, int alarmType, long windowMillis, long nowInMillis);
+
+private:
+    struct Window {
+        long openedAt;
+        unsigned int occurrences;
+    };
+
+    std::mutex mutex;
+    // Keyed by device, then alarm type. Only a device or type seen for the first time allocates.
+    std::map<std::string, std::map<int, Window>, std::less<>> windows;
+};
+
+#endif //HIKBRIDGE_COALESCER_H
@@ -0,0 +1,224 @@
+#include "codec.h"
+
+#include <plog/Log.h>
+#include <algorithm>
+
+// G.722 and G.726 frames are whatever the SDK's encoders consume and produce per call: 40 ms
+// of S16 in, one voice talk packet out.
+static const CodecProfile CODEC_PROFILES[] = {
+    { VoiceCodec::g711MuLaw, "G.711 mu-law", AUDIOTALKTYPE_G711_MU, 8000, 160, 160 },
+    { VoiceCodec::g711ALaw, "G.711 A-law", AUDIOTALKTYPE_G711_A, 8000, 160, 160 },
+    { VoiceCodec::g722, "G.722", AUDIOTALKTYPE_G722, 16000, 640, 80 },
+    { VoiceCodec::g726, "G.726", AUDIOTALKTYPE_G726, 8000, G726_EBCIN_DECOUT_SIZE / 2, G726_ENC_OUT_SIZE },
+};
+
+const CodecProfile &codecProfile(VoiceCodec codec) {
+    for (auto &profile : CODEC_PROFILES) {
+        if (profile.codec == codec) {
+            return profile;
+        }
+    }
+    return CODEC_PROFILES[0];
+}
+
+const CodecProfile *findCodecProfile(BYTE hikAudioEncType) {
+    for (auto &profile : CODEC_PROFILES) {
+        if (profile.hikAudioEncType == hikAudioEncType) {
+            return &profile;
+        }
+    }
+    return nullptr;
+}
+
+// Segment search from the ITU G.711 reference encoder.
+static int g711Segment(int value, const int *segmentEnds) {
+    for (int segment = 0; segment < 8; segment++) {
+        if (value <= segmentEnds[segment]) {
+            return segment;
+        }
+    }
+    return 8;
+}
+
+static unsigned char linearToMuLaw(int sample) {
+    static const int segmentEnds[8] = { 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF };
+    int value = sample >> 2;
+    int mask = 0xFF;
+    if (value < 0) {
+        value = -value;
+        mask = 0x7F;
+    }
+    value = std::min(value, 8159) + (0x84 >> 2);
+    int segment = g711Segment(value, segmentEnds);
+    if (segment >= 8) {
+        return (unsigned char) (0x7F ^ mask);
+    }
+    return (unsigned char) (((segment << 4) | ((value >> (segment + 1)) & 0xF)) ^ mask);
+}
+
+static unsigned char linearToALaw(int sample) {
+    static const int segmentEnds[8] = { 0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF };
+    int value = sample >> 3;
+    int mask = 0xD5;
+    if (value < 0) {
+        value = -value - 1;
+        mask = 0x55;
+    }
+    int segment = g711Segment(value, segmentEnds);
+    if (segment >= 8) {
+        return (unsigned char) (0x7F ^ mask);
+    }
+    int quantized = segment < 2 ? (value >> 1) & 0xF : (value >> segment) & 0xF;
+    return (unsigned char) (((segment << 4) | quantized) ^ mask);
+}
+
+int16_t muLawToLinear(unsigned char muLaw) {
+    muLaw = ~muLaw;
+    int magnitude = (((muLaw & 0xF) << 3) + 0x84) << ((muLaw & 0x70) >> 4);
+    return (int16_t) ((muLaw & 0x80) ? 0x84 - magnitude : magnitude - 0x84);
+}
+
+// mu-law only looks at the top 14 bits of a sample and A-law at the top 13, so both fit in a
+// lookup table indexed by the sample's high bits, and encoding a period is one load per sample.
+struct G711Tables {
+    unsigned char muLaw[1 << 14];
+    unsigned char aLaw[1 << 13];
+
+    G711Tables() {
+        for (int i = 0; i < (1 << 14); i++) {
+            muLaw[i] = linearToMuLaw((int16_t) (i << 2));
+        }
+        for (int i = 0; i < (1 << 13); i++) {
+            aLaw[i] = linearToALaw((int16_t) (i << 3));
+        }
+    }
+};
+
+static const G711Tables g711Tables;
+
+class G711Encoder : public AudioEncoder {
+public:
+    G711Encoder(const CodecProfile &profile, const unsigned char *table, unsigned int ignoredBits)
+        : AudioEncoder(profile), table(table), ignoredBits(ignoredBits) {}
+
+    bool encode(const int16_t *samples, unsigned char *encoded) override {
+        for (size_t i = 0; i < getProfile().samplesPerFrame; i++) {
+            encoded[i] = table[(uint16_t) samples[i] >> ignoredBits];
+        }
+        return true;
+    }
+
+private:
+    const unsigned char *table;
+    unsigned int ignoredBits;
+};
+
+class G722Encoder : public AudioEncoder {
+public:
+    G722Encoder(const CodecProfile &profile, void *handle) : AudioEncoder(profile), handle(handle) {}
+    ~G722Encoder() override { NET_DVR_ReleaseG722Encoder(handle); }
+
+    bool encode(const int16_t *samples, unsigned char *encoded) override {
+        NET_DVR_AUDIOENC_PROCESS_PARAM params = { nullptr };
+        params.in_buf = (unsigned char *) samples;
+        params.out_buf = encoded;
+        return NET_DVR_EncodeG722Frame(handle, &params) && params.out_frame_size == getProfile().encodedFrameBytes;
+    }
+
+private:
+    void *handle;
+};
+
+class G726Encoder : public AudioEncoder {
+public:
+    G726Encoder(const CodecProfile &profile, void *handle, void *module)
+        : AudioEncoder(profile), handle(handle), module(module) {}
+    ~G726Encoder() override { NET_DVR_ReleaseG726Encoder(handle); }
+
+    bool encode(const int16_t *samples, unsigned char *encoded) override {
+        BOOL encoded726 = NET_DVR_EncodeG726Frame(module, (BYTE *) samples, encoded, resetPending ? 1 : 0);
+        resetPending = false;
+        return encoded726;
+    }
+
+    void reset() override { resetPending = true; }
+
+private:
+    void *handle;
+    void *module;
+    bool resetPending = true;
+};
+
+static std::unique_ptr<AudioEncoder> createEncoder(const CodecProfile &profile) {
+    switch (profile.codec) {
+        case VoiceCodec::g711MuLaw:
+            return std::make_unique<G711Encoder>(profile, g711Tables.muLaw, 2);
+        case VoiceCodec::g711ALaw:
+            return std::make_unique<G711Encoder>(profile, g711Tables.aLaw, 3);
+        case VoiceCodec::g722: {
+            NET_DVR_AUDIOENC_INFO encoderInfo = { 0 };
+            void *handle = NET_DVR_InitG722Encoder(&encoderInfo);
+            if (handle == nullptr) {
+                PLOG_ERROR << "The Hik SDK failed to create a G.722 encoder.";
+                return nullptr;
+            }
+            if (encoderInfo.in_frame_size != profile.samplesPerFrame * sizeof(int16_t)) {
+                PLOG_ERROR << "The Hik SDK's G.722 encoder wants " << encoderInfo.in_frame_size
+                           << " byte frames, but capture is set up for " << profile.samplesPerFrame * sizeof(int16_t);
+                NET_DVR_ReleaseG722Encoder(handle);
+                return nullptr;
+            }
+            return std::make_unique<G722Encoder>(profile, handle);
+        }
+        case VoiceCodec::g726: {
+            void *module = nullptr;
+            void *handle = NET_DVR_InitG726Encoder(&module);
+            if (handle == nullptr) {
+                PLOG_ERROR << "The Hik SDK failed to create a G.726 encoder.";
+                return nullptr;
+            }
+            return std::make_unique<G726Encoder>(profile, handle, module);
+        }
+    }
+    return nullptr;
+}
+
+EncoderLease::~EncoderLease() {
+    if (encoder) {
+        pool.release(std::move(encoder));
+    }
+}
+
+EncoderLease EncoderPool::acquire(const CodecProfile &profile) {
+    std::unique_lock<std::mutex> lk(mutex);
+    for (auto it = idle.begin(); it != idle.end(); it++) {
+        if (&(*it)->getProfile() == &profile) {
+            std::unique_ptr<AudioEncoder> encoder = std::move(*it);
+            idle.erase(it);
+            encoder->reset();
+            return { *this, std::move(encoder) };
+        }
+    }
+    unsigned int generation = sessionGeneration;
+    lk.unlock();
+
+    PLOG_INFO << "Creating a " << profile.name << " encoder.";
+    std::unique_ptr<AudioEncoder> encoder = createEncoder(profile);
+    if (encoder) {
+        encoder->sessionGeneration = generation;
+    }
+    return { *this, std::move(encoder) };
+}
+
+void EncoderPool::release(std::unique_ptr<AudioEncoder> encoder) {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (encoder->sessionGeneration == sessionGeneration) {
+        idle.push_back(std::move(encoder));
+    }
+}
+
+void EncoderPool::beginSession() {
+    std::lock_guard<std::mutex> lk(mutex);
+    sessionGeneration++;
+    idle.clear();
+}
@@ -0,0 +1,88 @@
+#ifndef HIKBRIDGE_CODEC_H
+#define HIKBRIDGE_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <HCNetSDK.h>
+
+// The largest frame any codec profile asks capture for (G.722: 40 ms at 16 kHz).
+#define MAX_CODEC_FRAME_SAMPLES 640
+
+enum class VoiceCodec { g711MuLaw, g711ALaw, g722, g726 };
+
+// One voice talk codec the bridge can encode, with the frame geometry the SDK expects for it.
+struct CodecProfile {
+    VoiceCodec codec;
+    const char *name;
+    BYTE hikAudioEncType;
+    unsigned int sampleRate;
+    size_t samplesPerFrame;
+    size_t encodedFrameBytes;
+
+    unsigned int frameMillis() const { return (unsigned int) (samplesPerFrame * 1000 / sampleRate); }
+};
+
+const CodecProfile &codecProfile(VoiceCodec codec);
+// nullptr when the device talks a codec the bridge can't encode.
+const CodecProfile *findCodecProfile(BYTE hikAudioEncType);
+
+int16_t muLawToLinear(unsigned char muLaw);
+
+class AudioEncoder {
+public:
+    explicit AudioEncoder(const CodecProfile &profile) : profile(profile) {}
+    virtual ~AudioEncoder() = default;
+
+    // Encodes profile.samplesPerFrame samples into profile.encodedFrameBytes bytes.
+    virtual bool encode(const int16_t *samples, unsigned char *encoded) = 0;
+    // Called when voice talk starts so ADPCM state doesn't carry over between calls.
+    virtual void reset() {}
+
+    const CodecProfile &getProfile() const { return profile; }
+
+private:
+    friend class EncoderPool;
+
+    const CodecProfile &profile;
+    unsigned int sessionGeneration = 0;
+};
+
+class EncoderPool;
+
+// Returns its encoder to the pool when it goes out of scope.
+class EncoderLease {
+public:
+    EncoderLease(EncoderPool &pool, std::unique_ptr<AudioEncoder> encoder)
+        : pool(pool), encoder(std::move(encoder)) {}
+    EncoderLease(const EncoderLease &) = delete;
+    EncoderLease &operator=(const EncoderLease &) = delete;
+    ~EncoderLease();
+
+    explicit operator bool() const { return encoder != nullptr; }
+    AudioEncoder *operator->() const { return encoder.get(); }
+
+private:
+    EncoderPool &pool;
+    std::unique_ptr<AudioEncoder> encoder;
+};
+
+// Encoders are kept for the lifetime of a device session, so restarting capture or voice talk
+// doesn't go back to the SDK for fresh G.722/G.726 codec state every time.
+class EncoderPool {
+public:
+    // The lease is empty if the SDK failed to create the encoder.
+    EncoderLease acquire(const CodecProfile &profile);
+    void release(std::unique_ptr<AudioEncoder> encoder);
+    // Drops the previous session's encoders. Leased ones are dropped when they come back.
+    void beginSession();
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<AudioEncoder>> idle;
+    unsigned int sessionGeneration = 0;
+};
+
+#endif //HIKBRIDGE_CODEC_H
@@ -0,0 +1,368 @@
+#include "config.h"
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#define CONFIG_WATCH_POLL_MILLIS 100
+// Saving a file is often a burst of events, so they're left to settle before reloading.
+#define CONFIG_WATCH_SETTLE_MILLIS 200
+#define VOICE_CHANNEL_TABLE_PREFIX "voice-channel."
+
+namespace {
+
+struct ConfigValue {
+    enum { string, number, boolean } type;
+    std::string text;
+    double numberValue = 0;
+    bool booleanValue = false;
+};
+
+std::string asString(const ConfigValue &value) {
+    if (value.type != ConfigValue::string) {
+        throw std::runtime_error("expected a quoted string");
+    }
+    return value.text;
+}
+
+double asNumber(const ConfigValue &value) {
+    if (value.type != ConfigValue::number) {
+        throw std::runtime_error("expected a number");
+    }
+    return value.numberValue;
+}
+
+long asWholeNumber(const ConfigValue &value, long min, long max) {
+    double number = asNumber(value);
+    if (number != (double) (long) number || number < (double) min || number > (double) max) {
+        std::stringstream ss;
+        ss << "expected a whole number between " << min << " and " << max;
+        throw std::runtime_error(ss.str());
+    }
+    return (long) number;
+}
+
+bool asBoolean(const ConfigValue &value) {
+    if (value.type != ConfigValue::boolean) {
+        throw std::runtime_error("expected true or false");
+    }
+    return value.booleanValue;
+}
+
+unsigned short asPort(const ConfigValue &value) {
+    return (unsigned short) asWholeNumber(value, 1, 65535);
+}
+
+plog::Severity asSeverity(const ConfigValue &value) {
+    static const char *const SEVERITY_NAMES[] = { "none", "fatal", "error", "warning", "info", "debug", "verbose" };
+    std::string name = asString(value);
+    for (int severity = plog::none; severity <= plog::verbose; severity++) {
+        if (name == SEVERITY_NAMES[severity]) {
+            return (plog::Severity) severity;
+        }
+    }
+    throw std::runtime_error("expected one of none, fatal, error, warning, info, debug or verbose");
+}
+
+struct ConfigKey {
+    const char *table;
+    const char *key;
+    void (*apply)(BridgeConfig &config, const ConfigValue &value);
+};
+
+const ConfigKey CONFIG_KEYS[] = {
+    { "", "log-level", [](BridgeConfig &c, const ConfigValue &v) { c.logLevel = asSeverity(v); } },
+    { "device", "host", [](BridgeConfig &c, const ConfigValue &v) { c.device.host = asString(v); } },
+    { "device", "port", [](BridgeConfig &c, const ConfigValue &v) { c.device.port = asPort(v); } },
+    { "device", "username", [](BridgeConfig &c, const ConfigValue &v) { c.device.username = asString(v); } },
+    { "device", "password", [](BridgeConfig &c, const ConfigValue &v) { c.device.password = asString(v); } },
+    { "capture", "coordinates", [](BridgeConfig &c, const ConfigValue &v) { c.audioCaptureCoordinates = asString(v); } },
+    { "doorbell", "host", [](BridgeConfig &c, const ConfigValue &v) { c.doorbell.host = asString(v); } },
+    { "doorbell", "port", [](BridgeConfig &c, const ConfigValue &v) { c.doorbell.port = asPort(v); } },
+    { "doorbell", "path", [](BridgeConfig &c, const ConfigValue &v) { c.doorbell.path = asString(v); } },
+    { "vad", "silence-threshold", [](BridgeConfig &c, const ConfigValue &v) {
+        c.vad.silenceThreshold = (int) asWholeNumber(v, 0, 32767);
+    } },
+    { "vad", "hangup-after-ms", [](BridgeConfig &c, const ConfigValue &v) {
+        c.vad.hangupAfterMillis = asWholeNumber(v, 0, 3600000);
+    } },
+    { "coalescing", "bell-window-ms", [](BridgeConfig &c, const ConfigValue &v) {
+        c.coalescing.bellWindowMillis = asWholeNumber(v, 0, 3600000);
+    } },
+    { "coalescing", "tamper-window-ms", [](BridgeConfig &c, const ConfigValue &v) {
+        c.coalescing.tamperWindowMillis = asWholeNumber(v, 0, 3600000);
+    } },
+    { "http", "bind", [](BridgeConfig &c, const ConfigValue &v) { c.http.bind = asString(v); } },
+    { "http", "port", [](BridgeConfig &c, const ConfigValue &v) { c.http.port = (unsigned short) asWholeNumber(v, 0, 65535); } },
+    { "listener", "bind", [](BridgeConfig &c, const ConfigValue &v) { c.listener.bind = asString(v); } },
+    { "listener", "port", [](BridgeConfig &c, const ConfigValue &v) {
+        c.listener.port = (unsigned short) asWholeNumber(v, 0, 65535);
+    } },
+    { "announcements", "directory", [](BridgeConfig &c, const ConfigValue &v) { c.announcements.directory = asString(v); } },
+    { "announcements", "bell-clip", [](BridgeConfig &c, const ConfigValue &v) { c.announcements.bellClip = asString(v); } },
+    { "announcements", "mix", [](BridgeConfig &c, const ConfigValue &v) { c.announcements.mix = asBoolean(v); } },
+    { "recording", "directory", [](BridgeConfig &c, const ConfigValue &v) { c.recording.directory = asString(v); } },
+    { "recording", "direct-io", [](BridgeConfig &c, const ConfigValue &v) { c.recording.directIo = asBoolean(v); } },
+    { "recording", "retention-days", [](BridgeConfig &c, const ConfigValue &v) {
+        c.recording.retentionDays = asWholeNumber(v, 0, 36500);
+    } },
+    { "mqtt", "host", [](BridgeConfig &c, const ConfigValue &v) { c.mqtt.host = asString(v); } },
+    { "mqtt", "port", [](BridgeConfig &c, const ConfigValue &v) { c.mqtt.port = asPort(v); } },
+    { "mqtt", "client-id", [](BridgeConfig &c, const ConfigValue &v) { c.mqtt.clientId = asString(v); } },
+    { "mqtt", "username", [](BridgeConfig &c, const ConfigValue &v) { c.mqtt.username = asString(v); } },
+    { "mqtt", "password", [](BridgeConfig &c, const ConfigValue &v) { c.mqtt.password = asString(v); } },
+    { "mqtt", "topic-prefix", [](BridgeConfig &c, const ConfigValue &v) { c.mqtt.topicPrefix = asString(v); } },
+    { "mqtt", "keepalive-seconds", [](BridgeConfig &c, const ConfigValue &v) {
+        c.mqtt.keepaliveSeconds = asWholeNumber(v, 0, 65535);
+    } },
+    { "dsp", "highpass-hz", [](BridgeConfig &c, const ConfigValue &v) { c.dsp.highPassHz = asNumber(v); } },
+    { "dsp", "gate-threshold-dbfs", [](BridgeConfig &c, const ConfigValue &v) { c.dsp.gateThresholdDbfs = asNumber(v); } },
+    { "dsp", "agc-target-dbfs", [](BridgeConfig &c, const ConfigValue &v) { c.dsp.agcTargetDbfs = asNumber(v); } },
+    { "dsp", "agc-max-gain-db", [](BridgeConfig &c, const ConfigValue &v) { c.dsp.agcMaxGainDb = asNumber(v); } },
+    { "dsp", "limiter-ceiling-dbfs", [](BridgeConfig &c, const ConfigValue &v) { c.dsp.limiterCeilingDbfs = asNumber(v); } },
+};
+
+// There's a [voice-channel.N] table per routed channel, so they're matched by prefix rather than
+// listed in CONFIG_KEYS. False for a key they don't have.
+bool applyVoiceRouteSetting(BridgeConfig &config, const std::string &table, const std::string &key, const ConfigValue &value) {
+    std::string number = table.substr(strlen(VOICE_CHANNEL_TABLE_PREFIX));
+    char *end = nullptr;
+    long voiceChannel = std::strtol(number.c_str(), &end, 10);
+    if (number.empty() || *end != '\0' || voiceChannel < 1 || voiceChannel > MAX_DEVICE_VOICE_CHANNEL) {
+        std::stringstream ss;
+        ss << "expected [" << VOICE_CHANNEL_TABLE_PREFIX << "N] with N between 1 and " << MAX_DEVICE_VOICE_CHANNEL;
+        throw std::runtime_error(ss.str());
+    }
+    auto route = std::find_if(config.voiceRoutes.begin(), config.voiceRoutes.end(), [&](const VoiceRoute &r) {
+        return r.voiceChannel == (unsigned int) voiceChannel;
+    });
+    if (route == config.voiceRoutes.end()) {
+        VoiceRoute added;
+        added.voiceChannel = (unsigned int) voiceChannel;
+        route = config.voiceRoutes.insert(config.voiceRoutes.end(), added);
+    }
+    if (key == "source") {
+        route->source = asString(value);
+    } else if (key == "source-channel") {
+        route->sourceChannel = (int) asWholeNumber(value, -1, MAX_CAPTURE_CHANNELS - 1);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// A card is opened either as one mono source or with all its channels, so it can't be both.
+void validateVoiceRoutes(const BridgeConfig &config) {
+    for (auto &route : config.voiceRoutes) {
+        if (route.source.empty()) {
+            throw std::runtime_error("[" VOICE_CHANNEL_TABLE_PREFIX + std::to_string(route.voiceChannel) + "] needs a source");
+        }
+    }
+    std::vector<VoiceRoute> routes = effectiveVoiceRoutes(config);
+    if (routes.size() > MAX_VOICE_ROUTES) {
+        throw std::runtime_error("at most " + std::to_string(MAX_VOICE_ROUTES) + " voice channels can be routed");
+    }
+    std::vector<std::string> sources;
+    for (auto &route : routes) {
+        if (std::find(sources.begin(), sources.end(), route.source) == sources.end()) {
+            sources.push_back(route.source);
+        }
+        for (auto &other : routes) {
+            if (other.source == route.source && (other.sourceChannel < 0) != (route.sourceChannel < 0)) {
+                throw std::runtime_error(route.source + " is routed both as a mono source and by channel");
+            }
+        }
+    }
+    if (sources.size() > MAX_CAPTURE_SOURCES) {
+        throw std::runtime_error("voice channels can come from at most " + std::to_string(MAX_CAPTURE_SOURCES) + " capture sources");
+    }
+}
+
+std::string trim(const std::string &text) {
+    size_t start = text.find_first_not_of(" \t\r");
+    if (start == std::string::npos) {
+        return "";
+    }
+    return text.substr(start, text.find_last_not_of(" \t\r") - start + 1);
+}
+
+// Everything after the value is only allowed to be a comment.
+void expectEndOfLine(const std::string &rest) {
+    std::string remainder = trim(rest);
+    if (!remainder.empty() && remainder[0] != '#') {
+        throw std::runtime_error("unexpected text after the value");
+    }
+}
+
+ConfigValue parseValue(const std::string &text) {
+    ConfigValue value { ConfigValue::string };
+    if (!text.empty() && text[0] == '"') {
+        size_t i = 1;
+        for (; i < text.size() && text[i] != '"'; i++) {
+            if (text[i] == '\\' && i + 1 < text.size()) {
+                char escaped = text[++i];
+                value.text += escaped == 'n' ? '\n' : escaped == 't' ? '\t' : escaped;
+            } else {
+                value.text += text[i];
+            }
+        }
+        if (i == text.size()) {
+            throw std::runtime_error("unterminated string");
+        }
+        expectEndOfLine(text.substr(i + 1));
+        return value;
+    }
+
+    std::string bare = trim(text.substr(0, text.find('#')));
+    if (bare == "true" || bare == "false") {
+        value.type = ConfigValue::boolean;
+        value.booleanValue = bare == "true";
+        return value;
+    }
+    std::string digits = bare;
+    digits.erase(std::remove(digits.begin(), digits.end(), '_'), digits.end());
+    char *end = nullptr;
+    errno = 0;
+    value.numberValue = std::strtod(digits.c_str(), &end);
+    if (digits.empty() || *end != '\0' || errno != 0) {
+        throw std::runtime_error("expected a quoted string, a number or a boolean");
+    }
+    value.type = ConfigValue::number;
+    return value;
+}
+
+}
+
+void applyConfigFile(const std::string &path, BridgeConfig &config) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Can't read the config file " + path + ": " + strerror(errno));
+    }
+
+    // Applied to a copy, so a bad file leaves config untouched.
+    BridgeConfig updated = config;
+    std::string table;
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+        try {
+            std::string content = trim(line);
+            if (content.empty() || content[0] == '#') {
+                continue;
+            }
+            if (content[0] == '[') {
+                size_t close = content.find(']');
+                if (close == std::string::npos) {
+                    throw std::runtime_error("unterminated table header");
+                }
+                expectEndOfLine(content.substr(close + 1));
+                table = trim(content.substr(1, close - 1));
+                continue;
+            }
+
+            size_t equals = content.find('=');
+            if (equals == std::string::npos) {
+                throw std::runtime_error("expected key = value");
+            }
+            std::string key = trim(content.substr(0, equals));
+            ConfigValue value = parseValue(trim(content.substr(equals + 1)));
+            if (table.compare(0, strlen(VOICE_CHANNEL_TABLE_PREFIX), VOICE_CHANNEL_TABLE_PREFIX) == 0) {
+                if (!applyVoiceRouteSetting(updated, table, key, value)) {
+                    PLOG_WARNING << path << ":" << lineNumber << ": ignoring unknown setting " << table << "." << key;
+                }
+                continue;
+            }
+            auto configKey = std::find_if(std::begin(CONFIG_KEYS), std::end(CONFIG_KEYS), [&](const ConfigKey &k) {
+                return table == k.table && key == k.key;
+            });
+            if (configKey == std::end(CONFIG_KEYS)) {
+                PLOG_WARNING << path << ":" << lineNumber << ": ignoring unknown setting "
+                             << (table.empty() ? "" : table + ".") << key;
+                continue;
+            }
+            configKey->apply(updated, value);
+        } catch (const std::runtime_error &e) {
+            std::stringstream ss;
+            ss << path << ":" << lineNumber << ": " << e.what();
+            throw std::runtime_error(ss.str());
+        }
+    }
+    try {
+        validateVoiceRoutes(updated);
+    } catch (const std::runtime_error &e) {
+        throw std::runtime_error(path + ": " + e.what());
+    }
+    config = std::move(updated);
+}
+
+std::vector<VoiceRoute> effectiveVoiceRoutes(const BridgeConfig &config) {
+    std::vector<VoiceRoute> routes = config.voiceRoutes;
+    bool channelOneRouted = std::any_of(routes.begin(), routes.end(), [](const VoiceRoute &route) {
+        return route.voiceChannel == 1;
+    });
+    if (!channelOneRouted && !config.audioCaptureCoordinates.empty()) {
+        VoiceRoute capture;
+        capture.source = config.audioCaptureCoordinates;
+        routes.push_back(capture);
+    }
+    std::sort(routes.begin(), routes.end(), [](const VoiceRoute &a, const VoiceRoute &b) {
+        return a.voiceChannel < b.voiceChannel;
+    });
+    return routes;
+}
+
+std::shared_ptr<const BridgeConfig> ConfigStore::get() const {
+    std::lock_guard<std::mutex> lk(mutex);
+    return current;
+}
+
+std::shared_ptr<const BridgeConfig> ConfigStore::replace(BridgeConfig next) {
+    auto replacement = std::make_shared<const BridgeConfig>(std::move(next));
+    std::lock_guard<std::mutex> lk(mutex);
+    std::swap(current, replacement);
+    generation.fetch_add(1, std::memory_order_release);
+    return replacement;
+}
+
+[[noreturn]] void watchConfigFile(
+    const std::string &path,
+    SupervisedSubsystem &subsystem,
+    const std::function<void()> &onChange
+) {
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+
+    int inotifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotifyFd < 0) {
+        throw SubsystemFault(std::string("Failed to start inotify: ") + strerror(errno));
+    }
+    std::unique_ptr<int, void (*)(int *)> inotifyCloser(&inotifyFd, [](int *fd) { close(*fd); });
+    if (inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        throw SubsystemFault("Failed to watch " + directory + " for config changes: " + strerror(errno));
+    }
+    PLOG_INFO << "Watching " << path << " for config changes.";
+    subsystem.markHealthy();
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    pollfd pollFd { inotifyFd, POLLIN, 0 };
+    while (true) {
+        subsystem.checkForFault();
+        int ready = poll(&pollFd, 1, CONFIG_WATCH_POLL_MILLIS);
+        if (ready < 0 && errno != EINTR) {
+            throw SubsystemFault(std::string("Failed waiting for config changes: ") + strerror(errno));
+        } else if (ready <= 0) {
+            continue;
+        }
+
+        do {
+            usleep(CONFIG_WATCH_SETTLE_MILLIS * 1000);
+        } while (read(inotifyFd, events, sizeof(events)) > 0);
+        onChange();
+    }
+}
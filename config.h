@@ -0,0 +1,197 @@
+#ifndef HIKBRIDGE_CONFIG_H
+#define HIKBRIDGE_CONFIG_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <plog/Log.h>
+#include "audioPipeline.h"
+#include "dsp.h"
+#include "supervisor.h"
+
+struct DeviceCoordinates {
+    std::string host;
+    unsigned short port = 0;
+    std::string username = "admin";
+    std::string password;
+
+    bool operator==(const DeviceCoordinates &other) const {
+        return host == other.host && port == other.port && username == other.username && password == other.password;
+    }
+    bool operator!=(const DeviceCoordinates &other) const { return !(*this == other); }
+};
+
+struct WebhookTarget {
+    std::string host;
+    unsigned short port = 0;
+    std::string path;
+
+    bool operator==(const WebhookTarget &other) const {
+        return host == other.host && port == other.port && path == other.path;
+    }
+    bool operator!=(const WebhookTarget &other) const { return !(*this == other); }
+};
+
+struct VadConfig {
+    // Periods whose samples all stay within this of zero count as silence.
+    int silenceThreshold = 0;
+    long hangupAfterMillis = MILLIS_OF_SILENCE_BEFORE_HANGUP;
+
+    bool operator==(const VadConfig &other) const {
+        return silenceThreshold == other.silenceThreshold && hangupAfterMillis == other.hangupAfterMillis;
+    }
+    bool operator!=(const VadConfig &other) const { return !(*this == other); }
+};
+
+// Repeats of an alarm within its window are folded into the first. 0 turns coalescing off.
+struct CoalescingConfig {
+    long bellWindowMillis = 10000;
+    long tamperWindowMillis = 5000;
+
+    bool operator==(const CoalescingConfig &other) const {
+        return bellWindowMillis == other.bellWindowMillis && tamperWindowMillis == other.tamperWindowMillis;
+    }
+    bool operator!=(const CoalescingConfig &other) const { return !(*this == other); }
+};
+
+// The embedded HTTP server behind /events, /metrics and the door API. Port 0 turns it off.
+struct HttpConfig {
+    std::string bind = "0.0.0.0";
+    unsigned short port = 8090;
+
+    bool operator==(const HttpConfig &other) const { return bind == other.bind && port == other.port; }
+    bool operator!=(const HttpConfig &other) const { return !(*this == other); }
+};
+
+// Where devices push their alarms to, instead of each being armed over its own session. Port 0
+// turns the listener off and arms the device as before. Pushed alarms are told apart by IP, so
+// only those from the device's host act on its voice talk.
+struct ListenerConfig {
+    std::string bind = "0.0.0.0";
+    unsigned short port = 0;
+
+    bool operator==(const ListenerConfig &other) const { return bind == other.bind && port == other.port; }
+    bool operator!=(const ListenerConfig &other) const { return !(*this == other); }
+};
+
+// The MQTT broker to publish events and bridge state to. An empty host turns MQTT off.
+struct MqttConfig {
+    std::string host;
+    unsigned short port = 1883;
+    std::string clientId = "hikbridge";
+    std::string username;
+    std::string password;
+    std::string topicPrefix = "hikbridge";
+    long keepaliveSeconds = 30;
+
+    bool operator==(const MqttConfig &other) const {
+        return host == other.host && port == other.port && clientId == other.clientId
+            && username == other.username && password == other.password && topicPrefix == other.topicPrefix
+            && keepaliveSeconds == other.keepaliveSeconds;
+    }
+    bool operator!=(const MqttConfig &other) const { return !(*this == other); }
+};
+
+// Everything that used to need a restart to change.
+// Clips are the *.wav files in directory, played by their name without the extension. An empty
+// bell-clip plays nothing on a bell press.
+struct AnnouncementsConfig {
+    std::string directory;
+    std::string bellClip;
+    bool mix = false;
+
+    bool operator==(const AnnouncementsConfig &other) const {
+        return directory == other.directory && bellClip == other.bellClip && mix == other.mix;
+    }
+    bool operator!=(const AnnouncementsConfig &other) const { return !(*this == other); }
+};
+
+// An empty directory turns recording off, and 0 retention days keeps recordings forever.
+struct RecordingConfig {
+    std::string directory;
+    bool directIo = false;
+    long retentionDays = 30;
+
+    bool operator==(const RecordingConfig &other) const {
+        return directory == other.directory && directIo == other.directIo && retentionDays == other.retentionDays;
+    }
+    bool operator!=(const RecordingConfig &other) const { return !(*this == other); }
+};
+
+// Each routed voice channel gets its own voice talk callback heartbeat and each source its own
+// capture subsystem, so these have to match heartbeat.h.
+#define MAX_VOICE_ROUTES 4
+#define MAX_CAPTURE_SOURCES 4
+// The most channels HikBridge will open a multichannel card with.
+#define MAX_CAPTURE_CHANNELS 16
+#define MAX_DEVICE_VOICE_CHANNEL 64
+
+// Where one of the device's voice channels (dwVoiceChan) gets its audio: a whole ALSA device, or
+// one channel of a multichannel card. Routes from the same card share its capture.
+struct VoiceRoute {
+    unsigned int voiceChannel = 1;
+    std::string source;
+    // -1 takes the source as a mono device.
+    int sourceChannel = -1;
+
+    bool operator==(const VoiceRoute &other) const {
+        return voiceChannel == other.voiceChannel && source == other.source && sourceChannel == other.sourceChannel;
+    }
+    bool operator!=(const VoiceRoute &other) const { return !(*this == other); }
+};
+
+struct BridgeConfig {
+    DeviceCoordinates device;
+    std::string audioCaptureCoordinates;
+    // The [voice-channel.N] tables. audioCaptureCoordinates feeds voice channel 1 unless one of
+    // these routes it.
+    std::vector<VoiceRoute> voiceRoutes;
+    WebhookTarget doorbell;
+    VadConfig vad;
+    CoalescingConfig coalescing;
+    HttpConfig http;
+    MqttConfig mqtt;
+    ListenerConfig listener;
+    AnnouncementsConfig announcements;
+    RecordingConfig recording;
+    DspConfig dsp;
+    plog::Severity logLevel = plog::info;
+};
+
+// Overlays the file at path onto config. The file is the subset of TOML HikBridge needs:
+// [tables] of key = value, with quoted strings, numbers and booleans. Throws std::runtime_error
+// naming the offending line.
+void applyConfigFile(const std::string &path, BridgeConfig &config);
+
+// Every voice channel audio is routed to, ordered by voice channel. The first is the primary one,
+// which announcements and recordings follow.
+std::vector<VoiceRoute> effectiveVoiceRoutes(const BridgeConfig &config);
+
+// Holds the live config. Readers keep the snapshot they got for as long as they need it, and the
+// generation lets a hot loop notice a change without taking the lock every time.
+class ConfigStore {
+public:
+    std::shared_ptr<const BridgeConfig> get() const;
+    // Returns the config being replaced.
+    std::shared_ptr<const BridgeConfig> replace(BridgeConfig next);
+    unsigned long getGeneration() const { return generation.load(std::memory_order_acquire); }
+
+private:
+    mutable std::mutex mutex;
+    std::shared_ptr<const BridgeConfig> current = std::make_shared<BridgeConfig>();
+    std::atomic<unsigned long> generation {0};
+};
+
+// Watches the directory holding the config file, so editors that save by renaming and
+// ConfigMap-style symlink swaps are both seen. Calls onChange after every write, move or create
+// there; it's up to onChange to notice nothing actually changed.
+[[noreturn]] void watchConfigFile(
+    const std::string &path,
+    SupervisedSubsystem &subsystem,
+    const std::function<void()> &onChange
+);
+
+#endif //HIKBRIDGE_CONFIG_H
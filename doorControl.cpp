@@ -0,0 +1,176 @@
+#include "doorControl.h"
+
+#include <chrono>
+#include <plog/Log.h>
+#include <sstream>
+#include "eventStream.h"
+#include "heartbeat.h"
+#include "metrics.h"
+
+#define DOOR_WORKER_TICK_MILLIS 100
+
+static Histogram &openLatency() {
+    static Histogram &histogram = metrics().histogram(
+        "hikbridge_door_open_latency_ms",
+        "Time from an unlock being requested to the device confirming it.",
+        LATENCY_BUCKETS_IN_MILLIS
+    );
+    return histogram;
+}
+
+static Counter &failedOpens() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_door_open_failures_total",
+        "Unlocks the device refused or that couldn't be sent."
+    );
+    return counter;
+}
+
+static std::shared_future<DoorCommandResult> failedResult(const std::string &reason) {
+    std::promise<DoorCommandResult> promise;
+    promise.set_value({ false, reason, 0 });
+    return promise.get_future().share();
+}
+
+std::shared_future<DoorCommandResult> DoorCommandWorker::requestOpen(int lockId, const std::string &idempotencyKey) {
+    std::lock_guard<std::mutex> lk(mutex);
+    long now = heartbeatClockInMillis();
+    forgetExpiredKeys(now);
+    if (!idempotencyKey.empty()) {
+        auto remembered = idempotencyKeys.find({ lockId, idempotencyKey });
+        if (remembered != idempotencyKeys.end()) {
+            PLOG_INFO << "Answering a repeated unlock of lock <" << lockId << "> from its idempotency key.";
+            return remembered->second.result;
+        }
+    }
+    if (!running) {
+        return failedResult("The device session isn't up.");
+    }
+
+    std::deque<PendingOpen> &pending = pendingByLock[lockId];
+    pending.push_back({ std::promise<DoorCommandResult>(), now });
+    std::shared_future<DoorCommandResult> result = pending.back().promise.get_future().share();
+    if (!idempotencyKey.empty()) {
+        if (idempotencyKeys.size() >= MAX_DOOR_IDEMPOTENCY_KEYS) {
+            auto oldest = idempotencyKeys.begin();
+            for (auto key = idempotencyKeys.begin(); key != idempotencyKeys.end(); key++) {
+                if (key->second.expiresAt < oldest->second.expiresAt) {
+                    oldest = key;
+                }
+            }
+            idempotencyKeys.erase(oldest);
+        }
+        idempotencyKeys[{ lockId, idempotencyKey }] = { result, now + DOOR_IDEMPOTENCY_TTL_MILLIS };
+    }
+    cv.notify_one();
+    return result;
+}
+
+void DoorCommandWorker::forgetExpiredKeys(long now) {
+    for (auto key = idempotencyKeys.begin(); key != idempotencyKeys.end();) {
+        key = key->second.expiresAt <= now ? idempotencyKeys.erase(key) : std::next(key);
+    }
+}
+
+void DoorCommandWorker::failPending(const std::string &reason) {
+    std::lock_guard<std::mutex> lk(mutex);
+    running = false;
+    for (auto &lock : pendingByLock) {
+        for (PendingOpen &pending : lock.second) {
+            pending.promise.set_value({ false, reason, heartbeatClockInMillis() - pending.requestedAt });
+        }
+    }
+    pendingByLock.clear();
+}
+
+[[noreturn]] void DoorCommandWorker::run(
+    SupervisedSubsystem &subsystem,
+    const std::function<std::string(int lockId)> &open
+) {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        running = true;
+    }
+    subsystem.markHealthy();
+    try {
+        while (true) {
+            subsystem.checkForFault();
+            std::unique_lock<std::mutex> lk(mutex);
+            cv.wait_for(lk, std::chrono::milliseconds(DOOR_WORKER_TICK_MILLIS), [this] {
+                return !pendingByLock.empty();
+            });
+            if (pendingByLock.empty()) {
+                continue;
+            }
+
+            // Round robin, so a lock that keeps getting requests can't starve the others.
+            auto next = pendingByLock.upper_bound(lastLockServed);
+            if (next == pendingByLock.end()) {
+                next = pendingByLock.begin();
+            }
+            int lockId = next->first;
+            std::deque<PendingOpen> batch = std::move(next->second);
+            pendingByLock.erase(next);
+            lastLockServed = lockId;
+            lk.unlock();
+
+            std::string error;
+            try {
+                error = open(lockId);
+            } catch (const std::exception &e) {
+                error = e.what();
+                for (PendingOpen &pending : batch) {
+                    pending.promise.set_value({ false, error, heartbeatClockInMillis() - pending.requestedAt });
+                }
+                throw;
+            }
+            if (error.empty()) {
+                PLOG_INFO << "Opened lock <" << lockId << "> for " << batch.size() << " request(s).";
+            } else {
+                PLOG_WARNING << "Failed to open lock <" << lockId << ">: " << error;
+                failedOpens().increment();
+            }
+            long now = heartbeatClockInMillis();
+            for (PendingOpen &pending : batch) {
+                openLatency().observe((double) (now - pending.requestedAt));
+                pending.promise.set_value({ error.empty(), error, now - pending.requestedAt });
+            }
+        }
+    } catch (...) {
+        failPending("Door control restarted before getting to this request.");
+        throw;
+    }
+}
+
+void addDoorControlRoutes(httplib::Server &server, DoorCommandWorker &worker) {
+    server.Post(R"(/door/(\d+)/open)", [&worker](const httplib::Request &req, httplib::Response &res) {
+        int lockId;
+        try {
+            lockId = std::stoi(req.matches[1]);
+        } catch (const std::exception &) {
+            res.status = 400;
+            res.set_content("{\"error\":\"No such lock.\"}", "application/json");
+            return;
+        }
+
+        std::string idempotencyKey = req.get_header_value("Idempotency-Key");
+        std::shared_future<DoorCommandResult> result = worker.requestOpen(lockId, idempotencyKey);
+        if (result.wait_for(std::chrono::milliseconds(DOOR_OPEN_TIMEOUT_MILLIS)) != std::future_status::ready) {
+            res.status = 504;
+            res.set_content("{\"error\":\"The device hasn't answered yet.\"}", "application/json");
+            return;
+        }
+
+        const DoorCommandResult &outcome = result.get();
+        std::stringstream json;
+        json << "{\"lockId\":" << lockId
+             << ",\"opened\":" << (outcome.opened ? "true" : "false")
+             << ",\"latencyMs\":" << outcome.latencyMillis;
+        if (!outcome.opened) {
+            json << ",\"error\":\"" << jsonEscape(outcome.error) << "\"";
+        }
+        json << "}";
+        res.status = outcome.opened ? 200 : 502;
+        res.set_content(json.str(), "application/json");
+    });
+}
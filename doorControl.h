@@ -0,0 +1,66 @@
+#ifndef HIKBRIDGE_DOOR_CONTROL_H
+#define HIKBRIDGE_DOOR_CONTROL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include "cpp-httplib/httplib.h"
+#include "supervisor.h"
+
+#define DOOR_CONTROL_SUBSYSTEM "door-control"
+// How long a repeated Idempotency-Key gets the first request's answer instead of a new unlock.
+#define DOOR_IDEMPOTENCY_TTL_MILLIS 300000
+#define MAX_DOOR_IDEMPOTENCY_KEYS 1024
+// The HTTP request gives up waiting on the worker after this, though the unlock may still happen.
+#define DOOR_OPEN_TIMEOUT_MILLIS 3000
+
+struct DoorCommandResult {
+    bool opened;
+    std::string error;
+    long latencyMillis;
+};
+
+// Runs door commands on their own thread over the device session that's already logged in, so an
+// unlock costs one SDK round trip. Requests queue per lock, and everything queued for a lock when
+// the worker gets to it is answered by a single unlock, since opening a door twice in a row does
+// nothing more than opening it once.
+class DoorCommandWorker {
+public:
+    // idempotencyKey may be empty.
+    std::shared_future<DoorCommandResult> requestOpen(int lockId, const std::string &idempotencyKey);
+
+    // open returns an empty string on success, and otherwise why it failed.
+    [[noreturn]] void run(SupervisedSubsystem &subsystem, const std::function<std::string(int lockId)> &open);
+
+private:
+    struct PendingOpen {
+        std::promise<DoorCommandResult> promise;
+        long requestedAt;
+    };
+    struct RememberedKey {
+        std::shared_future<DoorCommandResult> result;
+        long expiresAt;
+    };
+
+    void forgetExpiredKeys(long now);
+    void failPending(const std::string &reason);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<int, std::deque<PendingOpen>> pendingByLock;
+    // By lock and key, so a key reused against another lock doesn't get this lock's answer.
+    std::map<std::pair<int, std::string>, RememberedKey> idempotencyKeys;
+    // Where the round robin over locks left off.
+    int lastLockServed = -1;
+    bool running = false;
+};
+
+// POST /door/{lockId}/open, honouring an Idempotency-Key header.
+void addDoorControlRoutes(httplib::Server &server, DoorCommandWorker &worker);
+
+#endif //HIKBRIDGE_DOOR_CONTROL_H
@@ -0,0 +1,258 @@
+#include "dsp.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <tuple>
+
+#define GATE_ATTACK_MILLIS 1
+#define GATE_RELEASE_MILLIS 100
+#define GATE_HOLD_MILLIS 50
+// The gate's envelope keeps this many fractional bits, so its decay doesn't stall a few LSBs
+// above zero, well over the close threshold of a quiet gate.
+#define GATE_ENVELOPE_FRACTION_BITS 8
+// A closed gate attenuates rather than mutes, so the far end still hears that the line is live.
+#define GATE_FLOOR_DB (-30.0)
+#define AGC_LOOKAHEAD_MILLIS 4
+#define AGC_MAX_LOOKAHEAD_SAMPLES 64
+// Frames quieter than this don't move the AGC, so background hiss isn't pumped up between words.
+#define AGC_NOISE_FLOOR_DBFS (-50.0)
+#define AGC_MIN_GAIN_DB (-12.0)
+// The AGC's gain keeps this many fractional bits below Q12, so its slow recovery step doesn't
+// truncate to zero half a linear gain short of the target.
+#define AGC_GAIN_FRACTION_BITS 8
+// Keeps the gain and its fraction bits inside an int32_t whatever the config asks for.
+#define AGC_GAIN_CAP_DB 48.0
+#define Q12_ONE 4096
+#define Q15_ONE 32767
+
+static int16_t saturate(int64_t sample) {
+    return (int16_t) std::clamp<int64_t>(sample, -32768, 32767);
+}
+
+static int32_t dbfsToLinear(double dbfs) {
+    return (int32_t) std::lround(32767.0 * std::pow(10.0, dbfs / 20.0));
+}
+
+static int32_t dbToQ12(double db) {
+    return (int32_t) std::lround(Q12_ONE * std::pow(10.0, db / 20.0));
+}
+
+// Written as a plain reduction so the compiler vectorises it with NEON or SSE.
+static int64_t sumOfMagnitudes(const int16_t *__restrict samples, size_t count) {
+    int32_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += std::abs((int32_t) samples[i]);
+    }
+    return sum;
+}
+
+// RBJ high-pass biquad with Q28 coefficients. The truncation error is fed back into the next
+// sample, which keeps a 100 Hz corner at 8 kHz from drifting into low-level noise.
+class HighPassStage {
+public:
+    HighPassStage(const DspConfig &config, unsigned int sampleRate) : cornerHz(config.highPassHz) {
+        double w0 = 2 * M_PI * config.highPassHz / sampleRate;
+        double alpha = std::sin(w0) / (2 * M_SQRT1_2);
+        double a0 = 1 + alpha;
+        auto toQ28 = [a0](double coefficient) { return (int64_t) std::llround(coefficient / a0 * (1 << 28)); };
+        b0 = toQ28((1 + std::cos(w0)) / 2);
+        b1 = toQ28(-(1 + std::cos(w0)));
+        b2 = b0;
+        a1 = toQ28(-2 * std::cos(w0));
+        a2 = toQ28(1 - alpha);
+    }
+
+    void process(int16_t *samples, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            int64_t x = samples[i];
+            int64_t accumulator = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2 + error;
+            int64_t y = accumulator >> 28;
+            error = accumulator - (y << 28);
+            x2 = x1;
+            x1 = x;
+            y2 = y1;
+            y1 = y;
+            samples[i] = saturate(y);
+        }
+    }
+
+    void describe(std::ostream &out) const { out << "high-pass " << cornerHz << " Hz"; }
+
+private:
+    double cornerHz;
+    int64_t b0, b1, b2, a1, a2;
+    int64_t x1 = 0, x2 = 0, y1 = 0, y2 = 0, error = 0;
+};
+
+// Peak-envelope gate with hysteresis and a hold so it doesn't chatter between syllables.
+class NoiseGateStage {
+public:
+    NoiseGateStage(const DspConfig &config, unsigned int sampleRate)
+        : thresholdDbfs(config.gateThresholdDbfs),
+          openThreshold(dbfsToLinear(config.gateThresholdDbfs) << GATE_ENVELOPE_FRACTION_BITS),
+          closeThreshold(openThreshold / 2),
+          floorGain(dbfsToLinear(GATE_FLOOR_DB)),
+          attackStep(std::max(1, (int32_t) (Q15_ONE * 1000L / (sampleRate * GATE_ATTACK_MILLIS)))),
+          releaseStep(std::max(1, (int32_t) ((Q15_ONE - floorGain) * 1000L / (sampleRate * GATE_RELEASE_MILLIS)))),
+          holdSamples((int32_t) (sampleRate * GATE_HOLD_MILLIS / 1000)),
+          gain(floorGain) {}
+
+    void process(int16_t *samples, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            int32_t magnitude = std::abs((int32_t) samples[i]) << GATE_ENVELOPE_FRACTION_BITS;
+            envelope = std::max(magnitude, envelope - (envelope >> 8) - 1);
+            if (envelope >= openThreshold) {
+                open = true;
+                holdRemaining = holdSamples;
+            } else if (envelope < closeThreshold) {
+                if (holdRemaining > 0) {
+                    holdRemaining--;
+                } else {
+                    open = false;
+                }
+            }
+            gain = open ? std::min(Q15_ONE, gain + attackStep) : std::max(floorGain, gain - releaseStep);
+            samples[i] = (int16_t) ((samples[i] * gain) >> 15);
+        }
+    }
+
+    void describe(std::ostream &out) const { out << "noise gate " << thresholdDbfs << " dBFS"; }
+
+private:
+    double thresholdDbfs;
+    int32_t openThreshold;
+    int32_t closeThreshold;
+    int32_t floorGain;
+    int32_t attackStep;
+    int32_t releaseStep;
+    int32_t holdSamples;
+    int32_t gain;
+    // Peak envelope with GATE_ENVELOPE_FRACTION_BITS fractional bits, as are both thresholds.
+    int32_t envelope = 0;
+    int32_t holdRemaining = 0;
+    bool open = false;
+};
+
+// Frame-level AGC towards a target average level, followed by a look-ahead peak limiter. The
+// output runs AGC_LOOKAHEAD_MILLIS behind the input, so the limiter sees a peak coming before it
+// has to turn the gain down, and the intercom's speaker never gets a clipped edge.
+class AgcLimiterStage {
+public:
+    AgcLimiterStage(const DspConfig &config, unsigned int sampleRate)
+        : targetDbfs(config.agcTargetDbfs),
+          maxGainDb(config.agcMaxGainDb),
+          ceilingDbfs(config.limiterCeilingDbfs),
+          targetLevel(dbfsToLinear(config.agcTargetDbfs)),
+          noiseFloor(dbfsToLinear(AGC_NOISE_FLOOR_DBFS)),
+          ceiling(dbfsToLinear(config.limiterCeilingDbfs)),
+          minGain(dbToQ12(AGC_MIN_GAIN_DB)),
+          maxGain(dbToQ12(std::min(config.agcMaxGainDb, AGC_GAIN_CAP_DB))),
+          lookahead(std::min<size_t>(AGC_MAX_LOOKAHEAD_SAMPLES, sampleRate * AGC_LOOKAHEAD_MILLIS / 1000)) {}
+
+    void process(int16_t *samples, size_t count) {
+        int64_t level = sumOfMagnitudes(samples, count) / (int64_t) std::max<size_t>(count, 1);
+        if (level > noiseFloor) {
+            desiredGain = (int32_t) std::clamp<int64_t>(targetLevel * Q12_ONE / level, minGain, maxGain);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            int32_t delayed = delayLine[delayIndex];
+            delayLine[delayIndex] = samples[i];
+            delayIndex = (delayIndex + 1) % lookahead;
+
+            // Gain falls within a few ms of a loud onset and recovers over a quarter second. Every
+            // gap moves it by at least one step, so it settles on the target rather than short of it.
+            int32_t gap = (desiredGain << AGC_GAIN_FRACTION_BITS) - gain;
+            gain += (gap >> (gap < 0 ? 6 : 11)) + (gap > 0);
+
+            int32_t peak = std::abs(delayed);
+            for (size_t j = 0; j < lookahead; j++) {
+                peak = std::max(peak, std::abs(delayLine[j]));
+            }
+            int64_t appliedGain = gain >> AGC_GAIN_FRACTION_BITS;
+            if (peak > 0 && ((int64_t) peak * appliedGain) / Q12_ONE > ceiling) {
+                appliedGain = (int64_t) ceiling * Q12_ONE / peak;
+            }
+            samples[i] = saturate(((int64_t) delayed * appliedGain) / Q12_ONE);
+        }
+    }
+
+    void describe(std::ostream &out) const {
+        out << "AGC " << targetDbfs << " dBFS (max +" << maxGainDb << " dB) with a " << ceilingDbfs << " dBFS limiter";
+    }
+
+private:
+    double targetDbfs;
+    double maxGainDb;
+    double ceilingDbfs;
+    int64_t targetLevel;
+    int64_t noiseFloor;
+    int32_t ceiling;
+    int32_t minGain;
+    int32_t maxGain;
+    size_t lookahead;
+    std::array<int32_t, AGC_MAX_LOOKAHEAD_SAMPLES> delayLine {};
+    size_t delayIndex = 0;
+    int32_t desiredGain = Q12_ONE;
+    // Q12 with AGC_GAIN_FRACTION_BITS more fractional bits.
+    int32_t gain = Q12_ONE << AGC_GAIN_FRACTION_BITS;
+};
+
+// The stages are a tuple fixed at compile time, so the per-frame call inlines every enabled
+// stage and there's nothing left of a disabled one.
+template <typename... Stages>
+class DspChain : public FrameProcessor {
+public:
+    explicit DspChain(Stages... stages) : stages(std::move(stages)...) {}
+
+    void process(int16_t *samples, size_t count) override {
+        std::apply([samples, count](auto &... stage) { (stage.process(samples, count), ...); }, stages);
+    }
+
+    std::string describe() const override {
+        std::stringstream ss;
+        const char *separator = "";
+        std::apply([&ss, &separator](auto &... stage) {
+            ((ss << separator, stage.describe(ss), separator = " -> "), ...);
+        }, stages);
+        return ss.str();
+    }
+
+private:
+    std::tuple<Stages...> stages;
+};
+
+template <typename... Enabled>
+static std::unique_ptr<FrameProcessor> finishChain(Enabled... enabled) {
+    if constexpr (sizeof...(Enabled) == 0) {
+        return nullptr;
+    } else {
+        return std::make_unique<DspChain<Enabled...>>(std::move(enabled)...);
+    }
+}
+
+template <typename... Enabled>
+static std::unique_ptr<FrameProcessor> addAgc(const DspConfig &config, unsigned int sampleRate, Enabled... enabled) {
+    if (config.agcTargetDbfs < 0) {
+        return finishChain(std::move(enabled)..., AgcLimiterStage(config, sampleRate));
+    }
+    return finishChain(std::move(enabled)...);
+}
+
+template <typename... Enabled>
+static std::unique_ptr<FrameProcessor> addGate(const DspConfig &config, unsigned int sampleRate, Enabled... enabled) {
+    if (config.gateThresholdDbfs < 0) {
+        return addAgc(config, sampleRate, std::move(enabled)..., NoiseGateStage(config, sampleRate));
+    }
+    return addAgc(config, sampleRate, std::move(enabled)...);
+}
+
+std::unique_ptr<FrameProcessor> makeDspChain(const DspConfig &config, unsigned int sampleRate) {
+    if (config.highPassHz > 0) {
+        return addGate(config, sampleRate, HighPassStage(config, sampleRate));
+    }
+    return addGate(config, sampleRate);
+}
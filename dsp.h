@@ -0,0 +1,41 @@
+#ifndef HIKBRIDGE_DSP_H
+#define HIKBRIDGE_DSP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Each stage is switched off by its "disabled" value, and a disabled stage isn't compiled into
+// the chain at all.
+struct DspConfig {
+    // 0 disables the high-pass.
+    double highPassHz = 100;
+    // 0 disables the noise gate.
+    double gateThresholdDbfs = 0;
+    // 0 disables AGC and the limiter.
+    double agcTargetDbfs = -18;
+    double agcMaxGainDb = 12;
+    double limiterCeilingDbfs = -3;
+
+    bool operator==(const DspConfig &other) const {
+        return highPassHz == other.highPassHz && gateThresholdDbfs == other.gateThresholdDbfs &&
+            agcTargetDbfs == other.agcTargetDbfs && agcMaxGainDb == other.agcMaxGainDb &&
+            limiterCeilingDbfs == other.limiterCeilingDbfs;
+    }
+    bool operator!=(const DspConfig &other) const { return !(*this == other); }
+};
+
+// Processes one frame of linear samples in place, between resampling and encoding. Runs on the
+// capture thread, so it never allocates or locks.
+class FrameProcessor {
+public:
+    virtual ~FrameProcessor() = default;
+    virtual void process(int16_t *samples, size_t count) = 0;
+    virtual std::string describe() const = 0;
+};
+
+// nullptr when every stage is disabled.
+std::unique_ptr<FrameProcessor> makeDspChain(const DspConfig &config, unsigned int sampleRate);
+
+#endif //HIKBRIDGE_DSP_H
@@ -0,0 +1,159 @@
+#include "eventStream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <plog/Log.h>
+#include "metrics.h"
+
+#define EVICTED_FRAME "event: evicted\ndata: {}\n\n"
+#define KEEPALIVE_FRAME ": keepalive\n\n"
+
+void appendJsonEscaped(std::string &out, const char *text) {
+    for (; *text != '\0'; text++) {
+        char c = *text;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char) c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+}
+
+std::string jsonEscape(const std::string &text) {
+    std::string escaped;
+    escaped.reserve(text.size());
+    appendJsonEscaped(escaped, text.c_str());
+    return escaped;
+}
+
+EventBroadcaster::EventBroadcaster() {
+    for (Slot &slot : ring) {
+        slot.frame.reserve(EVENT_FRAME_RESERVE_BYTES);
+    }
+}
+
+unsigned long EventBroadcaster::publish(const char *eventName, const std::string &json) {
+    unsigned long sequence;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        sequence = ++head;
+        Slot &slot = ring[sequence % EVENT_RING_CAPACITY];
+        slot.sequence = sequence;
+        char id[24];
+        snprintf(id, sizeof(id), "%lu", sequence);
+        slot.frame.clear();
+        slot.frame.append("id: ").append(id).append("\nevent: ").append(eventName)
+            .append("\ndata: ").append(json).append("\n\n");
+    }
+    cv.notify_all();
+    return sequence;
+}
+
+EventBroadcaster::ReadResult EventBroadcaster::next(
+    unsigned long &cursor,
+    unsigned long subscribedEpoch,
+    std::string &frame,
+    long timeoutMillis
+) {
+    std::unique_lock<std::mutex> lk(mutex);
+    bool ready = cv.wait_for(lk, std::chrono::milliseconds(timeoutMillis), [&] {
+        return head > cursor || epoch != subscribedEpoch;
+    });
+    if (epoch != subscribedEpoch) {
+        return ReadResult::closed;
+    } else if (!ready) {
+        return ReadResult::timedOut;
+    }
+    const Slot &slot = ring[(cursor + 1) % EVENT_RING_CAPACITY];
+    if (slot.sequence != cursor + 1) {
+        return ReadResult::evicted;
+    }
+    frame = slot.frame;
+    cursor++;
+    return ReadResult::event;
+}
+
+unsigned long EventBroadcaster::getHead() {
+    std::lock_guard<std::mutex> lk(mutex);
+    return head;
+}
+
+unsigned long EventBroadcaster::getEpoch() {
+    std::lock_guard<std::mutex> lk(mutex);
+    return epoch;
+}
+
+void EventBroadcaster::disconnectAll() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        epoch++;
+    }
+    cv.notify_all();
+}
+
+void addEventStreamRoute(httplib::Server &server, EventBroadcaster &broadcaster) {
+    static std::atomic<int> subscribers {0};
+    static Gauge &subscriberGauge = metrics().gauge(
+        "hikbridge_event_subscribers",
+        "Clients connected to the /events stream."
+    );
+    static Counter &evictions = metrics().counter(
+        "hikbridge_event_subscriber_evictions_total",
+        "/events subscribers disconnected for falling a whole ring of events behind."
+    );
+
+    server.Get("/events", [&broadcaster](const httplib::Request &req, httplib::Response &res) {
+        if (subscribers.fetch_add(1) >= MAX_EVENT_SUBSCRIBERS) {
+            subscribers--;
+            res.status = 503;
+            res.set_content("Too many /events subscribers.\n", "text/plain");
+            return;
+        }
+        subscriberGauge.set(subscribers.load());
+
+        unsigned long cursor = broadcaster.getHead();
+        if (req.has_header("Last-Event-ID")) {
+            try {
+                cursor = std::min(cursor, std::stoul(req.get_header_value("Last-Event-ID")));
+            } catch (const std::exception &) {
+                PLOG_WARNING << "Ignoring an unreadable Last-Event-ID from an /events subscriber.";
+            }
+        }
+        unsigned long epoch = broadcaster.getEpoch();
+
+        res.set_header("Cache-Control", "no-cache");
+        res.set_header("X-Accel-Buffering", "no");
+        res.set_chunked_content_provider(
+            "text/event-stream",
+            [&broadcaster, cursor, epoch](size_t, httplib::DataSink &sink) mutable {
+                std::string frame;
+                switch (broadcaster.next(cursor, epoch, frame, EVENT_KEEPALIVE_MILLIS)) {
+                    case EventBroadcaster::ReadResult::event:
+                        return sink.write(frame.data(), frame.size());
+                    case EventBroadcaster::ReadResult::timedOut:
+                        return sink.write(KEEPALIVE_FRAME, sizeof(KEEPALIVE_FRAME) - 1);
+                    case EventBroadcaster::ReadResult::evicted:
+                        PLOG_WARNING << "Evicting an /events subscriber that fell " << EVENT_RING_CAPACITY
+                                     << " events behind.";
+                        evictions.increment();
+                        sink.write(EVICTED_FRAME, sizeof(EVICTED_FRAME) - 1);
+                        sink.done();
+                        return true;
+                    default:
+                        sink.done();
+                        return true;
+                }
+            },
+            [](bool) {
+                subscribers--;
+                subscriberGauge.set(subscribers.load());
+            }
+        );
+    });
+}
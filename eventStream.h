@@ -0,0 +1,62 @@
+#ifndef HIKBRIDGE_EVENT_STREAM_H
+#define HIKBRIDGE_EVENT_STREAM_H
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include "cpp-httplib/httplib.h"
+
+// How many events a subscriber can fall behind before it's evicted.
+#define EVENT_RING_CAPACITY 1024
+#define MAX_EVENT_SUBSCRIBERS 32
+// SSE comments keep idle connections (and the proxies in front of them) from timing out.
+#define EVENT_KEEPALIVE_MILLIS 15000
+// Slots are rendered into in place, so once every one has held an event this big publishing
+// stops allocating.
+#define EVENT_FRAME_RESERVE_BYTES 512
+
+// A single ring of rendered SSE frames shared by every /events subscriber. Each subscriber keeps
+// its own cursor into it, so publishing never waits on a subscriber; one that falls a whole ring
+// behind is told it's been evicted and disconnected.
+class EventBroadcaster {
+public:
+    enum class ReadResult { event, timedOut, evicted, closed };
+
+    EventBroadcaster();
+
+    // Called from the event handler threads, possibly several at once. Returns the event's
+    // sequence number.
+    unsigned long publish(const char *eventName, const std::string &json);
+
+    // Waits for the event after cursor and advances past it. subscribedEpoch is what
+    // getEpoch() returned when the subscriber connected.
+    ReadResult next(unsigned long &cursor, unsigned long subscribedEpoch, std::string &frame, long timeoutMillis);
+    unsigned long getHead();
+    unsigned long getEpoch();
+    // Ends every current subscription, so the server can stop without waiting out keepalives.
+    void disconnectAll();
+
+private:
+    struct Slot {
+        unsigned long sequence = 0;
+        std::string frame;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::array<Slot, EVENT_RING_CAPACITY> ring;
+    unsigned long head = 0;
+    unsigned long epoch = 0;
+};
+
+// GET /events as text/event-stream. A reconnecting client's Last-Event-ID resumes it where it
+// left off, as long as that's still in the ring.
+void addEventStreamRoute(httplib::Server &server, EventBroadcaster &broadcaster);
+
+std::string jsonEscape(const std::string &text);
+// The same, onto the end of out, for callers that reuse one buffer.
+void appendJsonEscaped(std::string &out, const char *text);
+
+#endif //HIKBRIDGE_EVENT_STREAM_H
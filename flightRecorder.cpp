@@ -0,0 +1,210 @@
+#include "flightRecorder.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+static FlightRecording recording;
+static char dumpPath[PATH_MAX];
+static std::atomic<bool> dumped {false};
+
+// The signals backward-cpp prints a stack trace for.
+static const int CRASH_SIGNALS[] = { SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGQUIT, SIGSEGV, SIGSYS, SIGTRAP, SIGXCPU, SIGXFSZ };
+static struct sigaction previousHandlers[sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0])];
+
+// clock_gettime is async-signal-safe, so the dump can stamp itself with the same clock.
+static long wallClockInMillis() {
+    timespec now {};
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// strncpy without the padding, and always terminated.
+static void copyText(char *destination, const char *source, size_t capacity) {
+    size_t i = 0;
+    for (; source != nullptr && source[i] != '\0' && i + 1 < capacity; i++) {
+        destination[i] = source[i];
+    }
+    destination[i] = '\0';
+}
+
+void flightRecordAudio(const int16_t *samples, size_t count, unsigned int sampleRate) {
+    count = std::min(count, (size_t) MAX_CODEC_FRAME_SAMPLES);
+    recording.audio.append([&](FlightAudioFrame &frame) {
+        frame.at = wallClockInMillis();
+        frame.sampleRate = sampleRate;
+        frame.sampleCount = (unsigned int) count;
+        memcpy(frame.samples, samples, count * sizeof(int16_t));
+    });
+}
+
+static void appendEntry(FlightEntry &entry, long value, long detail, const char *text) {
+    entry.at = wallClockInMillis();
+    entry.value = value;
+    entry.detail = detail;
+    copyText(entry.text, text, sizeof(entry.text));
+}
+
+void flightRecordEvent(const char *text) {
+    recording.events.append([&](FlightEntry &entry) { appendEntry(entry, 0, 0, text); });
+}
+
+void flightRecordRelay(bool relaying, const char *reason) {
+    recording.relay.append([&](FlightEntry &entry) { appendEntry(entry, relaying ? 1 : 0, 0, reason); });
+}
+
+void flightRecordSdkCall(const char *call, long result, long lastError) {
+    recording.sdkCalls.append([&](FlightEntry &entry) { appendEntry(entry, result, lastError, call); });
+}
+
+void flightRecordXrun(long alsaError) {
+    recording.xruns.append([&](FlightEntry &entry) { appendEntry(entry, alsaError, 0, "xrun"); });
+}
+
+void dumpFlightRecording(const char *reason) {
+    if (dumped.exchange(true) || dumpPath[0] == '\0') {
+        return;
+    }
+    recording.dumpedAt = wallClockInMillis();
+    copyText(recording.reason, reason, sizeof(recording.reason));
+    int fd = open(dumpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        return;
+    }
+    [[maybe_unused]] ssize_t written = write(fd, &recording, sizeof(recording));
+    close(fd);
+}
+
+static void onCrashSignal(int signal, siginfo_t *info, void *context) {
+    // Nothing here may allocate or lock: "signal " plus the number, by hand.
+    char reason[32] = "Caught signal ";
+    size_t length = strlen(reason);
+    char digits[12];
+    int digitCount = 0;
+    for (int remaining = signal; digitCount == 0 || remaining > 0; remaining /= 10) {
+        digits[digitCount++] = (char) ('0' + remaining % 10);
+    }
+    while (digitCount > 0 && length + 1 < sizeof(reason)) {
+        reason[length++] = digits[--digitCount];
+    }
+    reason[length] = '\0';
+    dumpFlightRecording(reason);
+
+    for (size_t i = 0; i < sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]); i++) {
+        if (CRASH_SIGNALS[i] != signal) {
+            continue;
+        }
+        const struct sigaction &previous = previousHandlers[i];
+        if (previous.sa_flags & SA_SIGINFO) {
+            previous.sa_sigaction(signal, info, context);
+        } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+            previous.sa_handler(signal);
+        } else {
+            sigaction(signal, &previous, nullptr);
+            raise(signal);
+        }
+        return;
+    }
+}
+
+void installFlightRecorder(const std::string &path) {
+    memcpy(recording.magic, FLIGHT_RECORDING_MAGIC, sizeof(recording.magic));
+    recording.size = sizeof(FlightRecording);
+    recording.startedAt = wallClockInMillis();
+    copyText(dumpPath, path.c_str(), sizeof(dumpPath));
+
+    struct sigaction action {};
+    action.sa_sigaction = onCrashSignal;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]); i++) {
+        sigaction(CRASH_SIGNALS[i], &action, &previousHandlers[i]);
+    }
+}
+
+template <typename Entry, size_t Capacity, typename Print>
+static void printRing(const FlightRing<Entry, Capacity> &ring, std::ostream &out, Print print) {
+    unsigned long next = ring.next.load(std::memory_order_relaxed);
+    for (unsigned long position = next > Capacity ? next - Capacity : 0; position < next; position++) {
+        const auto &slot = ring.slots[position % Capacity];
+        if (slot.sequence.load(std::memory_order_relaxed) != position + 1) {
+            out << "  (torn by the dump)" << std::endl;
+            continue;
+        }
+        print(slot.entry);
+    }
+}
+
+static void writeAudioWav(const FlightRecording &dump, const std::string &path, std::ostream &out) {
+    std::vector<int16_t> samples;
+    unsigned int sampleRate = 0;
+    printRing(dump.audio, out, [&](const FlightAudioFrame &frame) {
+        // Capture restarts when the codec changes; only the latest rate's audio makes sense together.
+        if (frame.sampleRate != sampleRate) {
+            samples.clear();
+            sampleRate = frame.sampleRate;
+        }
+        samples.insert(samples.end(), frame.samples, frame.samples + std::min(frame.sampleCount, (unsigned int) MAX_CODEC_FRAME_SAMPLES));
+    });
+    if (samples.empty()) {
+        out << "No captured audio." << std::endl;
+        return;
+    }
+
+    uint32_t dataBytes = (uint32_t) (samples.size() * sizeof(int16_t));
+    uint32_t riffBytes = 36 + dataBytes, fmtBytes = 16, byteRate = sampleRate * 2;
+    uint16_t pcm = 1, channels = 1, blockAlign = 2, bits = 16;
+    std::ofstream wav(path, std::ios::binary);
+    wav.write("RIFF", 4).write((const char *) &riffBytes, 4).write("WAVEfmt ", 8);
+    wav.write((const char *) &fmtBytes, 4).write((const char *) &pcm, 2).write((const char *) &channels, 2);
+    wav.write((const char *) &sampleRate, 4).write((const char *) &byteRate, 4);
+    wav.write((const char *) &blockAlign, 2).write((const char *) &bits, 2);
+    wav.write("data", 4).write((const char *) &dataBytes, 4);
+    wav.write((const char *) samples.data(), dataBytes);
+    out << "Wrote " << samples.size() * 1000 / sampleRate << " ms of captured audio at " << sampleRate << " Hz to " << path << std::endl;
+}
+
+bool printFlightRecording(const std::string &path, std::ostream &out) {
+    std::ifstream file(path, std::ios::binary);
+    auto dump = std::make_unique<FlightRecording>();
+    if (!file.read(reinterpret_cast<char *>(dump.get()), sizeof(FlightRecording))
+        || memcmp(dump->magic, FLIGHT_RECORDING_MAGIC, sizeof(dump->magic)) != 0
+        || dump->size != sizeof(FlightRecording)) {
+        return false;
+    }
+    dump->reason[sizeof(dump->reason) - 1] = '\0';
+
+    long dumpedAt = dump->dumpedAt;
+    auto printEntry = [&](const char *valueName, const char *detailName) {
+        return [&out, dumpedAt, valueName, detailName](const FlightEntry &entry) {
+            out << "  " << entry.at - dumpedAt << " ms  " << std::string(entry.text, strnlen(entry.text, sizeof(entry.text)));
+            if (valueName != nullptr) {
+                out << "  " << valueName << "=" << entry.value;
+            }
+            if (detailName != nullptr) {
+                out << "  " << detailName << "=" << entry.detail;
+            }
+            out << std::endl;
+        };
+    };
+
+    out << "Dumped " << (dumpedAt - dump->startedAt) / 1000 << " s after starting: " << dump->reason << std::endl;
+    out << "Times are relative to the dump." << std::endl;
+    out << "Events:" << std::endl;
+    printRing(dump->events, out, printEntry(nullptr, nullptr));
+    out << "Relay transitions:" << std::endl;
+    printRing(dump->relay, out, printEntry("relaying", nullptr));
+    out << "SDK calls:" << std::endl;
+    printRing(dump->sdkCalls, out, printEntry("result", "error"));
+    out << "Xruns:" << std::endl;
+    printRing(dump->xruns, out, printEntry("alsa-error", nullptr));
+    writeAudioWav(*dump, path + ".wav", out);
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef HIKBRIDGE_FLIGHT_RECORDER_H
+#define HIKBRIDGE_FLIGHT_RECORDER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include "codec.h"
+
+// Enough frames for the last 10 s at the shortest codec frame, 20 ms.
+#define FLIGHT_RECORDER_AUDIO_FRAMES 500
+#define FLIGHT_RECORDER_EVENTS 256
+#define FLIGHT_RECORDER_RELAY_TRANSITIONS 64
+#define FLIGHT_RECORDER_SDK_CALLS 256
+#define FLIGHT_RECORDER_XRUNS 64
+#define FLIGHT_RECORDER_TEXT_BYTES 96
+#define FLIGHT_RECORDER_REASON_BYTES 512
+#define FLIGHT_RECORDING_MAGIC "HIKFLT1"
+
+struct FlightAudioFrame {
+    long at;
+    unsigned int sampleRate;
+    unsigned int sampleCount;
+    int16_t samples[MAX_CODEC_FRAME_SAMPLES];
+};
+
+// What value and detail mean depends on the ring: 1/0 for relay transitions, the return value and
+// NET_DVR_GetLastError for SDK calls, and the ALSA error for xruns.
+struct FlightEntry {
+    long at;
+    long value;
+    long detail;
+    char text[FLIGHT_RECORDER_TEXT_BYTES];
+};
+
+// Appending claims a slot with one fetch_add, copies into it, and publishes it by storing its
+// sequence, so it never locks or allocates. A dump that lands mid-append can catch a half-written
+// slot; its sequence still holds the previous lap's, which is how the decoder tells.
+template <typename Entry, size_t Capacity>
+struct FlightRing {
+    struct Slot {
+        std::atomic<unsigned long> sequence;
+        Entry entry;
+    };
+
+    std::atomic<unsigned long> next;
+    Slot slots[Capacity];
+
+    template <typename Fill>
+    void append(Fill fill) {
+        unsigned long position = next.fetch_add(1, std::memory_order_relaxed);
+        Slot &slot = slots[position % Capacity];
+        fill(slot.entry);
+        slot.sequence.store(position + 1, std::memory_order_release);
+    }
+};
+
+// Lives in static storage and is written out as is, so a dump is a single write().
+struct FlightRecording {
+    char magic[8];
+    uint32_t size;
+    long startedAt;
+    long dumpedAt;
+    char reason[FLIGHT_RECORDER_REASON_BYTES];
+    FlightRing<FlightAudioFrame, FLIGHT_RECORDER_AUDIO_FRAMES> audio;
+    FlightRing<FlightEntry, FLIGHT_RECORDER_EVENTS> events;
+    FlightRing<FlightEntry, FLIGHT_RECORDER_RELAY_TRANSITIONS> relay;
+    FlightRing<FlightEntry, FLIGHT_RECORDER_SDK_CALLS> sdkCalls;
+    FlightRing<FlightEntry, FLIGHT_RECORDER_XRUNS> xruns;
+};
+
+void flightRecordAudio(const int16_t *samples, size_t count, unsigned int sampleRate);
+void flightRecordEvent(const char *text);
+void flightRecordRelay(bool relaying, const char *reason);
+void flightRecordSdkCall(const char *call, long result, long lastError);
+void flightRecordXrun(long alsaError);
+
+// Puts a dump in front of backward-cpp's crash handlers, which still run afterwards.
+void installFlightRecorder(const std::string &dumpPath);
+// Async-signal-safe, and only dumps once however many fatal paths get here.
+void dumpFlightRecording(const char *reason);
+// Decodes a dump for a human. False if it isn't one.
+bool printFlightRecording(const std::string &path, std::ostream &out);
+
+#endif //HIKBRIDGE_FLIGHT_RECORDER_H
@@ -0,0 +1,124 @@
+#include "heartbeat.h"
+
+#include <backward.hpp>
+#include <chrono>
+#include <csignal>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define STALL_STACK_SIGNAL SIGUSR2
+#define STALL_STACK_TIMEOUT_IN_MILLIS 500
+
+static Heartbeat heartbeats[heartbeatCount] = {
+    { "capture", 2000 },
+    { "capture-1", 2000 },
+    { "capture-2", 2000 },
+    { "capture-3", 2000 },
+    { "sender", 1000 },
+    { "sender-1", 1000 },
+    { "sender-2", 1000 },
+    { "sender-3", 1000 },
+    { "notifier", 30000 },
+    { "alarm-callback", 5000 },
+    { "event-handler-0", 5000 },
+    { "event-handler-1", 5000 },
+    { "event-handler-2", 5000 },
+    { "event-handler-3", 5000 },
+};
+
+static pid_t currentThreadId() {
+    return (pid_t) syscall(SYS_gettid);
+}
+
+long heartbeatClockInMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+Heartbeat &heartbeat(HeartbeatId id) {
+    return heartbeats[id];
+}
+
+Heartbeat::Heartbeat(const char *name, long stallThresholdMillis)
+    : name(name), stallThresholdMillis(stallThresholdMillis) {}
+
+void Heartbeat::beat(const char *newState) {
+    state.store(newState, std::memory_order_relaxed);
+    lastBeatMillis.store(heartbeatClockInMillis(), std::memory_order_relaxed);
+    beats.fetch_add(1, std::memory_order_relaxed);
+    if (!armed.load(std::memory_order_relaxed)) {
+        threadId.store(currentThreadId(), std::memory_order_relaxed);
+        armed.store(true, std::memory_order_release);
+    }
+}
+
+void Heartbeat::enter(const char *newState) {
+    threadId.store(currentThreadId(), std::memory_order_relaxed);
+    state.store(newState, std::memory_order_relaxed);
+    lastBeatMillis.store(heartbeatClockInMillis(), std::memory_order_relaxed);
+    beats.fetch_add(1, std::memory_order_relaxed);
+    armed.store(true, std::memory_order_release);
+}
+
+void Heartbeat::setState(const char *newState) {
+    state.store(newState, std::memory_order_relaxed);
+}
+
+void Heartbeat::exit() {
+    armed.store(false, std::memory_order_release);
+    state.store("idle", std::memory_order_relaxed);
+}
+
+bool Heartbeat::isStalled(long nowInMillis, long &stalledForMillis) const {
+    if (!armed.load(std::memory_order_acquire)) {
+        return false;
+    }
+    stalledForMillis = nowInMillis - lastBeatMillis.load(std::memory_order_relaxed);
+    return stalledForMillis > stallThresholdMillis;
+}
+
+static backward::StackTrace stalledThreadStack;
+static std::atomic<bool> stalledThreadStackReady {false};
+
+static void stallStackSignalHandler([[maybe_unused]] int signal) {
+    stalledThreadStack.load_here(32);
+    stalledThreadStackReady.store(true, std::memory_order_release);
+}
+
+void installStallStackHandler() {
+    struct sigaction action {};
+    action.sa_handler = stallStackSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(STALL_STACK_SIGNAL, &action, nullptr);
+}
+
+std::string captureThreadStack(pid_t threadId) {
+    static std::mutex captureMutex;
+    std::lock_guard<std::mutex> lk(captureMutex);
+    if (threadId == 0) {
+        return "<thread id unknown>";
+    }
+
+    stalledThreadStackReady = false;
+    if (syscall(SYS_tgkill, getpid(), threadId, STALL_STACK_SIGNAL) != 0) {
+        return "<unable to signal the stalled thread>";
+    }
+    long deadline = heartbeatClockInMillis() + STALL_STACK_TIMEOUT_IN_MILLIS;
+    while (!stalledThreadStackReady.load(std::memory_order_acquire)) {
+        if (heartbeatClockInMillis() > deadline) {
+            return "<the stalled thread did not respond to the stack sampling signal>";
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    backward::Printer p;
+    p.snippet = true;
+    std::ostringstream btStream;
+    p.print(stalledThreadStack, btStream);
+    return btStream.str();
+}
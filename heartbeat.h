@@ -0,0 +1,87 @@
+#ifndef HIKBRIDGE_HEARTBEAT_H
+#define HIKBRIDGE_HEARTBEAT_H
+
+#include <atomic>
+#include <string>
+#include <sys/types.h>
+
+enum HeartbeatId {
+    // One capture heartbeat per capture source and one sender heartbeat per routed voice channel;
+    // MAX_CAPTURE_SOURCES and MAX_VOICE_ROUTES have to match.
+    captureHeartbeat,
+    capture1Heartbeat,
+    capture2Heartbeat,
+    capture3Heartbeat,
+    senderHeartbeat,
+    sender1Heartbeat,
+    sender2Heartbeat,
+    sender3Heartbeat,
+    notifierHeartbeat,
+    alarmCallbackHeartbeat,
+    // One per intercom event handler; INTERCOM_HANDLER_THREADS has to match.
+    eventHandler0Heartbeat,
+    eventHandler1Heartbeat,
+    eventHandler2Heartbeat,
+    eventHandler3Heartbeat,
+    heartbeatCount
+};
+
+// Lock-free liveness record for one long-lived thread or SDK callback. Loops beat() every
+// iteration; callbacks bracket their body with enter()/exit(). Either way the heartbeat counts
+// as stalled once it has been armed and silent for longer than its threshold. States are
+// string literals so the last-known state can be read from any thread without locking.
+class Heartbeat {
+public:
+    Heartbeat(const char *name, long stallThresholdMillis);
+
+    void beat(const char *state);
+    void enter(const char *state);
+    void setState(const char *state);
+    void exit();
+
+    bool isStalled(long nowInMillis, long &stalledForMillis) const;
+    const char *getName() const { return name; }
+    const char *getState() const { return state.load(std::memory_order_relaxed); }
+    pid_t getThreadId() const { return threadId.load(std::memory_order_relaxed); }
+    long getBeatCount() const { return beats.load(std::memory_order_relaxed); }
+    long getStallThresholdMillis() const { return stallThresholdMillis; }
+
+private:
+    const char *name;
+    long stallThresholdMillis;
+    std::atomic<long> lastBeatMillis {0};
+    std::atomic<long> beats {0};
+    std::atomic<const char *> state {"idle"};
+    std::atomic<pid_t> threadId {0};
+    std::atomic<bool> armed {false};
+};
+
+// Disarms a loop's heartbeat when the loop unwinds, so a restarting subsystem isn't a stall.
+class HeartbeatScope {
+public:
+    explicit HeartbeatScope(Heartbeat &heartbeat) : heartbeat(heartbeat) {}
+    ~HeartbeatScope() { heartbeat.exit(); }
+
+private:
+    Heartbeat &heartbeat;
+};
+
+// enter()/exit() around an SDK callback body.
+class CallbackHeartbeat {
+public:
+    CallbackHeartbeat(Heartbeat &heartbeat, const char *state) : heartbeat(heartbeat) { heartbeat.enter(state); }
+    ~CallbackHeartbeat() { heartbeat.exit(); }
+
+private:
+    Heartbeat &heartbeat;
+};
+
+Heartbeat &heartbeat(HeartbeatId id);
+long heartbeatClockInMillis();
+
+// Installs the SIGUSR2 handler used to sample the stack of a stalled thread.
+void installStallStackHandler();
+// Signals the thread and returns its backward-cpp stack, or why it couldn't be captured.
+std::string captureThreadStack(pid_t threadId);
+
+#endif //HIKBRIDGE_HEARTBEAT_H
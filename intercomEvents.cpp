@@ -0,0 +1,293 @@
+#include "intercomEvents.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "metrics.h"
+
+#define ANY_SUB_TYPE (-2)
+
+namespace {
+
+template <size_t N, typename Byte, size_t M>
+void copyBytes(char (&destination)[N], const Byte (&source)[M]) {
+    size_t length = strnlen(reinterpret_cast<const char *>(source), std::min(N - 1, M));
+    memcpy(destination, source, length);
+    destination[length] = '\0';
+}
+
+void copyDeviceTime(const NET_DVR_TIME_EX &time, IntercomEvent &event) {
+    snprintf(
+        event.deviceTime,
+        sizeof(event.deviceTime),
+        "%04u-%02u-%02uT%02u:%02u:%02u",
+        time.wYear % 10000,
+        time.byMonth % 100,
+        time.byDay % 100,
+        time.byHour % 100,
+        time.byMinute % 100,
+        time.bySecond % 100
+    );
+}
+
+const NET_DVR_VIDEO_INTERCOM_ALARM &asAlarm(const char *info) {
+    return *reinterpret_cast<const NET_DVR_VIDEO_INTERCOM_ALARM *>(info);
+}
+
+const NET_DVR_VIDEO_INTERCOM_EVENT &asEvent(const char *info) {
+    return *reinterpret_cast<const NET_DVR_VIDEO_INTERCOM_EVENT *>(info);
+}
+
+// Reads the sub-type and whatever every sub-type of a command shares.
+struct CommandDecoder {
+    LONG command;
+    int (*decodeCommon)(const char *info, IntercomEvent &event);
+};
+
+const CommandDecoder COMMAND_DECODERS[] = {
+    { COMM_ALARM_VIDEO_INTERCOM, [](const char *info, IntercomEvent &event) {
+        const NET_DVR_VIDEO_INTERCOM_ALARM &alarm = asAlarm(info);
+        copyDeviceTime(alarm.struTime, event);
+        event.lockId = alarm.wLockID;
+        return (int) alarm.byAlarmType;
+    } },
+    { COMM_UPLOAD_VIDEO_INTERCOM_EVENT, [](const char *info, IntercomEvent &event) {
+        const NET_DVR_VIDEO_INTERCOM_EVENT &intercomEvent = asEvent(info);
+        copyDeviceTime(intercomEvent.struTime, event);
+        return (int) intercomEvent.byEventType;
+    } },
+};
+
+struct SubTypeDecoder {
+    LONG command;
+    int subType;
+    IntercomEventKind kind;
+    void (*decode)(const char *info, IntercomEvent &event);
+};
+
+void decodeNothing(const char *, IntercomEvent &) {}
+
+void decodeLockAlarm(const char *info, IntercomEvent &event) {
+    event.lockId = (int) asAlarm(info).uAlarmInfo.struLockAlarm.dwLockID;
+}
+
+void decodeCardSwipe(const char *info, IntercomEvent &event) {
+    copyBytes(event.credential, asEvent(info).uEventInfo.struSendCardInfo.byCardNo);
+}
+
+// First match wins, so the ANY_SUB_TYPE fallbacks go last.
+const SubTypeDecoder SUB_TYPE_DECODERS[] = {
+    { COMM_ALARM_VIDEO_INTERCOM, BELL_PRESSED_ALARM, IntercomEventKind::bell, decodeNothing },
+    { COMM_ALARM_VIDEO_INTERCOM, TAMPER_ALARM, IntercomEventKind::tamper, decodeNothing },
+    { COMM_ALARM_VIDEO_INTERCOM, ZONE_ALARM, IntercomEventKind::zoneAlarm, [](const char *info, IntercomEvent &event) {
+        const NET_DVR_ZONE_ALARM_INFO &zone = asAlarm(info).uAlarmInfo.struZoneAlarm;
+        event.zoneIndex = zone.dwZonendex;
+        event.zoneType = zone.byZoneType;
+        copyBytes(event.zoneName, zone.byZoneName);
+    } },
+    { COMM_ALARM_VIDEO_INTERCOM, UNLOCK_FAILURES_ALARM, IntercomEventKind::lockAlarm, decodeLockAlarm },
+    { COMM_ALARM_VIDEO_INTERCOM, DOOR_FORCED_OPEN_ALARM, IntercomEventKind::lockAlarm, decodeLockAlarm },
+    { COMM_ALARM_VIDEO_INTERCOM, DOOR_OPEN_TOO_LONG_ALARM, IntercomEventKind::lockAlarm, decodeLockAlarm },
+    { COMM_ALARM_VIDEO_INTERCOM, ANY_SUB_TYPE, IntercomEventKind::otherAlarm, decodeNothing },
+    { COMM_UPLOAD_VIDEO_INTERCOM_EVENT, UNLOCK_RECORD_EVENT, IntercomEventKind::unlock, [](const char *info, IntercomEvent &event) {
+        const NET_DVR_UNLOCK_RECORD_INFO &unlock = asEvent(info).uEventInfo.struUnlockRecord;
+        event.lockId = unlock.wLockID;
+        event.unlockType = unlock.byUnlockType;
+        copyBytes(event.credential, unlock.byControlSrc);
+    } },
+    { COMM_UPLOAD_VIDEO_INTERCOM_EVENT, INVALID_CARD_SWIPE_EVENT, IntercomEventKind::cardSwipe, decodeCardSwipe },
+    { COMM_UPLOAD_VIDEO_INTERCOM_EVENT, CARD_SWIPE_EVENT, IntercomEventKind::cardSwipe, decodeCardSwipe },
+    { COMM_UPLOAD_VIDEO_INTERCOM_EVENT, MAGNETIC_DOOR_STATUS_EVENT, IntercomEventKind::doorStatus, [](const char *info, IntercomEvent &event) {
+        event.doorOpen = asEvent(info).uEventInfo.struMagneticDoorStatus.byMagneticDoorStatus == 1;
+    } },
+    { COMM_UPLOAD_VIDEO_INTERCOM_EVENT, ANY_SUB_TYPE, IntercomEventKind::otherEvent, decodeNothing },
+};
+
+Counter &decodedEvents(IntercomEventKind kind) {
+    static const std::vector<Counter *> counters = [] {
+        std::vector<Counter *> byKind;
+        for (int k = 0; k <= (int) IntercomEventKind::unknownCommand; k++) {
+            byKind.push_back(&metrics().counter(
+                std::string("hikbridge_intercom_events_total{kind=\"") + intercomEventKindName((IntercomEventKind) k) + "\"}",
+                "Events decoded from the device, by kind."
+            ));
+        }
+        return byKind;
+    }();
+    return *counters[(int) kind];
+}
+
+Counter &droppedEvents() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_intercom_events_dropped_total",
+        "Device events thrown away because the dispatch queue was full."
+    );
+    return counter;
+}
+
+}
+
+const char *intercomEventKindName(IntercomEventKind kind) {
+    switch (kind) {
+        case IntercomEventKind::bell:
+            return "bell";
+        case IntercomEventKind::tamper:
+            return "tamper";
+        case IntercomEventKind::zoneAlarm:
+            return "zone-alarm";
+        case IntercomEventKind::lockAlarm:
+            return "lock-alarm";
+        case IntercomEventKind::otherAlarm:
+            return "alarm";
+        case IntercomEventKind::unlock:
+            return "unlock";
+        case IntercomEventKind::cardSwipe:
+            return "card-swipe";
+        case IntercomEventKind::doorStatus:
+            return "door";
+        case IntercomEventKind::otherEvent:
+            return "event";
+        default:
+            return "device-event";
+    }
+}
+
+IntercomEventQueue::IntercomEventQueue() {
+    for (unsigned long i = 0; i < cells.size(); i++) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+IntercomEventQueue::~IntercomEventQueue() {
+    if (wakeFd >= 0) {
+        close(wakeFd);
+    }
+}
+
+IntercomEvent *IntercomEventQueue::claim(unsigned long &position) {
+    position = enqueuePosition.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+        cell = &cells[position & (INTERCOM_EVENT_QUEUE_CAPACITY - 1)];
+        long lag = (long) (cell->sequence.load(std::memory_order_acquire) - position);
+        if (lag == 0) {
+            if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (lag < 0) {
+            return nullptr;
+        } else {
+            position = enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+    return &cell->event;
+}
+
+void IntercomEventQueue::commit(unsigned long position) {
+    cells[position & (INTERCOM_EVENT_QUEUE_CAPACITY - 1)].sequence.store(position + 1, std::memory_order_release);
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t written = write(wakeFd, &one, sizeof(one));
+}
+
+bool IntercomEventQueue::pop(IntercomEvent &event) {
+    unsigned long position = dequeuePosition.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+        cell = &cells[position & (INTERCOM_EVENT_QUEUE_CAPACITY - 1)];
+        long lag = (long) (cell->sequence.load(std::memory_order_acquire) - (position + 1));
+        if (lag == 0) {
+            if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (lag < 0) {
+            return false;
+        } else {
+            position = dequeuePosition.load(std::memory_order_relaxed);
+        }
+    }
+    event = cell->event;
+    cell->sequence.store(position + INTERCOM_EVENT_QUEUE_CAPACITY, std::memory_order_release);
+    return true;
+}
+
+void IntercomEventQueue::awaitPush(long timeoutMillis) {
+    pollfd pollFd { wakeFd, POLLIN, 0 };
+    if (poll(&pollFd, 1, (int) timeoutMillis) > 0) {
+        uint64_t pushes;
+        [[maybe_unused]] ssize_t readBytes = read(wakeFd, &pushes, sizeof(pushes));
+    }
+}
+
+long IntercomEventQueue::size() const {
+    return (long) (enqueuePosition.load(std::memory_order_relaxed) - dequeuePosition.load(std::memory_order_relaxed));
+}
+
+// FNV-1a over whatever identifies the device.
+IntercomEventQueue &IntercomEventQueues::forAlarmer(const NET_DVR_ALARMER *alarmer) {
+    uint32_t hash = 2166136261u;
+    if (alarmer != nullptr && alarmer->byDeviceIPValid) {
+        for (size_t i = 0; i < sizeof(alarmer->sDeviceIP) && alarmer->sDeviceIP[i] != '\0'; i++) {
+            hash = (hash ^ (unsigned char) alarmer->sDeviceIP[i]) * 16777619u;
+        }
+    } else if (alarmer != nullptr) {
+        hash = (hash ^ (uint32_t) alarmer->lUserID) * 16777619u;
+    }
+    return queues[hash % INTERCOM_HANDLER_THREADS];
+}
+
+bool decodeIntercomEvent(
+    LONG command,
+    const NET_DVR_ALARMER *alarmer,
+    const char *alarmInfo,
+    long receivedAt,
+    IntercomEventQueues &queues
+) {
+    IntercomEventQueue &queue = queues.forAlarmer(alarmer);
+    unsigned long position;
+    IntercomEvent *slot = queue.claim(position);
+    if (slot == nullptr) {
+        droppedEvents().increment();
+        return false;
+    }
+
+    IntercomEvent &event = *slot;
+    event = IntercomEvent {};
+    event.kind = IntercomEventKind::unknownCommand;
+    event.command = command;
+    event.subType = -1;
+    event.receivedAt = receivedAt;
+    event.lockId = -1;
+    if (alarmer != nullptr && alarmer->byDeviceIPValid) {
+        copyBytes(event.device, alarmer->sDeviceIP);
+    } else {
+        snprintf(event.device, sizeof(event.device), "session-%ld", alarmer != nullptr ? (long) alarmer->lUserID : -1L);
+    }
+
+    if (alarmInfo != nullptr) {
+        for (const CommandDecoder &commandDecoder : COMMAND_DECODERS) {
+            if (commandDecoder.command != command) {
+                continue;
+            }
+            event.subType = commandDecoder.decodeCommon(alarmInfo, event);
+            for (const SubTypeDecoder &decoder : SUB_TYPE_DECODERS) {
+                if (decoder.command == command && (decoder.subType == event.subType || decoder.subType == ANY_SUB_TYPE)) {
+                    event.kind = decoder.kind;
+                    decoder.decode(alarmInfo, event);
+                    break;
+                }
+            }
+            break;
+        }
+    }
+
+    decodedEvents(event.kind).increment();
+    queue.commit(position);
+    return true;
+}
@@ -0,0 +1,120 @@
+#ifndef HIKBRIDGE_INTERCOM_EVENTS_H
+#define HIKBRIDGE_INTERCOM_EVENTS_H
+
+#include <HCNetSDK.h>
+#include <array>
+#include <atomic>
+
+// Followed by the handler's index.
+#define EVENT_HANDLER_SUBSYSTEM_PREFIX "event-handler-"
+// Events are handed out by device, so this only matters once the alarm listener brings in more
+// than one.
+#define INTERCOM_HANDLER_THREADS 4
+
+// COMM_ALARM_VIDEO_INTERCOM's byAlarmType. The SDK header doesn't name these, so they come from
+// its documentation.
+#define ZONE_ALARM 1
+#define UNLOCK_FAILURES_ALARM 4
+#define DOOR_FORCED_OPEN_ALARM 5
+#define DOOR_OPEN_TOO_LONG_ALARM 6
+#define BELL_PRESSED_ALARM 0x11
+#define TAMPER_ALARM 0x12
+
+// COMM_UPLOAD_VIDEO_INTERCOM_EVENT's byEventType.
+#define UNLOCK_RECORD_EVENT 1
+#define INVALID_CARD_SWIPE_EVENT 5
+#define CARD_SWIPE_EVENT 6
+#define MAGNETIC_DOOR_STATUS_EVENT 8
+
+// Must be a power of two.
+#define INTERCOM_EVENT_QUEUE_CAPACITY 256
+
+enum class IntercomEventKind {
+    bell,
+    tamper,
+    zoneAlarm,
+    lockAlarm,
+    otherAlarm,
+    unlock,
+    cardSwipe,
+    doorStatus,
+    otherEvent,
+    unknownCommand,
+};
+
+const char *intercomEventKindName(IntercomEventKind kind);
+
+// What routing needs from one SDK event, copied out of the SDK's buffers so the callback can
+// return. Fixed size, so queueing one never allocates.
+struct IntercomEvent {
+    IntercomEventKind kind;
+    LONG command;
+    // byAlarmType or byEventType, depending on the command. -1 for other commands.
+    int subType;
+    // The device's IP, or session-<user id> when the SDK didn't give one.
+    char device[48];
+    long receivedAt;
+    // ISO 8601 local time as the device reported it, empty when it didn't.
+    char deviceTime[20];
+    int lockId;
+    unsigned long zoneIndex;
+    int zoneType;
+    char zoneName[33];
+    int unlockType;
+    // The card number of a swipe, or whatever the device says opened the lock.
+    char credential[33];
+    bool doorOpen;
+};
+
+// Bounded multi-producer queue in the style of Vyukov's, since the SDK may call back from more
+// than one thread. Never locks and never allocates; producers decode straight into the slot.
+class IntercomEventQueue {
+public:
+    IntercomEventQueue();
+    ~IntercomEventQueue();
+
+    // The next free slot, or nullptr if the queue is full. Every slot claimed has to be committed.
+    IntercomEvent *claim(unsigned long &position);
+    // Hands the slot to the consumer and wakes it.
+    void commit(unsigned long position);
+    bool pop(IntercomEvent &event);
+    // Blocks until something may have been pushed, or for at most timeoutMillis.
+    void awaitPush(long timeoutMillis);
+    long size() const;
+
+private:
+    struct Cell {
+        std::atomic<unsigned long> sequence;
+        IntercomEvent event;
+    };
+
+    std::array<Cell, INTERCOM_EVENT_QUEUE_CAPACITY> cells;
+    alignas(64) std::atomic<unsigned long> enqueuePosition {0};
+    alignas(64) std::atomic<unsigned long> dequeuePosition {0};
+    // Written after every push so the consumer can sleep in poll() without missing one.
+    int wakeFd = -1;
+};
+
+// One queue per handler. A device's events always land on the same one, so they're handled in
+// the order the device sent them.
+class IntercomEventQueues {
+public:
+    IntercomEventQueue &forAlarmer(const NET_DVR_ALARMER *alarmer);
+    IntercomEventQueue &forHandler(int handler) { return queues[handler]; }
+
+private:
+    std::array<IntercomEventQueue, INTERCOM_HANDLER_THREADS> queues;
+};
+
+// Runs the decoder for command and its sub-type straight into a slot on the device's queue. Only
+// copies bytes, so it's cheap enough to call from the SDK's alarm callback. False if the event was
+// dropped because the queue was full.
+bool decodeIntercomEvent(
+    LONG command,
+    const NET_DVR_ALARMER *alarmer,
+    const char *alarmInfo,
+    long receivedAt,
+    IntercomEventQueues &queues
+);
+
+#endif //HIKBRIDGE_INTERCOM_EVENTS_H
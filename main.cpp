@@ -12,9 +12,35 @@
 #include <utility>
 #include <HCNetSDK.h>
 #include <thread>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <future>
 #include "cpp-httplib/httplib.h"
+#include "allocationAudit.h"
+#include "announcements.h"
+#include "audioPipeline.h"
+#include "clockDrift.h"
+#include "coalescer.h"
+#include "codec.h"
+#include "config.h"
+#include "doorControl.h"
+#include "dsp.h"
+#include "eventStream.h"
+#include "flightRecorder.h"
+#include "heartbeat.h"
+#include "intercomEvents.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "replay.h"
+#include "resampler.h"
+#include "sessionRecovery.h"
+#include "mqtt.h"
+#include "probes.h"
+#include "spool.h"
+#include "startup.h"
+#include "supervisor.h"
+#include "voiceChannels.h"
 #ifdef REMOTE
     #include <alsa/asoundlib.h>
 #else
@@ -22,20 +48,20 @@
 #endif
 
 
-#define MILLIS_OF_SILENCE_BEFORE_HANGUP 5000
 typedef int HikSessionId, HikEventListeningHandle, HikVoiceComHandle;
 
-HikSessionId sessionId;
-char soundcardReadBuffer[160];
-std::mutex soundcardReadBufferMutex;
-std::mutex voiceComHandleMutex;
-std::condition_variable soundcardReadBufferCV;
-std::string doorbellHost;
-unsigned short doorbellPort;
-std::string doorbellPath;
-HikVoiceComHandle voiceComHandle = -1;
-long lastSoundcardLoopTime;
-bool intercomGotFuckedWith;
+HikSessionId sessionId = -1;
+EncoderPool encoderPool;
+ConfigStore configStore;
+// What the device expects on the voice talk channel. Capture reopens the card when it changes.
+std::atomic<const CodecProfile *> negotiatedCodec {&codecProfile(VoiceCodec::g711MuLaw)};
+std::promise<void> sdkInitializedPromise;
+std::shared_future<void> sdkInitialized = sdkInitializedPromise.get_future().share();
+AnnouncementPlayer announcementPlayer;
+ConversationRecorder conversationRecorder;
+std::mutex doorbellRingsMutex;
+std::condition_variable doorbellRingsCV;
+unsigned int pendingDoorbellRings = 0;
 
 void shutdown(std::stringstream &stream) {
     backward::StackTrace st;
@@ -45,6 +71,7 @@ void shutdown(std::stringstream &stream) {
     std::ostringstream btStream;
     p.print(st, btStream);
     PLOG_FATAL << "HikBridge shutting down due to error: " << std::endl << stream.str() << std::endl << btStream.str();
+    dumpFlightRecording(stream.str().c_str());
     exit(1);
 }
 
@@ -59,65 +86,136 @@ void shutdown(std::optional<std::string> errorMessage = std::nullopt) {
     }
 }
 
+Supervisor supervisor([](const std::string &reason) { shutdown(reason); });
+
+long currTimeInMillis() {
+    long virtualTime = replayVirtualTimeInMillis();
+    if (virtualTime >= 0) {
+        return virtualTime;
+    }
+    struct timeval tv {};
+    gettimeofday(&tv, nullptr);
+    return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+};
+
+long currTimeInSeconds() {
+    return currTimeInMillis() / 1000;
+};
+
 std::string obtainHikSDKErrorMsg(const std::string& prefix = "HikSDK Error") {
     int errorCode = 0;
     char *errMsg = NET_DVR_GetErrorMsg(&errorCode);
+    flightRecordSdkCall(prefix.c_str(), -1, errorCode);
     std::stringstream ss;
     ss << prefix << " | <" << errorCode << "> " << errMsg;
     return ss.str();
 }
 
-HikSessionId logInToDevice(
-    const std::string& host,
-    unsigned short port,
-    const std::string& username,
-    const std::string& password
+// A login that hasn't called back by then has gone well past the SDK's own connect timeout.
+#define ASYNC_LOGIN_TIMEOUT_IN_MILLIS 15000
+
+// The SDK reports an asynchronous login from one of its own threads. pUser carries the attempt it
+// belongs to, so a result that straggles in after its attempt was given up on isn't mistaken for
+// the current one; if that straggler did log in, the next attempt logs it out.
+struct AsyncLogin {
+    std::mutex mutex;
+    std::condition_variable cv;
+    long attempt = 0;
+    bool finished = false;
+    HikSessionId sessionId = -1;
+    HikSessionId straySessionId = -1;
+};
+AsyncLogin asyncLogin;
+
+void CALLBACK hikLoginResultCallback(
+    LONG lUserID,
+    DWORD dwResult,
+    [[maybe_unused]] LPNET_DVR_DEVICEINFO_V30 lpDeviceInfo,
+    void *pUser
 ) {
-    PLOG_INFO << "Creating a session to a Hikvision device at "
-              << username << ":" << password << "@" << host << ":" << port;
-    bool initSuccessful = NET_DVR_Init();
-    if (!initSuccessful) {
-        shutdown("Failed to initialize Hik SDK.");
+    std::lock_guard<std::mutex> lk(asyncLogin.mutex);
+    HikSessionId sid = dwResult != 0 ? lUserID : -1;
+    if ((long) (intptr_t) pUser != asyncLogin.attempt) {
+        asyncLogin.straySessionId = sid;
+        return;
     }
+    asyncLogin.finished = true;
+    asyncLogin.sessionId = sid;
+    asyncLogin.cv.notify_all();
+}
 
-    NET_DVR_SetConnectTime(2000, 1);
-    NET_DVR_SetReconnect(10000, true);
+HikSessionId logInToDevice(const DeviceCoordinates &device) {
+    PLOG_INFO << "Creating a session to a Hikvision device at "
+              << device.username << ":" << device.password << "@" << device.host << ":" << device.port;
 
-    NET_DVR_USER_LOGIN_INFO loginInfo;
-    loginInfo.bUseAsynLogin = 0;
-    loginInfo.wPort = 8000;
-    strcpy(loginInfo.sDeviceAddress, host.c_str());
-    strcpy(loginInfo.sUserName, username.c_str());
-    strcpy(loginInfo.sPassword, password.c_str());
+    NET_DVR_USER_LOGIN_INFO loginInfo = {};
+    loginInfo.bUseAsynLogin = 1;
+    loginInfo.cbLoginResult = hikLoginResultCallback;
+    loginInfo.wPort = device.port;
+    strncpy(loginInfo.sDeviceAddress, device.host.c_str(), NET_DVR_DEV_ADDRESS_MAX_LEN - 1);
+    strncpy(loginInfo.sUserName, device.username.c_str(), NET_DVR_LOGIN_USERNAME_MAX_LEN - 1);
+    strncpy(loginInfo.sPassword, device.password.c_str(), NET_DVR_LOGIN_PASSWD_MAX_LEN - 1);
 
-    NET_DVR_DEVICEINFO_V40 deviceInfoV40 = {0};
-    int sid = NET_DVR_Login_V40(&loginInfo, &deviceInfoV40);
+    std::unique_lock<std::mutex> lk(asyncLogin.mutex);
+    if (asyncLogin.straySessionId >= 0) {
+        PLOG_INFO << "Logging out of session id <" << asyncLogin.straySessionId << "> from an abandoned login";
+        NET_DVR_Logout(asyncLogin.straySessionId);
+        asyncLogin.straySessionId = -1;
+    }
+    asyncLogin.finished = false;
+    loginInfo.pUser = (void *) (intptr_t) ++asyncLogin.attempt;
+    lk.unlock();
+
+    NET_DVR_DEVICEINFO_V40 deviceInfoV40 = {};
+    if (NET_DVR_Login_V40(&loginInfo, &deviceInfoV40) < 0) {
+        throw SubsystemFault(obtainHikSDKErrorMsg("Failed to start logging in to Hik device."));
+    }
 
-    if (sid < 0) {
-        shutdown(obtainHikSDKErrorMsg("Failed to log in to Hik device."));
+    lk.lock();
+    if (!asyncLogin.cv.wait_for(
+        lk,
+        std::chrono::milliseconds(ASYNC_LOGIN_TIMEOUT_IN_MILLIS),
+        [] { return asyncLogin.finished; }
+    )) {
+        asyncLogin.attempt++;
+        throw SubsystemFault("Timed out logging in to Hik device.");
     }
-    PLOG_INFO << "Successfully logged in with session id <" << sid << ">";
-    return sid;
+    if (asyncLogin.sessionId < 0) {
+        throw SubsystemFault("The Hik device refused the login.");
+    }
+    PLOG_INFO << "Successfully logged in with session id <" << asyncLogin.sessionId << ">";
+    flightRecordSdkCall("NET_DVR_Login_V40", asyncLogin.sessionId, 0);
+    return asyncLogin.sessionId;
 }
 
-std::optional<std::string> checkAlsaError(int errCode) {
+// Fixed-size, so a card that fails every read doesn't allocate on every period too.
+struct AlsaErrorMessage {
+    bool failed = false;
+    char text[128] {};
+
+    explicit operator bool() const { return failed; }
+    const char *operator*() const { return text; }
+};
+
+AlsaErrorMessage checkAlsaError(int errCode) {
+    AlsaErrorMessage message;
     if (errCode < 0) {
-        std::stringstream alsaErrStream;
-        alsaErrStream << "ALSA ERROR CODE | <" << errCode << "> – " << snd_strerror(errCode);
-        return alsaErrStream.str();
+        message.failed = true;
+        snprintf(message.text, sizeof(message.text), "ALSA ERROR CODE | <%d> – %s", errCode, snd_strerror(errCode));
     }
-    return std::nullopt;
+    return message;
 }
 
 void recoverPcm(snd_pcm_t *handle, int errCode) {
     if (errCode == -EPIPE) {
         PLOG_WARNING << "Experiencing xrun.";
+        flightRecordXrun(errCode);
         snd_pcm_status_t *status;
         snd_pcm_status_alloca(&status);
         if (auto pcmStatusErrMsg = checkAlsaError(snd_pcm_status(handle, status))) {
             std::stringstream ss;
             ss << "Failed to get PCM status after xrun: " << *pcmStatusErrMsg;
-            shutdown(ss);
+            throw SubsystemFault(ss.str());
         }
         snd_pcm_status_get_state(status);
         snd_output_t *statusOutput;
@@ -133,124 +231,581 @@ void recoverPcm(snd_pcm_t *handle, int errCode) {
         )) {
             std::stringstream ss;
             ss << "Failed to recover after xrun: " << *recoverErrorMsg;
-            shutdown(ss);
+            throw SubsystemFault(ss.str());
         } else {
             PLOG_WARNING << "Recovered seemingly successfully.";
         }
     } else if (auto errMsg = checkAlsaError(errCode)){
-        shutdown(*errMsg);
+        throw SubsystemFault(*errMsg);
     }
 }
 
-bool hikRelayEnabled = false;
+// Set from the first failed send until one goes through again.
+std::atomic<bool> voiceSendFailing {false};
+
+// A device that stops taking audio fails every frame, so failures are counted and only the first
+// of a run is logged, without building a message for the rest.
+void noteVoiceSend(bool successful, const char *what) {
+    static Counter &failures = metrics().counter(
+        "hikbridge_voice_send_failures_total", "Voice talk frames the SDK refused to send."
+    );
+    if (successful) {
+        if (voiceSendFailing.exchange(false)) {
+            PLOG_INFO << "The Hik device is taking audio again.";
+        }
+        return;
+    }
+    failures.increment();
+    int errorCode = 0;
+    char *errMsg = NET_DVR_GetErrorMsg(&errorCode);
+    flightRecordSdkCall(what, -1, errorCode);
+    if (!voiceSendFailing.exchange(true)) {
+        PLOG_WARNING << what << " | <" << errorCode << "> " << errMsg
+                     << " Further failures are only counted until a frame goes through.";
+    }
+}
+
+// Fires voice_callback_exit however the callback returns.
+struct VoiceCallbackExitProbe {
+    ~VoiceCallbackExitProbe() { HIKBRIDGE_PROBE(voice_callback_exit); }
+};
+
 void hikVoiceCommunicationsCallback(
         HikVoiceComHandle lVoiceComHandle,
         char *pRecvDataBuffer,
         DWORD dwBufSize,
         [[maybe_unused]] BYTE byAudioFlag,
-        [[maybe_unused]] void* pUser
+        void* pUser
 ) {
-    assert(dwBufSize == sizeof(soundcardReadBuffer));
-    if (!hikRelayEnabled) {
+    HIKBRIDGE_PROBE1(voice_callback_entry, dwBufSize);
+    VoiceCallbackExitProbe exitProbe;
+    ALLOCATION_STAGE(voiceCallback);
+    // pUser is the channel the session was started for. Replay's stand-in SDK thread passes none,
+    // and only ever talks on the primary channel.
+    VoiceChannel &channel = pUser != nullptr ? *static_cast<VoiceChannel *>(pUser) : voiceChannel(0);
+    // Recordings and announcements follow the primary channel.
+    bool isPrimary = channel.slot == 0;
+    if (!channel.relayEnabled) {
         PLOG_INFO << "Hik relay is disabled, so we're going to short circuit the mutex/CV dance.";
         return;
     }
-    std::unique_lock<std::mutex> soundcardReadBufferLock(soundcardReadBufferMutex);
-    soundcardReadBufferCV.notify_one();
-    soundcardReadBufferCV.wait(soundcardReadBufferLock);
-    memcpy(pRecvDataBuffer, soundcardReadBuffer, dwBufSize);
-    soundcardReadBufferLock.unlock();
-    soundcardReadBufferCV.notify_one();
+    // The SDK's buffer arrives holding what the device heard, and leaves holding what we send.
+    if (isPrimary) {
+        conversationRecorder.record(RecordedDirection::incoming, pRecvDataBuffer, dwBufSize);
+    }
+    Heartbeat &senderBeat = heartbeat((HeartbeatId) (senderHeartbeat + channel.slot));
+    CallbackHeartbeat callbackHeartbeat(senderBeat, "waiting-for-capture");
+    DWORD periodSize = (DWORD) channel.handoff.take(pRecvDataBuffer, dwBufSize);
+    senderBeat.setState("sending");
 
-    if (!hikRelayEnabled) {
+    if (!channel.relayEnabled) {
         PLOG_INFO << "Hik relay is disabled, so we're going to short circuit the voice comm call.";
         return;
     }
+    if (isPrimary && announcementPlayer.isReplacingMicrophone()) {
+        return;
+    }
 
-    if (NET_DVR_VoiceComSendData(lVoiceComHandle, pRecvDataBuffer, dwBufSize)) {
-        PLOG_DEBUG << "Successfully sent " << dwBufSize << " bytes of audio to the Hik device.";
-    } else {
-        PLOG_WARNING << obtainHikSDKErrorMsg("Failed sending audio to the Hik device.");
+    BOOL sendSuccessful = isReplaying()
+        ? replayVoiceComSendData(lVoiceComHandle, pRecvDataBuffer, periodSize)
+        : NET_DVR_VoiceComSendData(lVoiceComHandle, pRecvDataBuffer, periodSize);
+    HIKBRIDGE_PROBE2(voice_send, sendSuccessful, periodSize);
+    if (sendSuccessful) {
+        if (isPrimary) {
+            conversationRecorder.record(RecordedDirection::outgoing, pRecvDataBuffer, periodSize);
+        }
+        PLOG_DEBUG << "Successfully sent " << periodSize << " bytes of audio to the Hik device.";
+    }
+    noteVoiceSend(sendSuccessful, "Failed sending audio to the Hik device.");
+}
+
+// Rides the tamper flag: capture stops waiting on the channel's sender and restarts its voice talk.
+void requestVoiceChannelRestart(VoiceChannel &channel) {
+    channel.restartRequested = true;
+    channel.handoff.wakeAll();
+}
+
+void requestVoiceTalkRestart() {
+    for (int slot = 0; slot < MAX_VOICE_ROUTES; slot++) {
+        requestVoiceChannelRestart(voiceChannel(slot));
     }
 }
 
-void startVoiceCommunications(bool restart = false, unsigned short retryNum = 1) {
-    std::unique_lock<std::mutex> lk(voiceComHandleMutex);
-    if (restart && voiceComHandle < 0) {
+// Done once nothing that's still up has a restart pending.
+bool voiceTalkRestarted() {
+    for (int slot = 0; slot < MAX_VOICE_ROUTES; slot++) {
+        if (voiceChannel(slot).restartRequested && voiceChannel(slot).handle >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void startVoiceCommunications(VoiceChannel &channel, bool restart = false, unsigned short retryNum = 1) {
+    std::unique_lock<std::mutex> lk(channel.handleMutex);
+    if (restart && channel.handle < 0) {
         PLOG_INFO << "No voice comms to restart. Abandoning...";
         return;
     } else if (restart) {
         PLOG_INFO << "Restarting voice comms...";
+    } else if (!isReplaying() && !supervisor.isHealthy(DEVICE_SESSION_SUBSYSTEM)) {
+        PLOG_WARNING << "The device session is not up, so voice comms can't be started yet.";
+        return;
     } else {
-        PLOG_INFO << "Starting voice communications on session id <" << sessionId << ">";
+        PLOG_INFO << "Starting voice communications on voice channel <" << channel.number
+                  << "> of session id <" << sessionId << ">";
     }
 
-    HikVoiceComHandle voiceComHandleCandidate = NET_DVR_StartVoiceCom_MR_V30(
+    HikVoiceComHandle voiceComHandleCandidate = isReplaying()
+        ? replayStartVoiceCom(hikVoiceCommunicationsCallback)
+        : NET_DVR_StartVoiceCom_MR_V30(
             sessionId,
-            1,
+            channel.number,
             hikVoiceCommunicationsCallback,
-            nullptr
-    );
+            &channel
+        );
     if (voiceComHandleCandidate < 0) {
         PLOG_ERROR << obtainHikSDKErrorMsg("Failed to establish voice comms.");
         if (retryNum < 4) {
             lk.unlock();
             PLOG_WARNING << "Retry num " << retryNum;
-            return startVoiceCommunications(restart, retryNum + 1);
+            return startVoiceCommunications(channel, restart, retryNum + 1);
         } else {
-            shutdown(obtainHikSDKErrorMsg("Failed to establish voice comms."));
+            supervisor.reportFault(
+                DEVICE_SESSION_SUBSYSTEM,
+                obtainHikSDKErrorMsg("Failed to establish voice comms.")
+            );
         }
     } else {
         PLOG_INFO << "Successfully started voice communications with handle <" << voiceComHandleCandidate << ">";
+        flightRecordSdkCall("NET_DVR_StartVoiceCom_MR_V30", voiceComHandleCandidate, 0);
+        if (!restart && channel.slot == 0) {
+            conversationRecorder.beginSession(*negotiatedCodec.load());
+        }
+    }
+    channel.handle = voiceComHandleCandidate;
+}
+
+// The announcement player's own timer sends through here while a clip replaces the microphone.
+// Clips only play on the primary channel.
+bool sendAnnouncementFrame(const char *frame, size_t size) {
+    ALLOCATION_STAGE(announcement);
+    VoiceChannel &channel = voiceChannel(0);
+    std::unique_lock<std::mutex> lk(channel.handleMutex);
+    if (channel.handle < 0 || !channel.relayEnabled) {
+        return false;
+    }
+    BOOL sendSuccessful = isReplaying()
+        ? replayVoiceComSendData(channel.handle, const_cast<char *>(frame), (DWORD) size)
+        : NET_DVR_VoiceComSendData(channel.handle, const_cast<char *>(frame), (DWORD) size);
+    HIKBRIDGE_PROBE2(voice_send, sendSuccessful, size);
+    if (sendSuccessful) {
+        conversationRecorder.record(RecordedDirection::outgoing, frame, size);
     }
-    voiceComHandle = voiceComHandleCandidate;
+    noteVoiceSend(sendSuccessful, "Failed sending an announcement frame to the Hik device.");
+    return sendSuccessful;
 }
 
-void callDoorbell(int retryNum = 0) {
+[[noreturn]] void runAnnouncementPlayer(SupervisedSubsystem &subsystem) {
+    sdkInitialized.wait();
+    announcementPlayer.run(
+        subsystem,
+        configStore.get()->announcements.directory,
+        encoderPool,
+        [] { return negotiatedCodec.load(); },
+        sendAnnouncementFrame
+    );
+}
+
+// One per calling thread, kept across rings so each one doesn't set up a client (and a connection)
+// from scratch. It's only rebuilt when a reload points the doorbell somewhere else.
+class DoorbellConnection {
+public:
+    httplib::Client &to(const WebhookTarget &doorbell) {
+        if (!client || doorbell.host != host || doorbell.port != port) {
+            host = doorbell.host;
+            port = doorbell.port;
+            std::stringstream ss;
+            ss << "http://" << host << ":" << port;
+            client = std::make_unique<httplib::Client>(ss.str());
+            client->set_url_encode(true);
+            client->set_keep_alive(true);
+        }
+        return *client;
+    }
+
+private:
+    std::string host;
+    unsigned short port = 0;
+    std::unique_ptr<httplib::Client> client;
+};
+
+bool callDoorbell(DoorbellConnection &connection, const WebhookTarget &doorbell, int maxRetries = 3, int retryNum = 0) {
     if (retryNum > 0) {
         PLOG_WARNING << "Doorbell call retry number " << retryNum;
     }
-    std::stringstream ss;
-    ss << "http://" << doorbellHost << ":" << doorbellPort;
-    httplib::Client doorbellHttpCall(ss.str());
-    doorbellHttpCall.set_url_encode(true);
-
-    PLOG_INFO << "Notifying doorbell service @ " << ss.str() << doorbellPath.c_str();
-    auto res = doorbellHttpCall.Get(doorbellPath.c_str());
-    PLOG_INFO << "Received result status: " << res->status;
-    if (res->status >= 300 && retryNum < 3) {
+    httplib::Client &doorbellHttpCall = connection.to(doorbell);
+
+    PLOG_INFO << "Notifying doorbell service @ " << doorbell.host << ":" << doorbell.port << doorbell.path;
+    HIKBRIDGE_PROBE1(webhook_start, retryNum);
+    auto res = doorbellHttpCall.Get(doorbell.path.c_str());
+    int status = res ? res->status : -1;
+    HIKBRIDGE_PROBE2(webhook_finish, retryNum, status);
+    PLOG_INFO << "Received result status: " << status;
+    if ((status < 0 || status >= 300) && retryNum < maxRetries) {
         PLOG_WARNING << "The result is unexpected. Retrying...";
-        callDoorbell(retryNum + 1);
-    } else if (res->status >= 300) {
+        return callDoorbell(connection, doorbell, maxRetries, retryNum + 1);
+    } else if (status < 0 || status >= 300) {
         PLOG_ERROR << "Exhausted retries, but unable to make the doorbell HTTP callback :(";
+        return false;
     } else {
         PLOG_INFO << "Doorbell callback was successful";
+        return true;
+    }
+}
+
+WebhookSpool webhookSpool(WEBHOOK_SPOOL_DIRECTORY);
+MqttClient mqttClient;
+
+std::string mqttTopic(const std::string &suffix) {
+    return configStore.get()->mqtt.topicPrefix + "/" + suffix;
+}
+
+// Retained, so Home Assistant knows whether voice talk is live as soon as it subscribes. The
+// primary channel keeps the plain relay topic; the others publish to relay/<voice channel>.
+void publishRelayState(const VoiceChannel &channel, bool relaying) {
+    std::string topic = channel.slot == 0
+        ? mqttTopic("relay")
+        : mqttTopic("relay/" + std::to_string(channel.number.load()));
+    mqttClient.publish(topic, relaying ? "on" : "off", true);
+}
+
+[[noreturn]] void runMqttClient(SupervisedSubsystem &subsystem) {
+    mqttClient.run(subsystem, configStore.get()->mqtt);
+}
+
+// The notifier already retried each of these, so redelivery is a single attempt per backoff.
+void runWebhookSpoolReplayer(SupervisedSubsystem &subsystem) {
+    DoorbellConnection connection;
+    webhookSpool.runReplayer(subsystem, [&connection](const SpooledDelivery &ring) {
+        PLOG_INFO << "Redelivering a ring from " << (currTimeInMillis() - ring.ringAtMillis) / 1000 << " s ago.";
+        return callDoorbell(connection, ring.target, 0);
+    });
+}
+
+void requestDoorbellRing() {
+    {
+        std::lock_guard<std::mutex> lk(doorbellRingsMutex);
+        pendingDoorbellRings++;
     }
+    doorbellRingsCV.notify_one();
+}
+
+[[noreturn]] void runNotifier(SupervisedSubsystem &subsystem) {
+    HeartbeatScope heartbeatScope(heartbeat(notifierHeartbeat));
+    DoorbellConnection connection;
+    subsystem.markHealthy();
+    while (true) {
+        heartbeat(notifierHeartbeat).beat("waiting-for-rings");
+        std::unique_lock<std::mutex> lk(doorbellRingsMutex);
+        doorbellRingsCV.wait_for(lk, std::chrono::milliseconds(100), [] { return pendingDoorbellRings > 0; });
+        subsystem.checkForFault();
+        if (pendingDoorbellRings == 0) {
+            continue;
+        }
+        pendingDoorbellRings--;
+        lk.unlock();
+
+        heartbeat(notifierHeartbeat).beat("calling-doorbell");
+        SpooledDelivery ring { configStore.get()->doorbell, currTimeInMillis() };
+        if (webhookSpool.hasBacklog(ring.target)) {
+            PLOG_INFO << "Spooling the ring behind the ones still waiting for the doorbell service.";
+            webhookSpool.append(ring);
+        } else if (callDoorbell(connection, ring.target)) {
+            subsystem.markHealthy();
+        } else {
+            subsystem.markDegraded("The doorbell service is not accepting rings.");
+            if (webhookSpool.append(ring)) {
+                PLOG_INFO << "Spooled the ring to redeliver once the doorbell service is back.";
+            } else {
+                PLOG_ERROR << "Couldn't spool the ring either. It's lost.";
+            }
+        }
+    }
+}
+
+EventCoalescer alarmCoalescer;
+EventBroadcaster eventBroadcaster;
+DoorCommandWorker doorCommandWorker;
+IntercomEventQueues intercomEventQueues;
+
+void appendNumber(std::string &out, long value) {
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%ld", value);
+    out += digits;
+}
 
+// Renders into the handler's own buffer, which stops growing after the first few events.
+// occurrences counts the event's coalescing window so far, this one included.
+void renderIntercomEventJson(std::string &json, const IntercomEvent &event, const CoalescedEvent &coalescing) {
+    json.assign("{\"device\":\"");
+    appendJsonEscaped(json, event.device);
+    json += "\",\"at\":";
+    appendNumber(json, event.receivedAt);
+    json.append(",\"kind\":\"").append(intercomEventKindName(event.kind)).append("\",\"command\":");
+    appendNumber(json, event.command);
+    if (event.subType >= 0) {
+        json += ",\"subType\":";
+        appendNumber(json, event.subType);
+        json.append(",\"deviceTime\":\"").append(event.deviceTime).append("\"");
+    }
+    if (event.lockId >= 0) {
+        json += ",\"lockId\":";
+        appendNumber(json, event.lockId);
+    }
+    switch (event.kind) {
+        case IntercomEventKind::zoneAlarm:
+            json += ",\"zone\":";
+            appendNumber(json, (long) event.zoneIndex);
+            json += ",\"zoneType\":";
+            appendNumber(json, event.zoneType);
+            json += ",\"zoneName\":\"";
+            appendJsonEscaped(json, event.zoneName);
+            json += "\"";
+            break;
+        case IntercomEventKind::unlock:
+            json += ",\"unlockType\":";
+            appendNumber(json, event.unlockType);
+            json += ",\"source\":\"";
+            appendJsonEscaped(json, event.credential);
+            json += "\"";
+            break;
+        case IntercomEventKind::cardSwipe:
+            json += ",\"card\":\"";
+            appendJsonEscaped(json, event.credential);
+            json.append("\",\"valid\":").append(event.subType == INVALID_CARD_SWIPE_EVENT ? "false" : "true");
+            break;
+        case IntercomEventKind::doorStatus:
+            json.append(",\"open\":").append(event.doorOpen ? "true" : "false");
+            break;
+        default:
+            break;
+    }
+    json.append(",\"coalesced\":").append(coalescing.dispatch ? "false" : "true");
+    json += ",\"occurrences\":";
+    appendNumber(json, coalescing.occurrences);
+    json += "}";
+}
+
+// MQTT only hears about what HikBridge acted on, which is what automations want. Repeats folded
+// into a bell or tamper alarm go to <kind>/coalesced instead, so the running count is visible
+// without retriggering anything. The device reports unlocks but never the relock, so those go out
+// as events, while the door contact is real state.
+void publishIntercomEventToMqtt(const IntercomEvent &event, const std::string &json, bool coalesced) {
+    if (coalesced) {
+        if (event.kind == IntercomEventKind::bell || event.kind == IntercomEventKind::tamper) {
+            mqttClient.publish(mqttTopic(intercomEventKindName(event.kind) + std::string("/coalesced")), json, false);
+        }
+        return;
+    }
+    switch (event.kind) {
+        case IntercomEventKind::bell:
+        case IntercomEventKind::tamper:
+        case IntercomEventKind::cardSwipe:
+            mqttClient.publish(mqttTopic(intercomEventKindName(event.kind)), json, false);
+            break;
+        case IntercomEventKind::unlock:
+            mqttClient.publish(mqttTopic("lock/" + std::to_string(event.lockId) + "/unlocked"), json, false);
+            break;
+        case IntercomEventKind::lockAlarm:
+            mqttClient.publish(mqttTopic("lock/" + std::to_string(event.lockId) + "/alarm"), json, false);
+            break;
+        case IntercomEventKind::zoneAlarm:
+            mqttClient.publish(mqttTopic("zone/" + std::to_string(event.zoneIndex) + "/alarm"), json, false);
+            break;
+        case IntercomEventKind::doorStatus:
+            mqttClient.publish(mqttTopic("door"), event.doorOpen ? "open" : "closed", true);
+            break;
+        default:
+            break;
+    }
+}
+
+// Looked up once per alarm type rather than by name on every alarm.
+struct AlarmEventCounters {
+    Counter &dispatched;
+    Counter &coalesced;
+};
+
+AlarmEventCounters alarmEventCounters(const char *alarmName) {
+    auto counter = [alarmName](const char *outcome) -> Counter & {
+        std::string labels = std::string("{type=\"") + alarmName + "\",outcome=\"" + outcome + "\"}";
+        return metrics().counter("hikbridge_alarm_events_total" + labels, "Intercom alarms, and whether they were acted on or coalesced.");
+    };
+    return { counter("dispatched"), counter("coalesced") };
 }
 
+// dispatch is true when the alarm should be acted on; repeats inside the window are only counted.
+CoalescedEvent admitAlarm(const char *deviceKey, int alarmType, const char *alarmName, const AlarmEventCounters &counters, long windowMillis) {
+    CoalescedEvent event = alarmCoalescer.admit(deviceKey, alarmType, windowMillis, heartbeatClockInMillis());
+    (event.dispatch ? counters.dispatched : counters.coalesced).increment();
+    if (!event.dispatch) {
+        PLOG_INFO << "Coalesced " << alarmName << " alarm #" << event.occurrences << " from " << deviceKey
+                  << " into the one already dispatched.";
+    }
+    return event;
+}
+
+// Voice talk only runs on the device HikBridge is logged in to. Armed, every alarm comes over its
+// session; behind the listener any station can push, and it's that device only when it pushes from
+// the configured host.
+bool isLoggedInDevice(const char *device) {
+    std::shared_ptr<const BridgeConfig> config = configStore.get();
+    return config->listener.port == 0 || config->device.host == device;
+}
+
+// Everything the SDK callback used to do itself. /events subscribers see every event, coalesced
+// or not; coalesced says whether HikBridge acted on it, and occurrences how many it folded in.
+void routeIntercomEvent(const IntercomEvent &event, std::string &json) {
+    static const AlarmEventCounters bellCounters = alarmEventCounters("bell");
+    static const AlarmEventCounters tamperCounters = alarmEventCounters("tamper");
+    PLOG_INFO << "Received " << intercomEventKindName(event.kind) << " <" << event.command << "/" << event.subType
+              << "> from " << event.device;
+    char flightText[FLIGHT_RECORDER_TEXT_BYTES];
+    snprintf(
+        flightText, sizeof(flightText), "%s %ld/%d from %s",
+        intercomEventKindName(event.kind), (long) event.command, event.subType, event.device
+    );
+    flightRecordEvent(flightText);
+    CoalescingConfig coalescing = configStore.get()->coalescing;
+    CoalescedEvent admitted { true, 1 };
+    if (event.kind == IntercomEventKind::bell) {
+        PLOG_INFO << "Bell button was pressed";
+        admitted = admitAlarm(event.device, BELL_PRESSED_ALARM, "bell", bellCounters, coalescing.bellWindowMillis);
+        if (admitted.dispatch) {
+            requestDoorbellRing();
+            AnnouncementsConfig announcements = configStore.get()->announcements;
+            if (!announcements.bellClip.empty() && !announcementPlayer.play(announcements.bellClip, announcements.mix)) {
+                PLOG_WARNING << "Couldn't play announcement " << announcements.bellClip << " for the bell press.";
+            }
+        }
+    } else if (event.kind == IntercomEventKind::tamper) {
+        PLOG_INFO << "The intercom thinks it's being fucked with";
+        admitted = admitAlarm(event.device, TAMPER_ALARM, "tamper", tamperCounters, coalescing.tamperWindowMillis);
+        if (admitted.dispatch && isLoggedInDevice(event.device)) {
+            requestVoiceTalkRestart();
+        } else if (admitted.dispatch) {
+            PLOG_INFO << event.device << " isn't the logged-in device, so its tamper alarm leaves voice talk alone.";
+        }
+    }
+
+    if (isReplaying()) {
+        replayRecordRoutedAlarm(event.device, event.subType, admitted.dispatch);
+    }
+    renderIntercomEventJson(json, event, admitted);
+    eventBroadcaster.publish(intercomEventKindName(event.kind), json);
+    publishIntercomEventToMqtt(event, json, !admitted.dispatch);
+}
+
+// Microseconds, since anywhere near a millisecond means the callback is doing too much again.
+Histogram &alarmCallbackDwell() {
+    static Histogram &histogram = metrics().histogram(
+        "hikbridge_alarm_callback_dwell_us",
+        "Time the SDK's alarm thread spends in HikBridge's callback.",
+        { 1, 2, 5, 10, 25, 50, 100, 250, 1000, 10000 }
+    );
+    return histogram;
+}
+
+// Only decodes into a queue slot and wakes a handler, so the SDK's alarm thread is handed back
+// in microseconds whatever the handlers are stuck on.
 void hikEventsCallback(
     LONG lCommand,
-    [[maybe_unused]] NET_DVR_ALARMER *pAlarmer,
+    NET_DVR_ALARMER *pAlarmer,
     char *pAlarmInfo,
     [[maybe_unused]] DWORD dwBufLen,
     [[maybe_unused]] void* pUser
 ) {
-    if (lCommand == COMM_ALARM_VIDEO_INTERCOM) {
-        auto *videoIntercomAlarm = reinterpret_cast<NET_DVR_VIDEO_INTERCOM_ALARM *>(pAlarmInfo);
-        PLOG_INFO << "Received Hik video intercom alarm: <" << (int) videoIntercomAlarm->byAlarmType << ">";
-        if (videoIntercomAlarm->byAlarmType == 0x11) {
-            PLOG_INFO << "Bell button was pressed";
-            callDoorbell();
-        } else if (videoIntercomAlarm->byAlarmType == 0x12) {
-            PLOG_INFO << "The intercom thinks it's being fucked with";
-            intercomGotFuckedWith = true;
-            soundcardReadBufferCV.notify_one();
+    HIKBRIDGE_PROBE1(alarm_callback_entry, lCommand);
+    ALLOCATION_STAGE(alarmCallback);
+    auto enteredAt = std::chrono::steady_clock::now();
+    CallbackHeartbeat callbackHeartbeat(heartbeat(alarmCallbackHeartbeat), "decoding");
+    if (!decodeIntercomEvent(lCommand, pAlarmer, pAlarmInfo, currTimeInMillis(), intercomEventQueues)) {
+        PLOG_WARNING << "Dropped Hik device event <" << lCommand << ">: its handler's queue is full.";
+    }
+    alarmCallbackDwell().observe(
+        (double) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - enteredAt).count()
+    );
+    HIKBRIDGE_PROBE1(alarm_callback_exit, lCommand);
+}
+
+static_assert(
+    eventHandler3Heartbeat - eventHandler0Heartbeat + 1 == INTERCOM_HANDLER_THREADS,
+    "Every event handler needs its own heartbeat."
+);
+
+[[noreturn]] void runEventHandler(SupervisedSubsystem &subsystem, int handler) {
+    Heartbeat &handlerHeartbeat = heartbeat((HeartbeatId) (eventHandler0Heartbeat + handler));
+    IntercomEventQueue &queue = intercomEventQueues.forHandler(handler);
+    HeartbeatScope heartbeatScope(handlerHeartbeat);
+    subsystem.markHealthy();
+    IntercomEvent event {};
+    std::string json;
+    json.reserve(EVENT_FRAME_RESERVE_BYTES);
+    while (true) {
+        handlerHeartbeat.beat("waiting-for-events");
+        subsystem.checkForFault();
+        while (queue.pop(event)) {
+            handlerHeartbeat.beat("routing");
+            ALLOCATION_STAGE(eventHandler);
+            routeIntercomEvent(event, json);
         }
-    } else {
-        PLOG_INFO << "Received Hik device event <" << lCommand << ">.";
+        queue.awaitPush(100);
+    }
+}
+
+// Reads its bind address afresh on every run, so a reload only has to restart this subsystem.
+// Every /events subscriber holds a thread, so the pool is sized for all of them plus a few
+// for everything else.
+#define HTTP_REQUEST_THREADS 4
+
+[[noreturn]] void runHttpServer(SupervisedSubsystem &subsystem) {
+    HttpConfig http = configStore.get()->http;
+    if (http.port == 0) {
+        PLOG_INFO << "The HTTP server is turned off.";
+        subsystem.markHealthy();
+        subsystem.awaitFault();
+    }
+
+    httplib::Server server;
+    server.new_task_queue = [] { return new httplib::ThreadPool(MAX_EVENT_SUBSCRIBERS + HTTP_REQUEST_THREADS); };
+    server.set_write_timeout(5, 0);
+    addEventStreamRoute(server, eventBroadcaster);
+    addDoorControlRoutes(server, doorCommandWorker);
+    addAnnouncementRoutes(server, announcementPlayer, [] { return configStore.get()->announcements.mix; });
+    server.Get("/metrics", [](const httplib::Request &, httplib::Response &res) {
+#ifdef HIKBRIDGE_ALLOCATION_AUDIT
+        res.set_content(metrics().render() + renderAllocationAudit(), "text/plain; version=0.0.4");
+#else
+        res.set_content(metrics().render(), "text/plain; version=0.0.4");
+#endif
+    });
+    if (!server.bind_to_port(http.bind, http.port)) {
+        std::stringstream ss;
+        ss << "Failed to listen for HTTP on " << http.bind << ":" << http.port;
+        throw SubsystemFault(ss.str());
+    }
+    std::thread listener([&server] { server.listen_after_bind(); });
+    PLOG_INFO << "Serving HTTP on " << http.bind << ":" << http.port;
+    subsystem.markHealthy();
+    try {
+        subsystem.awaitFault();
+    } catch (...) {
+        eventBroadcaster.disconnectAll();
+        server.stop();
+        listener.join();
+        throw;
     }
-    PLOG_INFO << "Finished processing Hik device event";
 }
 
 HikEventListeningHandle registerForHikEvents() {
@@ -265,22 +820,208 @@ HikEventListeningHandle registerForHikEvents() {
 
     HikEventListeningHandle handle = NET_DVR_SetupAlarmChan_V41(sessionId, &setupParam);
     if (handle < 0) {
-        shutdown(obtainHikSDKErrorMsg("Failed to register for events for Hik device."));
+        throw SubsystemFault(obtainHikSDKErrorMsg("Failed to register for events for Hik device."));
     }
     PLOG_INFO << "Successfully registered for receiving Hik device events with handle <" << handle << ">";
     return handle;
 }
 
-void stopVoiceCommunications() {
-    PLOG_INFO << "Wrapping up voice communications on session id <" << sessionId << ">";
-
-    std::unique_lock<std::mutex> lk(voiceComHandleMutex);
-    if (!NET_DVR_StopVoiceCom(voiceComHandle)) {
-        shutdown(obtainHikSDKErrorMsg("Failed to tear down voice comms."));
+void stopVoiceCommunications(VoiceChannel &channel) {
+    std::unique_lock<std::mutex> lk(channel.handleMutex);
+    if (channel.handle < 0) {
+        return;
+    }
+    PLOG_INFO << "Wrapping up voice communications on voice channel <" << channel.number
+              << "> of session id <" << sessionId << ">";
+    BOOL stopSuccessful = isReplaying()
+        ? replayStopVoiceCom(channel.handle)
+        : NET_DVR_StopVoiceCom(channel.handle);
+    if (!stopSuccessful) {
+        supervisor.reportFault(DEVICE_SESSION_SUBSYSTEM, obtainHikSDKErrorMsg("Failed to tear down voice comms."));
     } else {
         PLOG_INFO << "Successfully wrapped up voice communications on session id <" << sessionId << ">";
+        flightRecordSdkCall("NET_DVR_StopVoiceCom", 1, 0);
+    }
+    channel.handle = -1;
+    if (channel.slot == 0) {
+        conversationRecorder.endSession();
     }
-    voiceComHandle = -1;
+}
+
+void hangUpVoiceChannel(VoiceChannel &channel, const char *reason) {
+    channel.relayEnabled = false;
+    channel.handoff.wake();
+    stopVoiceCommunications(channel);
+    flightRecordRelay(false, reason);
+    HIKBRIDGE_PROBE1(relay_change, 0);
+    publishRelayState(channel, false);
+}
+
+void applyAudioSettings() {
+    NET_DVR_COMPRESSION_AUDIO currentSettings = { 0 };
+    DWORD returned = 0;
+    if (
+        NET_DVR_GetDVRConfig(
+            sessionId,
+            NET_DVR_GET_COMPRESSCFG_AUD,
+            1,
+            &currentSettings,
+            sizeof(currentSettings),
+            &returned
+        ) &&
+        currentSettings.byAudioEncType == AUDIOTALKTYPE_G711_MU
+    ) {
+        PLOG_INFO << "The Hik device's audio settings already match. Not rewriting them.";
+        return;
+    }
+
+    NET_DVR_COMPRESSION_AUDIO audioSettings = { 0 };
+    audioSettings.byAudioEncType = AUDIOTALKTYPE_G711_MU;
+    audioSettings.byAudioSamplingRate = 5;
+    audioSettings.byAudioBitRate = BITRATE_ENCODE_128kps;
+    audioSettings.bySupport = 0;
+    if (!NET_DVR_SetDVRConfig(
+        sessionId,
+        NET_DVR_SET_COMPRESSCFG_AUD,
+        1,
+        &audioSettings,
+        sizeof(audioSettings)
+    )) {
+        throw SubsystemFault(obtainHikSDKErrorMsg("Failed to set audio settings"));
+    } else {
+        PLOG_INFO << "Successfully set Hik device audio settings.";
+    }
+}
+
+// Encodes in whatever the device already talks, and only falls back to forcing G.711 mu-law
+// when that's a codec the bridge can't produce.
+void negotiateAudioCodec(const std::string &deviceKey) {
+    NET_DVR_COMPRESSION_AUDIO currentSettings = { 0 };
+    if (!NET_DVR_GetCurrentAudioCompress(sessionId, &currentSettings)) {
+        throw SubsystemFault(obtainHikSDKErrorMsg("Failed to query the device's voice talk codec"));
+    }
+    const CodecProfile *profile = findCodecProfile(currentSettings.byAudioEncType);
+    if (profile == nullptr) {
+        PLOG_WARNING << "The device talks audio encoding type <" << (int) currentSettings.byAudioEncType
+                     << ">, which HikBridge can't encode. Switching it to G.711 mu-law.";
+        applyAudioSettings();
+        profile = &codecProfile(VoiceCodec::g711MuLaw);
+    }
+    encoderPool.beginSession();
+    PLOG_INFO << "Voice talk will be encoded as " << profile->name << " @ " << profile->sampleRate << " Hz";
+    if (negotiatedCodec.exchange(profile) != profile) {
+        storeCachedAudioEncType(deviceKey, profile->hikAudioEncType);
+    }
+}
+
+void endDeviceSession() {
+    for (int slot = 0; slot < MAX_VOICE_ROUTES; slot++) {
+        VoiceChannel &channel = voiceChannel(slot);
+        std::unique_lock<std::mutex> lk(channel.handleMutex);
+        if (channel.handle >= 0) {
+            channel.relayEnabled = false;
+            channel.handoff.wakeAll();
+            NET_DVR_StopVoiceCom(channel.handle);
+            channel.handle = -1;
+            if (slot == 0) {
+                conversationRecorder.endSession();
+            }
+            flightRecordRelay(false, "device session ended");
+            HIKBRIDGE_PROBE1(relay_change, 0);
+            publishRelayState(channel, false);
+        }
+    }
+    if (sessionId >= 0) {
+        PLOG_INFO << "Logging out of session id <" << sessionId << ">";
+        NET_DVR_Logout(sessionId);
+        sessionId = -1;
+    }
+}
+
+std::string deviceCacheKey(const DeviceCoordinates &device) {
+    return device.host + ":" + std::to_string(device.port);
+}
+
+// Reads the device's coordinates afresh on every run, so a config reload that changes them only
+// has to restart this subsystem.
+[[noreturn]] void runDeviceSession(SupervisedSubsystem &subsystem) {
+    DeviceCoordinates device = configStore.get()->device;
+    try {
+        sessionId = logInToDevice(device);
+        startupTimeline().mark("logged-in");
+        negotiateAudioCodec(deviceCacheKey(device));
+        startupTimeline().mark("codec-negotiated");
+        subsystem.markHealthy();
+        subsystem.awaitFault();
+    } catch (...) {
+        endDeviceSession();
+        throw;
+    }
+}
+
+[[noreturn]] void runAlarmChannel(SupervisedSubsystem &subsystem) {
+    if (configStore.get()->listener.port != 0) {
+        PLOG_INFO << "Not arming the device: its alarms are pushed to the alarm listener.";
+        subsystem.markHealthy();
+        startupTimeline().markArmed();
+        subsystem.awaitFault();
+    }
+    HikEventListeningHandle handle = registerForHikEvents();
+    subsystem.markHealthy();
+    startupTimeline().markArmed();
+    try {
+        subsystem.awaitFault();
+    } catch (...) {
+        PLOG_INFO << "Closing alarm channel with handle <" << handle << ">";
+        NET_DVR_CloseAlarmChan_V30(handle);
+        throw;
+    }
+}
+
+// One socket for every device that pushes alarms to HikBridge. The SDK calls back with each one's
+// NET_DVR_ALARMER, which is what hands it to that device's handler.
+[[noreturn]] void runAlarmListener(SupervisedSubsystem &subsystem) {
+    ListenerConfig listener = configStore.get()->listener;
+    if (listener.port == 0) {
+        subsystem.markHealthy();
+        subsystem.awaitFault();
+    }
+    std::vector<char> bind(listener.bind.begin(), listener.bind.end());
+    bind.push_back('\0');
+    LONG handle = NET_DVR_StartListen_V30(bind.data(), listener.port, hikEventsCallback, nullptr);
+    if (handle < 0) {
+        std::stringstream ss;
+        ss << "Failed to listen for pushed alarms on " << listener.bind << ":" << listener.port;
+        throw SubsystemFault(obtainHikSDKErrorMsg(ss.str()));
+    }
+    PLOG_INFO << "Listening for pushed alarms on " << listener.bind << ":" << listener.port << " with handle <" << handle << ">";
+    subsystem.markHealthy();
+    try {
+        subsystem.awaitFault();
+    } catch (...) {
+        NET_DVR_StopListen_V30(handle);
+        throw;
+    }
+}
+
+// The outdoor stations answer to gateway 1 and pick the door by lock id.
+std::string openDoor(int lockId) {
+    NET_DVR_CONTROL_GATEWAY gatewayControl = { 0 };
+    gatewayControl.dwSize = sizeof(gatewayControl);
+    gatewayControl.dwGatewayIndex = 1;
+    gatewayControl.byCommand = 1;
+    gatewayControl.wLockID = (WORD) lockId;
+    gatewayControl.byControlType = 1;
+    strncpy((char *) gatewayControl.byControlSrc, "HikBridge", sizeof(gatewayControl.byControlSrc) - 1);
+    if (!NET_DVR_RemoteControl(sessionId, NET_DVR_REMOTECONTROL_GATEWAY, &gatewayControl, sizeof(gatewayControl))) {
+        return obtainHikSDKErrorMsg("The device refused to open the door");
+    }
+    return "";
+}
+
+// A child of the device session, so it only takes requests while there's a session to send them over.
+[[noreturn]] void runDoorCommandWorker(SupervisedSubsystem &subsystem) {
+    doorCommandWorker.run(subsystem, openDoor);
 }
 
 void alsaErrorLogger(
@@ -301,18 +1042,77 @@ void alsaErrorLogger(
     PLOG_ERROR << buff;
 }
 
-long currTimeInMillis() {
-    struct timeval tv {};
-    gettimeofday(&tv, nullptr);
-    return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
-};
+// Rates to open the card at when it can't run at the codec's rate, best first. Every one gives a
+// whole number of card frames per codec frame.
+static const unsigned int NATIVE_CAPTURE_RATES[] = { 48000, 44100, 32000, 96000, 16000 };
 
-long currTimeInSeconds() {
-    return currTimeInMillis() / 1000;
+unsigned int chooseCaptureRate(snd_pcm_t *captureHandle, const CodecProfile &codec) {
+    snd_pcm_hw_params_t *hwParams;
+    snd_pcm_hw_params_alloca(&hwParams);
+    if (
+        snd_pcm_hw_params_any(captureHandle, hwParams) < 0 ||
+        snd_pcm_hw_params_set_format(captureHandle, hwParams, SND_PCM_FORMAT_S16_LE) < 0 ||
+        snd_pcm_hw_params_test_rate(captureHandle, hwParams, codec.sampleRate, 0) == 0
+    ) {
+        return codec.sampleRate;
+    }
+    for (unsigned int rate : NATIVE_CAPTURE_RATES) {
+        if (
+            (codec.samplesPerFrame * rate) % codec.sampleRate == 0 &&
+            snd_pcm_hw_params_test_rate(captureHandle, hwParams, rate, 0) == 0
+        ) {
+            return rate;
+        }
+    }
+    return codec.sampleRate;
+}
+
+// Drift compensation keeps about a period waiting in the card's buffer, and drops frames
+// regardless of speech once the backlog gets this many periods deep, well short of an overrun.
+#define DRIFT_TARGET_BACKLOG_PERIODS 1
+#define DRIFT_MAX_BACKLOG_PERIODS 8
+
+// Source 0 keeps the unlabelled series it always had; the others are told apart by a source label.
+std::string captureMetricName(const std::string &name, const std::string &labels, int source) {
+    std::string combined = labels;
+    if (source != 0) {
+        combined += (combined.empty() ? "" : ",") + std::string("source=\"") + std::to_string(source) + "\"";
+    }
+    return combined.empty() ? name : name + "{" + combined + "}";
+}
+
+// One voice channel fed by a capture source. The encoder lease can't move, so these are held by
+// pointer for the life of the capture loop.
+struct RoutedChannel {
+    RoutedChannel(VoiceChannel &channel, const CodecProfile &codec)
+        : channel(channel), encoder(encoderPool.acquire(codec)) {}
+
+    bool isRelaying() const { return channel.handle >= 0 && !channel.restartRequested; }
+
+    VoiceChannel &channel;
+    // This channel's run of the de-interleaved card period, at the card's rate.
+    const int16_t *cardSamples = nullptr;
+    std::optional<PolyphaseResampler> resampler;
+    int16_t resampled[MAX_CODEC_FRAME_SAMPLES] {};
+    // The card run itself, or its resampled copy. VAD keeps looking at this; only what's sent goes
+    // through the DSP chain.
+    const int16_t *pcmPeriod = nullptr;
+    int16_t processedPeriod[MAX_CODEC_FRAME_SAMPLES] {};
+    std::unique_ptr<FrameProcessor> dsp;
+    RelaySilenceTracker silenceTracker;
+    EncoderLease encoder;
+    // pcmPeriod or processedPeriod, whichever this period is sent from.
+    const int16_t *periodToEncode = nullptr;
+    // Whether this period made it into the channel's handoff, and whether the last one didn't.
+    bool delivered = false;
+    bool stalled = false;
 };
 
-[[noreturn]] void soundcardReadLoop(const std::string &soundcardCoordinates) {
-    PLOG_INFO << "Starting reading from soundcard @ " << soundcardCoordinates;
+// A multichannel card is read once per period and de-interleaved into per-channel runs, which
+// each routed voice channel then resamples, processes and encodes from in place.
+void soundcardReadLoop(const CaptureGroup &group, int source, SupervisedSubsystem *subsystem = nullptr) {
+    PLOG_INFO << "Starting reading from soundcard @ " << group.source;
+    Heartbeat &captureBeat = heartbeat((HeartbeatId) (captureHeartbeat + source));
 
     snd_lib_error_set_handler(alsaErrorLogger);
 
@@ -321,64 +1121,310 @@ long currTimeInSeconds() {
         auto sndOpenErrorMsg = checkAlsaError(
             snd_pcm_open(
                 &captureHandle,
-                soundcardCoordinates.c_str(),
+                group.source.c_str(),
                 SND_PCM_STREAM_CAPTURE,
                 0
             )
         )
     ) {
-        shutdown(*sndOpenErrorMsg);
+        throw SubsystemFault(*sndOpenErrorMsg);
     } else {
         PLOG_INFO << "Successfully opened an ALSA capture handle.";
     }
+    std::unique_ptr<snd_pcm_t, decltype(&snd_pcm_close)> captureHandleCloser(captureHandle, snd_pcm_close);
 
-    snd_pcm_format_t format = SND_PCM_FORMAT_MU_LAW;
-    unsigned short numChannels = 1;
-    unsigned int sampleRate = 8000;
-    int allowResampling = 1;
+    const CodecProfile &codec = *negotiatedCodec.load();
+
+    // Replay captures are recorded mu-law, so they're expanded to the linear PCM a live card delivers.
+    snd_pcm_format_t format = isReplaying() ? SND_PCM_FORMAT_MU_LAW : SND_PCM_FORMAT_S16_LE;
+    unsigned short numChannels = (unsigned short) group.channelCount;
+    unsigned int sampleRate = isReplaying() ? codec.sampleRate : chooseCaptureRate(captureHandle, codec);
     unsigned int requiredLatencyInUs = 500000;
-    if (
-        auto pcmSetParamsErrorMsg = checkAlsaError(
-            snd_pcm_set_params(
-                captureHandle,
-                format,
-                SND_PCM_ACCESS_RW_INTERLEAVED,
-                numChannels,
-                sampleRate,
-                allowResampling,
-                requiredLatencyInUs
-            )
-        )
-    ) {
-        shutdown(*pcmSetParamsErrorMsg);
+    auto setCaptureParams = [captureHandle, format, numChannels, requiredLatencyInUs](unsigned int rate, int allowResampling) {
+        return snd_pcm_set_params(
+            captureHandle,
+            format,
+            SND_PCM_ACCESS_RW_INTERLEAVED,
+            numChannels,
+            rate,
+            allowResampling,
+            requiredLatencyInUs
+        );
+    };
+    int setParamsResult = setCaptureParams(sampleRate, 0);
+    if (setParamsResult == -EINVAL) {
+        PLOG_WARNING << "The soundcard can't capture S16 @ " << sampleRate
+                     << " Hz natively. Falling back to ALSA's plug conversion.";
+        sampleRate = codec.sampleRate;
+        setParamsResult = setCaptureParams(sampleRate, 1);
+    }
+    if (auto pcmSetParamsErrorMsg = checkAlsaError(setParamsResult)) {
+        throw SubsystemFault(*pcmSetParamsErrorMsg);
     } else {
         PLOG_INFO << "Successfully set PCM params for capture handle";
     }
 
-    unsigned int bitsPerSample = snd_pcm_format_width(format);
-    unsigned short bitsPerByte = 8;
+    // The card is opened while the SDK is still starting up, but the G.722 and G.726 encoders
+    // come out of the SDK.
+    sdkInitialized.wait();
+    unsigned long numFramesToRead = codec.samplesPerFrame * sampleRate / codec.sampleRate;
+    // One run of numFramesToRead samples per card channel.
+    std::vector<int16_t> cardPeriod(numFramesToRead * numChannels);
+    std::vector<int16_t> interleavedPeriod(numChannels > 1 ? numFramesToRead * numChannels : 0);
+    std::vector<std::unique_ptr<RoutedChannel>> routes;
+    for (const RoutedVoiceChannel &routed : group.routes) {
+        VoiceChannel &channel = voiceChannel(routed.slot);
+        if (channel.number != routed.voiceChannel && channel.handle >= 0) {
+            PLOG_INFO << "Voice channel <" << channel.number << "> was rerouted, so it's hanging up.";
+            hangUpVoiceChannel(channel, "rerouted");
+        }
+        channel.number = routed.voiceChannel;
+        auto route = std::make_unique<RoutedChannel>(channel, codec);
+        if (!route->encoder) {
+            std::stringstream ss;
+            ss << "Failed to create a " << codec.name << " encoder.";
+            throw SubsystemFault(ss.str());
+        }
+        channel.handoff.setPeriodSize(codec.encodedFrameBytes);
+        route->cardSamples = cardPeriod.data() + std::max(routed.sourceChannel, 0) * numFramesToRead;
+        if (sampleRate != codec.sampleRate) {
+            route->resampler.emplace(sampleRate, codec.sampleRate);
+            route->pcmPeriod = route->resampled;
+        } else {
+            route->pcmPeriod = route->cardSamples;
+        }
+        PLOG_INFO << "Capture channel <" << std::max(routed.sourceChannel, 0) << "> of " << group.source
+                  << " feeds voice channel <" << routed.voiceChannel << ">";
+        routes.push_back(std::move(route));
+    }
+    if (sampleRate != codec.sampleRate) {
+        PLOG_INFO << "Resampling capture from " << sampleRate << " Hz to " << codec.sampleRate << " Hz with "
+                  << routes.front()->resampler->getTapsPerPhase() << " taps per phase.";
+    }
+    RoutedChannel &primary = *routes.front();
+    unsigned long configGeneration = configStore.getGeneration();
+    std::shared_ptr<const BridgeConfig> config = configStore.get();
+    for (auto &route : routes) {
+        route->dsp = makeDspChain(config->dsp, codec.sampleRate);
+        route->silenceTracker.hangupAfterMillis = config->vad.hangupAfterMillis;
+    }
+    if (primary.dsp) {
+        PLOG_INFO << "Voice talk DSP: " << primary.dsp->describe();
+    }
+    if (subsystem != nullptr) {
+        subsystem->markHealthy();
+        startupTimeline().mark("capture-ready");
+    }
+
+    size_t frameSamples = codec.samplesPerFrame;
+    unsigned char muLawPeriod[MAX_CODEC_FRAME_SAMPLES];
+
+    Gauge &driftPpmGauge = metrics().gauge(
+        captureMetricName("hikbridge_capture_clock_drift_ppm", "", source),
+        "Estimated drift of the soundcard clock against the host clock that paces voice talk."
+    );
+    Gauge &backlogGauge = metrics().gauge(
+        captureMetricName("hikbridge_capture_backlog_frames", "", source),
+        "Frames waiting in the soundcard's capture buffer."
+    );
+    Counter &droppedFrames = metrics().counter(
+        captureMetricName("hikbridge_drift_corrections_total", "kind=\"drop\"", source),
+        "Capture periods dropped or inserted to hold the capture backlog at its target depth."
+    );
+    Counter &forcedDroppedFrames = metrics().counter(
+        captureMetricName("hikbridge_drift_corrections_total", "kind=\"forced_drop\"", source),
+        "Capture periods dropped or inserted to hold the capture backlog at its target depth."
+    );
+    Counter &insertedFrames = metrics().counter(
+        captureMetricName("hikbridge_drift_corrections_total", "kind=\"insert\"", source),
+        "Capture periods dropped or inserted to hold the capture backlog at its target depth."
+    );
+    Counter &stalledPeriods = metrics().counter(
+        captureMetricName("hikbridge_capture_stalled_periods_total", "", source),
+        "Periods a voice channel missed because its voice talk sender hadn't taken the one before."
+    );
+    ClockDriftEstimator driftEstimator(sampleRate);
+    DriftCompensator driftCompensator(
+        (long) numFramesToRead,
+        (long) numFramesToRead * DRIFT_TARGET_BACKLOG_PERIODS,
+        (long) numFramesToRead * DRIFT_MAX_BACKLOG_PERIODS
+    );
+    long long cardFramesRead = 0;
+    bool lastPeriodWasSilent = false;
+
+    auto readCardPeriod = [&]() {
+        long framesRead = snd_pcm_readi(
+            captureHandle,
+            numChannels > 1 ? interleavedPeriod.data() : cardPeriod.data(),
+            numFramesToRead
+        );
+        if (framesRead == (long) numFramesToRead) {
+            if (numChannels > 1) {
+                deinterleave(interleavedPeriod.data(), numFramesToRead, numChannels, cardPeriod.data());
+            }
+            for (auto &route : routes) {
+                if (route->resampler) {
+                    captureBeat.beat("resampling");
+                    route->resampler->process(route->cardSamples, numFramesToRead, route->resampled);
+                }
+            }
+        }
+        if (framesRead > 0) {
+            cardFramesRead += framesRead;
+        }
+        return framesRead;
+    };
 
+    auto allRoutesSilent = [&]() {
+        return std::all_of(routes.begin(), routes.end(), [&](const std::unique_ptr<RoutedChannel> &route) {
+            return isSilentPcmPeriod(route->pcmPeriod, frameSamples, config->vad.silenceThreshold);
+        });
+    };
 
-    long startOfSilence = -1;
-    unsigned long numFramesToRead = sizeof(soundcardReadBuffer) / (numChannels * (bitsPerSample / bitsPerByte));
+    // Drift only matters while the SDK is pulling frames; otherwise capture just follows the card.
+    // Every channel shares the card's clock, so they're compensated together.
+    auto compensateAndReadCardPeriod = [&](bool relaying) {
+        long backlog = snd_pcm_avail(captureHandle);
+        if (backlog < 0) {
+            return readCardPeriod();
+        }
+        backlogGauge.set((double) backlog);
+        driftEstimator.observe(heartbeatClockInMillis(), cardFramesRead + backlog);
+        if (driftEstimator.hasEstimate()) {
+            driftPpmGauge.set(driftEstimator.getDriftPpm());
+        }
+        if (!relaying) {
+            return readCardPeriod();
+        }
 
-    bool isBufferReady = false;
-    auto readFromPcm = [captureHandle, numFramesToRead, &isBufferReady]() {
-        std::unique_lock<std::mutex> lk(soundcardReadBufferMutex);
-        if (isBufferReady && voiceComHandle >= 0 && !intercomGotFuckedWith) {
-            soundcardReadBufferCV.notify_one();
-            soundcardReadBufferCV.wait(lk);
+        switch (driftCompensator.decide(driftEstimator.getDriftPpm(), backlog, lastPeriodWasSilent)) {
+            case DriftCorrection::insertFrame:
+                insertedFrames.increment();
+                std::fill(cardPeriod.begin(), cardPeriod.end(), 0);
+                for (auto &route : routes) {
+                    std::fill(route->resampled, route->resampled + frameSamples, 0);
+                }
+                return (long) numFramesToRead;
+            case DriftCorrection::forcedDropFrame:
+                forcedDroppedFrames.increment();
+                if (long framesRead = readCardPeriod(); framesRead != (long) numFramesToRead) {
+                    return framesRead;
+                }
+                return readCardPeriod();
+            case DriftCorrection::dropFrame: {
+                // Only a period that turns out to be silent on every channel too is dropped.
+                long framesRead = readCardPeriod();
+                if (framesRead != (long) numFramesToRead || !allRoutesSilent()) {
+                    return framesRead;
+                }
+                droppedFrames.increment();
+                return readCardPeriod();
+            }
+            default:
+                return readCardPeriod();
         }
-        isBufferReady = false;
-        return snd_pcm_readi(captureHandle, soundcardReadBuffer, numFramesToRead);
+    };
+
+    auto readPeriod = [&]() {
+        captureBeat.beat("reading-pcm");
+        HIKBRIDGE_PROBE(capture_read_start);
+        ALLOCATION_STAGE(capture);
+        long framesRead;
+        if (isReplaying()) {
+            replayPacePeriod();
+            framesRead = snd_pcm_readi(captureHandle, muLawPeriod, numFramesToRead);
+            for (long i = 0; i < framesRead; i++) {
+                cardPeriod[i] = muLawToLinear(muLawPeriod[i]);
+            }
+        } else {
+            bool relaying = std::any_of(routes.begin(), routes.end(), [](const std::unique_ptr<RoutedChannel> &route) {
+                return route->isRelaying();
+            });
+            framesRead = compensateAndReadCardPeriod(relaying);
+        }
+        HIKBRIDGE_PROBE1(capture_read_done, framesRead);
+        if (framesRead != (long) numFramesToRead) {
+            return framesRead;
+        }
+        for (auto &route : routes) {
+            route->periodToEncode = route->pcmPeriod;
+            if (route->dsp) {
+                captureBeat.beat("processing");
+                std::copy(route->pcmPeriod, route->pcmPeriod + frameSamples, route->processedPeriod);
+                route->dsp->process(route->processedPeriod, frameSamples);
+                route->periodToEncode = route->processedPeriod;
+            }
+            // Announcements only play on the primary channel.
+            if (route.get() == &primary && announcementPlayer.isPlaying()) {
+                if (route->periodToEncode == route->pcmPeriod) {
+                    std::copy(route->pcmPeriod, route->pcmPeriod + frameSamples, route->processedPeriod);
+                    route->periodToEncode = route->processedPeriod;
+                }
+                announcementPlayer.mixInto(route->processedPeriod, frameSamples, codec);
+            }
+        }
+        return framesRead;
+    };
+
+    // The card is read with no handoff held, and each channel's frame is then encoded under its own
+    // handoff alone, so a sender stuck in the SDK only costs its own channel periods.
+    auto readFromPcm = [&]() {
+        long framesRead = readPeriod();
+        if (framesRead != (long) numFramesToRead) {
+            return framesRead;
+        }
+        captureBeat.beat("waiting-for-sender");
+        for (auto &route : routes) {
+            auto encodePeriod = [&](char *buffer) {
+                captureBeat.beat("encoding");
+                if (!route->encoder->encode(route->periodToEncode, (unsigned char *) buffer)) {
+                    PLOG_WARNING << "Failed to encode a " << route->encoder->getProfile().name << " frame.";
+                }
+            };
+            route->delivered = route->channel.handoff.capture(route->isRelaying(), HANDOFF_STALL_MILLIS, encodePeriod);
+            if (!route->delivered) {
+                stalledPeriods.increment();
+            }
+            if (route->stalled != !route->delivered) {
+                route->stalled = !route->delivered;
+                if (route->stalled) {
+                    PLOG_WARNING << "Voice channel <" << route->channel.number
+                                 << "> stopped taking frames, so its periods are being dropped.";
+                } else {
+                    PLOG_INFO << "Voice channel <" << route->channel.number << "> is taking frames again.";
+                }
+            }
+        }
+        return framesRead;
     };
 
     PLOG_INFO << "Capturing sound from the soundcard";
-    while (true) {
+    HeartbeatScope heartbeatScope(captureBeat);
+    while (!isReplaying() || replayHasMorePeriods()) {
         long errCode;
         PLOG_DEBUG << "About to read " << numFramesToRead << " frames from the soundcard";
 
-        lastSoundcardLoopTime = currTimeInMillis();
+        if (subsystem != nullptr) {
+            subsystem->checkForFault();
+        }
+        if (negotiatedCodec.load() != &codec) {
+            std::stringstream ss;
+            ss << "The device switched voice talk to " << negotiatedCodec.load()->name << ", so capture has to reopen.";
+            throw SubsystemFault(ss.str());
+        }
+        if (configStore.getGeneration() != configGeneration) {
+            configGeneration = configStore.getGeneration();
+            std::shared_ptr<const BridgeConfig> previous = std::exchange(config, configStore.get());
+            for (auto &route : routes) {
+                route->silenceTracker.hangupAfterMillis = config->vad.hangupAfterMillis;
+                if (config->dsp != previous->dsp) {
+                    route->dsp = makeDspChain(config->dsp, codec.sampleRate);
+                }
+            }
+            if (config->dsp != previous->dsp) {
+                PLOG_INFO << "Voice talk DSP is now: " << (primary.dsp ? primary.dsp->describe() : "off");
+            }
+        }
 
         if (
             (
@@ -387,83 +1433,340 @@ long currTimeInSeconds() {
         ) {
             auto errMsg = checkAlsaError((int) errCode);
             PLOG_WARNING << "Failed reading audio from soundcard: " << *errMsg;
-            recoverPcm(captureHandle, (int) errCode);
-        } else {
-            isBufferReady = true;
-            soundcardReadBufferCV.notify_one();
-            bool isSilence = true;
-            for (char c : soundcardReadBuffer) {
-                if (c != (char) 0xFF) {
-                    isSilence = false;
-                    break;
-                }
+            if (isReplaying()) {
+                replayRecordFrameDrop(errCode);
             }
+            recoverPcm(captureHandle, (int) errCode);
+            // Frames lost to the overrun would read as drift.
+            driftEstimator.reset();
+            continue;
+        }
 
-            enum AudioRelayAction { shouldStart, shouldEnd, none };
-            AudioRelayAction actionToTake = none;
-            if (voiceComHandle < 0 && !isSilence) {
-                PLOG_INFO << "Detected audio! Going to start relaying audio to Hik device.";
-                actionToTake = shouldStart;
-            } else if (voiceComHandle >= 0 && intercomGotFuckedWith) {
-                PLOG_INFO << "It looks like intercom got fucked with, so we're going to need to restart voice comms.";
-                actionToTake = shouldStart;
-            } else if (voiceComHandle >= 0 && startOfSilence < 0 && isSilence) {
-                PLOG_INFO << "Detected start of silence. If no sound is heard for "
-                    << MILLIS_OF_SILENCE_BEFORE_HANGUP << " millis we will hang up voice communications.";
-                startOfSilence = currTimeInMillis();
-            } else if (voiceComHandle >= 0 && startOfSilence >= 0 && !isSilence) {
-                PLOG_INFO << "Heard sound. Postponing hang up.";
-                startOfSilence = -1;
-            } else if (
-                voiceComHandle >= 0 &&
-                currTimeInMillis() - startOfSilence > MILLIS_OF_SILENCE_BEFORE_HANGUP &&
-                isSilence
-            ) {
-                PLOG_INFO << "Observed " << MILLIS_OF_SILENCE_BEFORE_HANGUP << " millis of silence. Hanging up.";
-                actionToTake = shouldEnd;
-                startOfSilence = -1;
+        captureBeat.beat("deciding");
+        for (auto &route : routes) {
+            if (route->delivered) {
+                route->channel.handoff.publish();
             }
-            intercomGotFuckedWith = false;
+        }
+        if (primary.channel.slot == 0) {
+            flightRecordAudio(primary.pcmPeriod, frameSamples, codec.sampleRate);
+        }
+        lastPeriodWasSilent = true;
+        for (auto &route : routes) {
+            VoiceChannel &channel = route->channel;
+            // A clip playing counts as talking, which is what brings voice talk up for it.
+            bool isSilence = !(channel.slot == 0 && announcementPlayer.isPlaying())
+                && isSilentPcmPeriod(route->pcmPeriod, frameSamples, config->vad.silenceThreshold);
+            lastPeriodWasSilent = lastPeriodWasSilent && isSilence;
+            if (isReplaying() && channel.slot == 0) {
+                replayRecordVadDecision(isSilence);
+            }
+
+            AudioRelayAction actionToTake = decideAudioRelayAction(
+                route->silenceTracker,
+                channel.handle >= 0,
+                channel.restartRequested.exchange(false),
+                isSilence,
+                currTimeInMillis()
+            );
+            HIKBRIDGE_PROBE2(vad_decision, isSilence, (int) actionToTake);
 
             switch (actionToTake) {
                 case shouldStart:
-                    hikRelayEnabled = true;
-                    soundcardReadBufferCV.notify_one();
-                    startVoiceCommunications();
+                    route->encoder->reset();
+                    driftCompensator.reset();
+                    channel.relayEnabled = true;
+                    channel.handoff.wake();
+                    startVoiceCommunications(channel);
+                    flightRecordRelay(
+                        true,
+                        channel.slot == 0 && announcementPlayer.isPlaying() ? "announcement" : "sound"
+                    );
+                    HIKBRIDGE_PROBE1(relay_change, 1);
+                    publishRelayState(channel, true);
                     break;
                 case shouldEnd:
-                    hikRelayEnabled = false;
-                    soundcardReadBufferCV.notify_one();
-                    stopVoiceCommunications();
-                    voiceComHandle = -1;
+                    hangUpVoiceChannel(channel, "silence");
                     break;
                 default:
-                    soundcardReadBufferCV.notify_one();
+                    channel.handoff.wake();
             }
         }
     }
+
+    PLOG_INFO << "Reached the end of the replayed capture.";
+    for (auto &route : routes) {
+        route->channel.relayEnabled = false;
+        stopVoiceCommunications(route->channel);
+    }
+}
+
+// Capture sources are supervised by index, since reloads can reroute them. An index past the
+// current table's sources idles until a reload gives it one.
+void runCapture(SupervisedSubsystem &subsystem, int source) {
+    std::vector<VoiceRoute> routes = effectiveVoiceRoutes(*configStore.get());
+    if (source == 0) {
+        // Channels dropped from the table have nothing left to feed them.
+        for (int slot = (int) routes.size(); slot < MAX_VOICE_ROUTES; slot++) {
+            if (voiceChannel(slot).handle >= 0) {
+                hangUpVoiceChannel(voiceChannel(slot), "unrouted");
+            }
+        }
+    }
+    std::vector<CaptureGroup> groups = groupVoiceRoutes(routes);
+    if ((size_t) source >= groups.size()) {
+        subsystem.markHealthy();
+        subsystem.awaitFault();
+    }
+    soundcardReadLoop(groups[source], source, &subsystem);
+}
+
+std::string captureSubsystem(int source) {
+    return source == 0 ? CAPTURE_SUBSYSTEM : CAPTURE_SUBSYSTEM_PREFIX + std::to_string(source);
+}
+
+#define ALARM_CHANNEL_ALERT_THRESHOLD_IN_MILLIS 30000
+RecoveryEngine recoveryEngine(
+    supervisor,
+    requestVoiceTalkRestart,
+    voiceTalkRestarted,
+    ALARM_CHANNEL_ALERT_THRESHOLD_IN_MILLIS
+);
+
+void hikExceptionCallback(DWORD dwType, LONG lUserID, LONG lHandle, [[maybe_unused]] void *pUser) {
+    recoveryEngine.onSdkException(dwType, lUserID, lHandle);
+}
+
+static_assert(
+    capture3Heartbeat - captureHeartbeat + 1 == MAX_CAPTURE_SOURCES,
+    "Every capture source needs its own heartbeat."
+);
+static_assert(
+    sender3Heartbeat - senderHeartbeat + 1 == MAX_VOICE_ROUTES,
+    "Every routed voice channel needs its own sender heartbeat."
+);
+
+bool isCaptureHeartbeat(int id) {
+    return id >= captureHeartbeat && id <= capture3Heartbeat;
+}
+
+bool isSenderHeartbeat(int id) {
+    return id >= senderHeartbeat && id <= sender3Heartbeat;
+}
+
+void recoverFromStall(HeartbeatId id, const std::string &diagnosis) {
+    bool stuckInHandoff = strcmp(heartbeat(id).getState(), "waiting-for-sender") == 0 ||
+        strcmp(heartbeat(id).getState(), "waiting-for-capture") == 0;
+    switch (id) {
+        case captureHeartbeat:
+        case capture1Heartbeat:
+        case capture2Heartbeat:
+        case capture3Heartbeat:
+        case senderHeartbeat:
+        case sender1Heartbeat:
+        case sender2Heartbeat:
+        case sender3Heartbeat:
+            if (stuckInHandoff && isSenderHeartbeat(id)) {
+                PLOG_WARNING << "The capture/voice callback handoff is wedged. Restarting voice talk on its channel.";
+                requestVoiceChannelRestart(voiceChannel(id - senderHeartbeat));
+            } else if (stuckInHandoff) {
+                // Capture could be waiting on any of the channels it feeds.
+                PLOG_WARNING << "The capture/voice callback handoff is wedged. Restarting voice talk.";
+                requestVoiceTalkRestart();
+            } else if (isCaptureHeartbeat(id)) {
+                supervisor.reportFault(captureSubsystem(id - captureHeartbeat), diagnosis);
+            } else {
+                supervisor.reportFault(DEVICE_SESSION_SUBSYSTEM, diagnosis);
+            }
+            break;
+        case notifierHeartbeat:
+            supervisor.reportFault(NOTIFIER_SUBSYSTEM, diagnosis);
+            break;
+        case alarmCallbackHeartbeat:
+            supervisor.reportFault(ALARM_CHANNEL_SUBSYSTEM, diagnosis);
+            break;
+        case eventHandler0Heartbeat:
+        case eventHandler1Heartbeat:
+        case eventHandler2Heartbeat:
+        case eventHandler3Heartbeat:
+            supervisor.reportFault(EVENT_HANDLER_SUBSYSTEM_PREFIX + std::to_string(id - eventHandler0Heartbeat), diagnosis);
+            break;
+        default:
+            break;
+    }
 }
 
-#define WATCHDOG_LOOP_INTERVAL_IN_SECONDS 10
+#define WATCHDOG_LOOP_INTERVAL_IN_MILLIS 500
+#define WATCHDOG_ESCALATION_IN_MILLIS 10000
+#define WATCHDOG_HEALTH_LOG_INTERVAL_IN_MILLIS 60000
+#define MIN_VOICE_CALLBACKS_PER_SECOND 10
 [[noreturn]] void watchdogLoop() {
     PLOG_INFO << "Starting the watchdog loop thread";
+    installStallStackHandler();
 
+    long stallReportedAt[heartbeatCount];
+    std::fill(stallReportedAt, stallReportedAt + heartbeatCount, -1);
+    long lastVoiceCallbackCount[MAX_VOICE_ROUTES];
+    long voiceTalkUpSince[MAX_VOICE_ROUTES];
+    for (int slot = 0; slot < MAX_VOICE_ROUTES; slot++) {
+        lastVoiceCallbackCount[slot] = heartbeat((HeartbeatId) (senderHeartbeat + slot)).getBeatCount();
+        voiceTalkUpSince[slot] = -1;
+    }
+    long lastHealthLogAt = heartbeatClockInMillis();
     while (true) {
-        sleep(WATCHDOG_LOOP_INTERVAL_IN_SECONDS);
-        long millisSinceLastSoundcardLoop = currTimeInMillis() - lastSoundcardLoopTime;
-        if (millisSinceLastSoundcardLoop > WATCHDOG_LOOP_INTERVAL_IN_SECONDS * 1000) {
+        usleep(WATCHDOG_LOOP_INTERVAL_IN_MILLIS * 1000);
+        long now = heartbeatClockInMillis();
+
+        for (int id = 0; id < heartbeatCount; id++) {
+            Heartbeat &threadHeartbeat = heartbeat((HeartbeatId) id);
+            long stalledForMillis = 0;
+            if (!threadHeartbeat.isStalled(now, stalledForMillis)) {
+                stallReportedAt[id] = -1;
+                continue;
+            }
             std::stringstream ss;
-            ss << "The soundcard loop appears to be dead. The last loop took place "
-               << millisSinceLastSoundcardLoop << " ms ago";
-            shutdown(ss.str());
-        } else {
-            PLOG_INFO << "Still capturing sound from the soundcard.";
+            if (stallReportedAt[id] < 0) {
+                ss << "Heartbeat <" << threadHeartbeat.getName() << "> stalled for " << stalledForMillis
+                   << " ms (threshold " << threadHeartbeat.getStallThresholdMillis() << " ms) in state <"
+                   << threadHeartbeat.getState() << "> on thread <" << threadHeartbeat.getThreadId() << ">";
+                PLOG_ERROR << ss.str() << std::endl << captureThreadStack(threadHeartbeat.getThreadId());
+                recoverFromStall((HeartbeatId) id, ss.str());
+                stallReportedAt[id] = now;
+            } else if (
+                (isCaptureHeartbeat(id) || isSenderHeartbeat(id)) &&
+                now - stallReportedAt[id] > WATCHDOG_ESCALATION_IN_MILLIS
+            ) {
+                ss << "Heartbeat <" << threadHeartbeat.getName() << "> is still stalled in state <"
+                   << threadHeartbeat.getState() << "> " << now - stallReportedAt[id]
+                   << " ms after recovery was attempted.";
+                shutdown(ss.str());
+            }
+        }
+
+        // Each channel has its own SDK session, so each is held to the rate on its own.
+        long voiceCallbacksPerSecond = 0;
+        for (int slot = 0; slot < MAX_VOICE_ROUTES; slot++) {
+            VoiceChannel &channel = voiceChannel(slot);
+            long voiceCallbackCount = heartbeat((HeartbeatId) (senderHeartbeat + slot)).getBeatCount();
+            long channelCallbacksPerSecond = (voiceCallbackCount - lastVoiceCallbackCount[slot]) * 1000 / WATCHDOG_LOOP_INTERVAL_IN_MILLIS;
+            lastVoiceCallbackCount[slot] = voiceCallbackCount;
+            voiceCallbacksPerSecond += channelCallbacksPerSecond;
+            if (channel.handle < 0 || !channel.relayEnabled) {
+                voiceTalkUpSince[slot] = -1;
+            } else if (voiceTalkUpSince[slot] < 0) {
+                voiceTalkUpSince[slot] = now;
+            } else if (
+                now - voiceTalkUpSince[slot] > 2 * WATCHDOG_LOOP_INTERVAL_IN_MILLIS &&
+                channelCallbacksPerSecond < MIN_VOICE_CALLBACKS_PER_SECOND
+            ) {
+                PLOG_WARNING << "The SDK voice callback rate on voice channel <" << channel.number << "> dropped to "
+                             << channelCallbacksPerSecond << "/s while voice talk is up. Restarting its voice talk.";
+                requestVoiceChannelRestart(channel);
+                voiceTalkUpSince[slot] = now;
+            }
+        }
+
+        if (!isReplaying()) {
+            recoveryEngine.poll();
         }
+
+        if (now - lastHealthLogAt >= WATCHDOG_HEALTH_LOG_INTERVAL_IN_MILLIS) {
+            lastHealthLogAt = now;
+            PLOG_INFO << "Subsystem health: " << supervisor.describe()
+                      << " | voice callbacks: " << voiceCallbacksPerSecond << "/s";
+        }
+    }
+
+}
+
+std::optional<std::string> findMissingSetting(const BridgeConfig &config) {
+    if (config.device.host.empty()) {
+        return "The device host";
+    } else if (config.device.port == 0) {
+        return "The device port";
+    } else if (config.device.password.empty()) {
+        return "The device password";
+    } else if (effectiveVoiceRoutes(config).empty()) {
+        return "The audio capture coordinates";
+    } else if (config.doorbell.host.empty() || config.doorbell.port == 0 || config.doorbell.path.empty()) {
+        return "The doorbell host, port and path";
+    }
+    return std::nullopt;
+}
+
+// Restarts only what the change actually touches. The doorbell target, VAD and DSP settings are
+// read straight from the store, so they need nothing beyond the swap; a reloaded device or
+// soundcard restarts just its own subsystem.
+void applyConfigChange(const BridgeConfig &previous, const BridgeConfig &next) {
+    if (next.logLevel != previous.logLevel) {
+        PLOG_INFO << "Log level is now " << plog::severityToString(next.logLevel);
+        plog::get()->setMaxSeverity(next.logLevel);
+    }
+    if (next.doorbell != previous.doorbell) {
+        PLOG_INFO << "Doorbell rings now go to http://" << next.doorbell.host << ":" << next.doorbell.port
+                  << next.doorbell.path;
+    }
+    if (next.vad != previous.vad) {
+        PLOG_INFO << "VAD now treats samples within " << next.vad.silenceThreshold << " of zero as silence and hangs up after "
+                  << next.vad.hangupAfterMillis << " millis of it.";
+    }
+    if (next.mqtt != previous.mqtt) {
+        supervisor.reportFault(MQTT_SUBSYSTEM, "The config changed the MQTT broker.");
+    }
+    if (next.http != previous.http) {
+        supervisor.reportFault(HTTP_SUBSYSTEM, "The config moved the HTTP server.");
+    }
+    if (next.listener != previous.listener) {
+        supervisor.reportFault(ALARM_LISTENER_SUBSYSTEM, "The config moved the alarm listener.");
+        if ((next.listener.port == 0) != (previous.listener.port == 0)) {
+            supervisor.reportFault(ALARM_CHANNEL_SUBSYSTEM, "The config switched how alarms are received.");
+        }
+    }
+    if (next.announcements.directory != previous.announcements.directory) {
+        supervisor.reportFault(ANNOUNCEMENT_SUBSYSTEM, "The config moved the announcements.");
+    }
+    if (next.recording != previous.recording) {
+        supervisor.reportFault(RECORDER_SUBSYSTEM, "The config changed how voice talk is recorded.");
+    }
+    if (effectiveVoiceRoutes(next) != effectiveVoiceRoutes(previous)) {
+        for (int source = 0; source < MAX_CAPTURE_SOURCES; source++) {
+            supervisor.reportFault(captureSubsystem(source), "The config rerouted voice talk.");
+        }
+    }
+    if (next.device != previous.device) {
+        supervisor.reportFault(DEVICE_SESSION_SUBSYSTEM, "The config changed the device's coordinates, so it has to log in again.");
     }
+}
 
+// The file is laid over the flags again, so a setting deleted from it falls back to its flag.
+void reloadConfig(const std::string &configPath, const BridgeConfig &flagConfig) {
+    BridgeConfig next = flagConfig;
+    try {
+        applyConfigFile(configPath, next);
+    } catch (const std::runtime_error &e) {
+        PLOG_ERROR << "Keeping the current config, because the reloaded one is broken: " << e.what();
+        return;
+    }
+    if (auto missing = findMissingSetting(next)) {
+        PLOG_ERROR << "Keeping the current config, because the reloaded one is missing a setting: " << *missing;
+        return;
+    }
+    PLOG_INFO << "Reloaded config from " << configPath;
+    applyConfigChange(*configStore.replace(next), next);
+}
+
+void superviseEventHandlers() {
+    for (int handler = 0; handler < INTERCOM_HANDLER_THREADS; handler++) {
+        supervisor.supervise(
+            EVENT_HANDLER_SUBSYSTEM_PREFIX + std::to_string(handler),
+            { 100, 10000, 10000, 0 },
+            [handler](SupervisedSubsystem &subsystem) { runEventHandler(subsystem, handler); }
+        );
+    }
 }
 
 int main(int argc, char** argv) {
+    startupTimeline();
 
     static plog::ColorConsoleAppender<plog::TxtFormatter> consoleAppender;
     plog::init(
@@ -477,6 +1780,11 @@ int main(int argc, char** argv) {
 
     cxxopts::Options options("HikBridge", "Hikbridge connects HikVision intercoms to Homebridge.");
     options.add_options()
+        (
+            "c,config",
+            "Path to a TOML config file. It's watched, and changes apply without a restart. Settings in it override flags.",
+            cxxopts::value<std::string>()->default_value("")
+        )
         (
             "h,device-host",
             "The address of the Hikvision device we're connecting",
@@ -504,7 +1812,7 @@ int main(int argc, char** argv) {
         )
         (
             "s,audio-capture-coordinates",
-            "The ALSA name of the soundcard to read mu-law sound signal from",
+            "The ALSA name of the soundcard to capture sound from. A hw: device lets HikBridge resample in-process.",
             cxxopts::value<std::string>()
         )
         (
@@ -521,57 +1829,236 @@ int main(int argc, char** argv) {
             "a,doorbell-path",
             "The path to make an HTTP GET request to when the doorbell is rung",
             cxxopts::value<std::string>()
+        )
+        (
+            "dsp-highpass-hz",
+            "Corner frequency of the high-pass filter that removes rumble before voice talk. 0 disables it.",
+            cxxopts::value<double>()->default_value("100")
+        )
+        (
+            "dsp-gate-threshold-dbfs",
+            "Level below which the noise gate closes, e.g. -45. 0 disables the gate.",
+            cxxopts::value<double>()->default_value("0")
+        )
+        (
+            "dsp-agc-target-dbfs",
+            "Average level the AGC steers voice talk towards. 0 disables AGC and the limiter.",
+            cxxopts::value<double>()->default_value("-18")
+        )
+        (
+            "dsp-agc-max-gain-db",
+            "The most the AGC will boost a quiet talker",
+            cxxopts::value<double>()->default_value("12")
+        )
+        (
+            "dsp-limiter-ceiling-dbfs",
+            "Peak level the limiter holds voice talk under, so the intercom's speaker doesn't clip",
+            cxxopts::value<double>()->default_value("-3")
+        )
+        (
+            "flight-recorder-dump",
+            "Where the last 10 s of audio, events, relay transitions, SDK calls and xruns are dumped on a crash",
+            cxxopts::value<std::string>()->default_value("/var/log/hikbridge/flight-recorder.bin")
+        )
+        (
+            "decode-flight-recording",
+            "Print a flight recorder dump, write its audio next to it as a WAV, and exit",
+            cxxopts::value<std::string>()
+        )
+        (
+            "replay-capture",
+            "Path to a raw mu-law capture to stream through the soundcard loop instead of a live soundcard",
+            cxxopts::value<std::string>()
+        )
+        (
+            "replay-asoundrc",
+            "The ALSA config template that defines the replay PCM",
+            cxxopts::value<std::string>()->default_value("replay.asoundrc")
+        )
+        (
+            "replay-virtual-clock",
+            "Replay the capture as fast as possible on a virtual clock instead of in real time",
+            cxxopts::value<bool>()->default_value("false")
+        )
+        (
+            "replay-alarms",
+            "Script of alarms for the stand-in SDK to push through the alarm listener during the replay",
+            cxxopts::value<std::string>()->default_value("")
+        )
+        (
+            "replay-report",
+            "Path to write the replay report JSON to. Logged if not set.",
+            cxxopts::value<std::string>()->default_value("")
         );
 
-    std::string deviceHost, deviceUsername, devicePassword, audioCaptureCoordinates;
-    unsigned short devicePort;
+    BridgeConfig initialConfig;
+    BridgeConfig flagConfig;
+    std::string configPath, replayCapture, replayAsoundrc, replayAlarms, replayReport;
+    bool replayVirtualClock = false;
     try {
         auto result = options.parse(argc, argv);
-        deviceHost = result["device-host"].as<std::string>();
-        devicePort = result["device-port"].as<unsigned short>();
-        deviceUsername = result["device-username"].as<std::string>();
-        devicePassword = result["device-password"].as<std::string>();
-        audioCaptureCoordinates = result["audio-capture-coordinates"].as<std::string>();
-        doorbellHost = result["doorbell-host"].as<std::string>();
-        doorbellPort = result["doorbell-port"].as<unsigned short>();
-        doorbellPath = result["doorbell-path"].as<std::string>();
+        configPath = result["config"].as<std::string>();
+        initialConfig.dsp.highPassHz = result["dsp-highpass-hz"].as<double>();
+        initialConfig.dsp.gateThresholdDbfs = result["dsp-gate-threshold-dbfs"].as<double>();
+        initialConfig.dsp.agcTargetDbfs = result["dsp-agc-target-dbfs"].as<double>();
+        initialConfig.dsp.agcMaxGainDb = result["dsp-agc-max-gain-db"].as<double>();
+        initialConfig.dsp.limiterCeilingDbfs = result["dsp-limiter-ceiling-dbfs"].as<double>();
+        initialConfig.device.username = result["device-username"].as<std::string>();
+        if (result.count("decode-flight-recording")) {
+            std::string dump = result["decode-flight-recording"].as<std::string>();
+            if (!printFlightRecording(dump, std::cout)) {
+                shutdown(dump + " isn't a flight recorder dump from this build of HikBridge.");
+            }
+            return 0;
+        }
+        installFlightRecorder(result["flight-recorder-dump"].as<std::string>());
+        if (result.count("replay-capture")) {
+            replayCapture = result["replay-capture"].as<std::string>();
+            replayAsoundrc = result["replay-asoundrc"].as<std::string>();
+            replayVirtualClock = result["replay-virtual-clock"].as<bool>();
+            replayAlarms = result["replay-alarms"].as<std::string>();
+            replayReport = result["replay-report"].as<std::string>();
+        }
+        // With a config file these can all come from there instead.
+        if (result.count("device-host")) {
+            initialConfig.device.host = result["device-host"].as<std::string>();
+        }
+        if (result.count("device-port")) {
+            initialConfig.device.port = result["device-port"].as<unsigned short>();
+        }
+        if (result.count("device-password")) {
+            initialConfig.device.password = result["device-password"].as<std::string>();
+        }
+        if (result.count("audio-capture-coordinates")) {
+            initialConfig.audioCaptureCoordinates = result["audio-capture-coordinates"].as<std::string>();
+        }
+        if (result.count("doorbell-host")) {
+            initialConfig.doorbell.host = result["doorbell-host"].as<std::string>();
+        }
+        if (result.count("doorbell-port")) {
+            initialConfig.doorbell.port = result["doorbell-port"].as<unsigned short>();
+        }
+        if (result.count("doorbell-path")) {
+            initialConfig.doorbell.path = result["doorbell-path"].as<std::string>();
+        }
     } catch (const cxxopts::option_has_no_value_exception& e) {
         shutdown(std::make_optional(e.what()));
     }
+    flagConfig = initialConfig;
+    if (!configPath.empty()) {
+        try {
+            applyConfigFile(configPath, initialConfig);
+        } catch (const std::runtime_error &e) {
+            shutdown(std::string(e.what()));
+        }
+    }
+    if (replayCapture.empty()) {
+        if (auto missing = findMissingSetting(initialConfig)) {
+            shutdown(*missing + " has to be set, either as a flag or in the config file.");
+        }
+    }
+    plog::get()->setMaxSeverity(initialConfig.logLevel);
+    configStore.replace(initialConfig);
 
-    sessionId = logInToDevice(
-        deviceHost,
-        devicePort,
-        deviceUsername,
-        devicePassword
-    );
-
-    registerForHikEvents();
-
-    NET_DVR_COMPRESSION_AUDIO audioSettings = { 0 };
-    audioSettings.byAudioEncType = 1;
-    audioSettings.byAudioSamplingRate = 5;
-    audioSettings.byAudioBitRate = BITRATE_ENCODE_128kps;
-    audioSettings.bySupport = 0;
-    if (!NET_DVR_SetDVRConfig(
-        sessionId,
-        NET_DVR_SET_COMPRESSCFG_AUD,
-        1,
-        &audioSettings,
-        sizeof(audioSettings)
-    )) {
-        shutdown(obtainHikSDKErrorMsg("Failed to set audio settings"));
-    } else {
-        PLOG_INFO << "Successfully set Hik device audio settings.";
+    if (!replayCapture.empty()) {
+        sdkInitializedPromise.set_value();
+        try {
+            beginReplay(
+                replayCapture,
+                replayAsoundrc,
+                replayVirtualClock,
+                AudioHandoff::size(),
+                SOUNDCARD_PERIOD_MILLIS,
+                [] {
+                    for (int slot = 0; slot < MAX_VOICE_ROUTES; slot++) {
+                        voiceChannel(slot).handoff.wakeAll();
+                    }
+                }
+            );
+        } catch (const std::runtime_error &e) {
+            shutdown(std::string(e.what()));
+        }
+        std::thread watchdogThread(watchdogLoop);
+        watchdogThread.detach();
+        LONG listenHandle = -1;
+        if (!replayAlarms.empty()) {
+            superviseEventHandlers();
+            listenHandle = replayStartListen(replayAlarms, hikEventsCallback);
+        }
+        try {
+            soundcardReadLoop({ replayCaptureCoordinates(), 1, { { 0, 1, -1 } } }, 0);
+        } catch (const SubsystemFault &fault) {
+            shutdown(std::string(fault.what()));
+        }
+        if (listenHandle >= 0) {
+            replayStopListen(listenHandle);
+        }
+        writeReplayReport(replayReport);
+        shutdown();
     }
 
-    std::thread soundcardReadThread(soundcardReadLoop, audioCaptureCoordinates);
+    // Capture opens the card and negotiates hw params while the SDK starts up and logs in, using
+    // the codec the device talked last time. If that turns out to be stale, capture reopens once
+    // the codec's been negotiated.
+    const CodecProfile *cachedCodec = findCodecProfile(
+        (BYTE) loadCachedAudioEncType(deviceCacheKey(initialConfig.device))
+    );
+    if (cachedCodec != nullptr) {
+        negotiatedCodec = cachedCodec;
+    }
+    // A card hiccup should be back up well inside a second, so capture restarts almost immediately.
+    for (int source = 0; source < MAX_CAPTURE_SOURCES; source++) {
+        supervisor.supervise(
+            captureSubsystem(source),
+            { 50, 5000, 10000, 20 },
+            [source](SupervisedSubsystem &subsystem) { runCapture(subsystem, source); }
+        );
+    }
+    supervisor.supervise(NOTIFIER_SUBSYSTEM, { 100, 10000, 10000, 0 }, runNotifier);
+    superviseEventHandlers();
+    supervisor.supervise(RECORDER_SUBSYSTEM, { 1000, 30000, 60000, 0 }, [](SupervisedSubsystem &subsystem) {
+        conversationRecorder.run(subsystem, configStore.get()->recording);
+    });
+    supervisor.supervise(SPOOL_SUBSYSTEM, { 1000, 30000, 60000, 0 }, runWebhookSpoolReplayer);
+    supervisor.supervise(HTTP_SUBSYSTEM, { 1000, 30000, 60000, 0 }, runHttpServer);
+    supervisor.supervise(MQTT_SUBSYSTEM, { 1000, 30000, 60000, 0 }, runMqttClient);
+    publishRelayState(voiceChannel(0), false);
 
-    std::thread watchdogThread(watchdogLoop);
+    if (!NET_DVR_Init()) {
+        shutdown("Failed to initialize Hik SDK.");
+    }
+    NET_DVR_SetConnectTime(2000, 1);
+    NET_DVR_SetReconnect(10000, true);
+    NET_DVR_SetExceptionCallBack_V30(0, nullptr, hikExceptionCallback, nullptr);
+    sdkInitializedPromise.set_value();
+    startupTimeline().mark("sdk-initialized");
 
-    soundcardReadThread.join();
+    supervisor.supervise(DEVICE_SESSION_SUBSYSTEM, { 1000, 30000, 60000, 10 }, runDeviceSession);
+    supervisor.supervise(
+        ALARM_CHANNEL_SUBSYSTEM,
+        { 500, 30000, 60000, 0 },
+        runAlarmChannel,
+        DEVICE_SESSION_SUBSYSTEM
+    );
+    supervisor.supervise(ALARM_LISTENER_SUBSYSTEM, { 1000, 30000, 60000, 0 }, runAlarmListener);
+    supervisor.supervise(ANNOUNCEMENT_SUBSYSTEM, { 1000, 30000, 60000, 0 }, runAnnouncementPlayer);
+    supervisor.supervise(
+        DOOR_CONTROL_SUBSYSTEM,
+        { 500, 30000, 60000, 0 },
+        runDoorCommandWorker,
+        DEVICE_SESSION_SUBSYSTEM
+    );
+    if (!configPath.empty()) {
+        supervisor.supervise(
+            CONFIG_SUBSYSTEM,
+            { 1000, 30000, 60000, 0 },
+            [configPath, flagConfig](SupervisedSubsystem &subsystem) {
+                watchConfigFile(configPath, subsystem, [&] { reloadConfig(configPath, flagConfig); });
+            }
+        );
+    }
 
-    shutdown();
+    watchdogLoop();
 }
 
 
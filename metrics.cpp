@@ -0,0 +1,163 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <sstream>
+
+const std::vector<double> LATENCY_BUCKETS_IN_MILLIS = {
+    1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000
+};
+
+static void addToAtomicDouble(std::atomic<double> &target, double delta) {
+    double current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + delta, std::memory_order_relaxed)) {}
+}
+
+void Gauge::add(double delta) {
+    addToAtomicDouble(value, delta);
+}
+
+Histogram::Histogram(std::vector<double> upperBounds)
+    : upperBounds(std::move(upperBounds)),
+      buckets(new std::atomic<long>[this->upperBounds.size() + 1]) {
+    for (size_t i = 0; i <= this->upperBounds.size(); i++) {
+        buckets[i] = 0;
+    }
+}
+
+void Histogram::observe(double value) {
+    size_t bucket = 0;
+    while (bucket < upperBounds.size() && value > upperBounds[bucket]) {
+        bucket++;
+    }
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    addToAtomicDouble(sum, value);
+}
+
+double Histogram::approximateQuantile(double quantile) const {
+    long total = getCount();
+    if (total == 0) {
+        return 0;
+    }
+    long seen = 0;
+    for (size_t i = 0; i < upperBounds.size(); i++) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if ((double) seen >= quantile * (double) total) {
+            return upperBounds[i];
+        }
+    }
+    return upperBounds.empty() ? 0 : upperBounds.back();
+}
+
+MetricsRegistry::Entry *MetricsRegistry::find(const std::string &name) {
+    for (auto &entry : entries) {
+        if (entry.name == name) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+Counter &MetricsRegistry::counter(const std::string &name, const std::string &help) {
+    std::lock_guard<std::mutex> lk(entriesMutex);
+    if (auto entry = find(name)) {
+        return *entry->counter;
+    }
+    entries.push_back({ name, help, Kind::counter, std::make_unique<Counter>(), nullptr, nullptr });
+    return *entries.back().counter;
+}
+
+Gauge &MetricsRegistry::gauge(const std::string &name, const std::string &help) {
+    std::lock_guard<std::mutex> lk(entriesMutex);
+    if (auto entry = find(name)) {
+        return *entry->gauge;
+    }
+    entries.push_back({ name, help, Kind::gauge, nullptr, std::make_unique<Gauge>(), nullptr });
+    return *entries.back().gauge;
+}
+
+Histogram &MetricsRegistry::histogram(
+    const std::string &name,
+    const std::string &help,
+    std::vector<double> upperBounds
+) {
+    std::lock_guard<std::mutex> lk(entriesMutex);
+    if (auto entry = find(name)) {
+        return *entry->histogram;
+    }
+    entries.push_back({
+        name, help, Kind::histogram, nullptr, nullptr, std::make_unique<Histogram>(std::move(upperBounds))
+    });
+    return *entries.back().histogram;
+}
+
+static std::string baseName(const std::string &name) {
+    return name.substr(0, name.find('{'));
+}
+
+// Labels of the metric name, without braces, so more labels can be appended.
+static std::string labels(const std::string &name) {
+    size_t open = name.find('{');
+    if (open == std::string::npos) {
+        return "";
+    }
+    return name.substr(open + 1, name.size() - open - 2);
+}
+
+static std::string withLabel(const std::string &name, const std::string &suffix, const std::string &extraLabel) {
+    std::string existing = labels(name);
+    std::string combined = existing.empty() ? extraLabel : (extraLabel.empty() ? existing : existing + "," + extraLabel);
+    return baseName(name) + suffix + (combined.empty() ? "" : "{" + combined + "}");
+}
+
+std::string MetricsRegistry::render() const {
+    std::lock_guard<std::mutex> lk(entriesMutex);
+    std::stringstream out;
+    std::vector<std::string> renderedBaseNames;
+    for (auto &first : entries) {
+        std::string base = baseName(first.name);
+        if (std::find(renderedBaseNames.begin(), renderedBaseNames.end(), base) != renderedBaseNames.end()) {
+            continue;
+        }
+        renderedBaseNames.push_back(base);
+        const char *type = first.kind == Kind::counter ? "counter" : first.kind == Kind::gauge ? "gauge" : "histogram";
+        out << "# HELP " << base << " " << first.help << "\n" << "# TYPE " << base << " " << type << "\n";
+        for (auto &entry : entries) {
+            if (baseName(entry.name) == base) {
+                renderEntry(entry, out);
+            }
+        }
+    }
+    return out.str();
+}
+
+void MetricsRegistry::renderEntry(const Entry &entry, std::ostream &out) {
+    switch (entry.kind) {
+        case Kind::counter:
+            out << entry.name << " " << entry.counter->get() << "\n";
+            break;
+        case Kind::gauge:
+            out << entry.name << " " << entry.gauge->get() << "\n";
+            break;
+        case Kind::histogram: {
+            const Histogram &histogram = *entry.histogram;
+            long cumulative = 0;
+            for (size_t i = 0; i < histogram.upperBounds.size(); i++) {
+                cumulative += histogram.buckets[i].load(std::memory_order_relaxed);
+                std::stringstream le;
+                le << "le=\"" << histogram.upperBounds[i] << "\"";
+                out << withLabel(entry.name, "_bucket", le.str()) << " " << cumulative << "\n";
+            }
+            cumulative += histogram.buckets[histogram.upperBounds.size()].load(std::memory_order_relaxed);
+            out << withLabel(entry.name, "_bucket", "le=\"+Inf\"") << " " << cumulative << "\n";
+            out << withLabel(entry.name, "_sum", "") << " " << histogram.getSum() << "\n";
+            out << withLabel(entry.name, "_count", "") << " " << histogram.getCount() << "\n";
+            break;
+        }
+    }
+}
+
+MetricsRegistry &metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
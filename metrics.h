@@ -0,0 +1,86 @@
+#ifndef HIKBRIDGE_METRICS_H
+#define HIKBRIDGE_METRICS_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Metrics are registered once at startup (which allocates) and then updated lock-free from any
+// thread, including SDK callbacks. Names may carry Prometheus-style labels, e.g.
+// hikbridge_recoveries_total{action="relogin"}.
+
+class Counter {
+public:
+    void increment(long by = 1) { value.fetch_add(by, std::memory_order_relaxed); }
+    long get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<long> value {0};
+};
+
+class Gauge {
+public:
+    void set(double newValue) { value.store(newValue, std::memory_order_relaxed); }
+    void add(double delta);
+    double get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> value {0};
+};
+
+class Histogram {
+public:
+    explicit Histogram(std::vector<double> upperBounds);
+
+    void observe(double value);
+    long getCount() const { return count.load(std::memory_order_relaxed); }
+    double getSum() const { return sum.load(std::memory_order_relaxed); }
+    // Upper bound of the bucket holding the given quantile, for log lines and JSON reports.
+    double approximateQuantile(double quantile) const;
+
+private:
+    friend class MetricsRegistry;
+
+    std::vector<double> upperBounds;
+    std::unique_ptr<std::atomic<long>[]> buckets;
+    std::atomic<long> count {0};
+    std::atomic<double> sum {0};
+};
+
+class MetricsRegistry {
+public:
+    Counter &counter(const std::string &name, const std::string &help);
+    Gauge &gauge(const std::string &name, const std::string &help);
+    Histogram &histogram(const std::string &name, const std::string &help, std::vector<double> upperBounds);
+
+    // Prometheus text exposition format.
+    std::string render() const;
+
+private:
+    enum class Kind { counter, gauge, histogram };
+    struct Entry {
+        std::string name;
+        std::string help;
+        Kind kind;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+
+    Entry *find(const std::string &name);
+    static void renderEntry(const Entry &entry, std::ostream &out);
+
+    mutable std::mutex entriesMutex;
+    std::list<Entry> entries;
+};
+
+MetricsRegistry &metrics();
+
+// Bucket bounds in milliseconds shared by the latency histograms.
+extern const std::vector<double> LATENCY_BUCKETS_IN_MILLIS;
+
+#endif //HIKBRIDGE_METRICS_H
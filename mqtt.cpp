@@ -0,0 +1,398 @@
+#include "mqtt.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <plog/Log.h>
+#include <sstream>
+#include "heartbeat.h"
+#include "metrics.h"
+
+#define MQTT_CONNECT_TIMEOUT_MILLIS 5000
+#define MQTT_SEND_TIMEOUT_SECONDS 5
+#define MQTT_TICK_MILLIS 100
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+
+static Histogram &publishLatency() {
+    static Histogram &histogram = metrics().histogram(
+        "hikbridge_mqtt_publish_latency_ms",
+        "Time from queueing an MQTT publish to the broker acknowledging it.",
+        LATENCY_BUCKETS_IN_MILLIS
+    );
+    return histogram;
+}
+
+static Gauge &queueDepth() {
+    static Gauge &gauge = metrics().gauge(
+        "hikbridge_mqtt_queue_depth",
+        "MQTT publishes queued or in flight."
+    );
+    return gauge;
+}
+
+static Counter &droppedPublishes() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_mqtt_dropped_total",
+        "MQTT publishes thrown away because the offline queue was full."
+    );
+    return counter;
+}
+
+static Gauge &connected() {
+    static Gauge &gauge = metrics().gauge(
+        "hikbridge_mqtt_connected",
+        "Whether HikBridge holds a session with the MQTT broker."
+    );
+    return gauge;
+}
+
+static void appendLength(std::string &packet, size_t length) {
+    do {
+        unsigned char byte = length % 128;
+        length /= 128;
+        packet += (char) (length > 0 ? byte | 0x80 : byte);
+    } while (length > 0);
+}
+
+static void appendShort(std::string &packet, uint16_t value) {
+    packet += (char) (value >> 8);
+    packet += (char) (value & 0xff);
+}
+
+static void appendString(std::string &packet, const std::string &text) {
+    appendShort(packet, (uint16_t) text.size());
+    packet += text;
+}
+
+static std::string framePacket(unsigned char header, const std::string &body) {
+    std::string packet(1, (char) header);
+    appendLength(packet, body.size());
+    return packet + body;
+}
+
+static std::string availabilityTopic(const MqttConfig &config) {
+    return config.topicPrefix + "/availability";
+}
+
+MqttClient::MqttClient() {
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+MqttClient::~MqttClient() {
+    disconnect();
+    if (wakeFd >= 0) {
+        close(wakeFd);
+    }
+}
+
+void MqttClient::publish(const std::string &topic, const std::string &payload, bool retain) {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (!enabled) {
+            return;
+        }
+        if (queue.size() >= MQTT_OFFLINE_QUEUE_CAPACITY) {
+            queue.pop_front();
+            droppedPublishes().increment();
+        }
+        queue.push_back({ topic, payload, retain, heartbeatClockInMillis() });
+        updateQueueDepth();
+    }
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        PLOG_WARNING << "Failed to wake the MQTT client: " << strerror(errno);
+    }
+}
+
+void MqttClient::updateQueueDepth() {
+    queueDepth().set((double) (queue.size() + inFlight.size()));
+}
+
+void MqttClient::connect(const MqttConfig &config) {
+    addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    int lookupError = getaddrinfo(config.host.c_str(), std::to_string(config.port).c_str(), &hints, &addresses);
+    if (lookupError != 0) {
+        throw SubsystemFault("Failed to resolve the MQTT broker " + config.host + ": " + gai_strerror(lookupError));
+    }
+    std::unique_ptr<addrinfo, void (*)(addrinfo *)> addressesFreer(addresses, freeaddrinfo);
+
+    std::string lastError = "no addresses";
+    for (addrinfo *address = addresses; address != nullptr; address = address->ai_next) {
+        int fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, address->ai_protocol);
+        if (fd < 0) {
+            lastError = strerror(errno);
+            continue;
+        }
+        if (::connect(fd, address->ai_addr, address->ai_addrlen) != 0 && errno != EINPROGRESS) {
+            lastError = strerror(errno);
+            close(fd);
+            continue;
+        }
+        pollfd pollFd { fd, POLLOUT, 0 };
+        int socketError = 0;
+        socklen_t errorLength = sizeof(socketError);
+        if (poll(&pollFd, 1, MQTT_CONNECT_TIMEOUT_MILLIS) <= 0) {
+            lastError = "timed out";
+            close(fd);
+            continue;
+        } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &socketError, &errorLength) != 0 || socketError != 0) {
+            lastError = strerror(socketError != 0 ? socketError : errno);
+            close(fd);
+            continue;
+        }
+
+        // Back to blocking for writes, which are small and bounded by the send timeout; reads
+        // only happen once poll() says there's something there.
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        timeval sendTimeout { MQTT_SEND_TIMEOUT_SECONDS, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+        socketFd = fd;
+        return;
+    }
+    std::stringstream ss;
+    ss << "Failed to connect to the MQTT broker " << config.host << ":" << config.port << ": " << lastError;
+    throw SubsystemFault(ss.str());
+}
+
+void MqttClient::sendConnect(const MqttConfig &config) {
+    unsigned char flags = 0x04 | 0x08 | 0x20; // will, will QoS 1, will retained; clean session left off
+    if (!config.username.empty()) {
+        flags |= 0x80;
+        if (!config.password.empty()) {
+            flags |= 0x40;
+        }
+    }
+    std::string body;
+    appendString(body, "MQTT");
+    body += (char) 4;
+    body += (char) flags;
+    appendShort(body, (uint16_t) config.keepaliveSeconds);
+    appendString(body, config.clientId);
+    appendString(body, availabilityTopic(config));
+    appendString(body, "offline");
+    if (!config.username.empty()) {
+        appendString(body, config.username);
+        if (!config.password.empty()) {
+            appendString(body, config.password);
+        }
+    }
+    sendPacket(framePacket(MQTT_CONNECT, body));
+}
+
+void MqttClient::awaitConnack(SupervisedSubsystem &subsystem) {
+    unsigned char connack[4];
+    size_t received = 0;
+    long deadline = heartbeatClockInMillis() + MQTT_CONNECT_TIMEOUT_MILLIS;
+    while (received < sizeof(connack)) {
+        subsystem.checkForFault();
+        if (heartbeatClockInMillis() > deadline) {
+            throw SubsystemFault("The MQTT broker never acknowledged the connection.");
+        }
+        pollfd pollFd { socketFd, POLLIN, 0 };
+        if (poll(&pollFd, 1, MQTT_TICK_MILLIS) <= 0) {
+            continue;
+        }
+        ssize_t count = recv(socketFd, connack + received, sizeof(connack) - received, 0);
+        if (count <= 0) {
+            throw SubsystemFault("The MQTT broker hung up before acknowledging the connection.");
+        }
+        received += count;
+    }
+    if (connack[0] != MQTT_CONNACK || connack[1] != 2) {
+        throw SubsystemFault("The MQTT broker answered the connection with something other than CONNACK.");
+    } else if (connack[3] != 0) {
+        // 1-3 may clear up by themselves; bad credentials (4, 5) won't.
+        std::stringstream ss;
+        ss << "The MQTT broker refused the connection with return code <" << (int) connack[3] << ">";
+        throw SubsystemFault(ss.str(), connack[3] < 4);
+    }
+    PLOG_INFO << "Connected to the MQTT broker" << ((connack[2] & 0x01) ? ", resuming the session." : ".");
+}
+
+void MqttClient::sendPacket(const std::string &packet) {
+    size_t sent = 0;
+    while (sent < packet.size()) {
+        ssize_t count = send(socketFd, packet.data() + sent, packet.size() - sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            throw SubsystemFault(std::string("Failed writing to the MQTT broker: ") + strerror(errno));
+        }
+        sent += count;
+    }
+    lastSentAt = heartbeatClockInMillis();
+}
+
+void MqttClient::sendPublish(const Message &message, bool duplicate) {
+    std::string body;
+    appendString(body, message.topic);
+    appendShort(body, message.packetId);
+    body += message.payload;
+    unsigned char header = MQTT_PUBLISH | 0x02 | (duplicate ? 0x08 : 0) | (message.retain ? 0x01 : 0);
+    sendPacket(framePacket(header, body));
+}
+
+bool MqttClient::handlePacket(std::string &input) {
+    size_t length = 0;
+    size_t headerSize = 1;
+    for (unsigned int multiplier = 1; ; multiplier *= 128) {
+        if (headerSize >= input.size()) {
+            return false;
+        } else if (headerSize > 4) {
+            throw SubsystemFault("The MQTT broker sent a malformed packet length.");
+        }
+        unsigned char byte = input[headerSize++];
+        length += (byte & 0x7f) * multiplier;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    if (input.size() < headerSize + length) {
+        return false;
+    }
+
+    unsigned char type = input[0] & 0xf0;
+    if (type == MQTT_PUBACK && length == 2) {
+        acknowledge((uint16_t) ((unsigned char) input[headerSize] << 8 | (unsigned char) input[headerSize + 1]));
+    } else if (type == MQTT_PINGRESP) {
+        pingSentAt = -1;
+    } else {
+        PLOG_DEBUG << "Ignoring MQTT packet type <" << (type >> 4) << ">";
+    }
+    input.erase(0, headerSize + length);
+    return true;
+}
+
+void MqttClient::acknowledge(uint16_t packetId) {
+    std::lock_guard<std::mutex> lk(mutex);
+    for (auto message = inFlight.begin(); message != inFlight.end(); message++) {
+        if (message->packetId == packetId) {
+            publishLatency().observe((double) (heartbeatClockInMillis() - message->queuedAt));
+            inFlight.erase(message);
+            updateQueueDepth();
+            return;
+        }
+    }
+    PLOG_DEBUG << "The MQTT broker acknowledged unknown packet id <" << packetId << ">";
+}
+
+void MqttClient::disconnect() {
+    if (socketFd >= 0) {
+        close(socketFd);
+        socketFd = -1;
+    }
+    connected().set(0);
+}
+
+[[noreturn]] void MqttClient::run(SupervisedSubsystem &subsystem, const MqttConfig &config) {
+    if (config.host.empty()) {
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            enabled = false;
+            queue.clear();
+            inFlight.clear();
+            updateQueueDepth();
+        }
+        PLOG_INFO << "MQTT is turned off.";
+        subsystem.markHealthy();
+        subsystem.awaitFault();
+    }
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        enabled = true;
+    }
+
+    std::unique_ptr<MqttClient, void (*)(MqttClient *)> disconnector(this, [](MqttClient *client) {
+        client->disconnect();
+    });
+    connect(config);
+    sendConnect(config);
+    awaitConnack(subsystem);
+    connected().set(1);
+    pingSentAt = -1;
+
+    // The broker may have lost the session even though we asked it to keep one, so anything
+    // unacknowledged goes out again. Availability jumps the offline queue so subscribers see us
+    // come back before the backlog does.
+    std::deque<Message> unacknowledged;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        queue.push_front({ availabilityTopic(config), "online", true, heartbeatClockInMillis() });
+        updateQueueDepth();
+        unacknowledged = inFlight;
+    }
+    for (const Message &message : unacknowledged) {
+        sendPublish(message, true);
+    }
+    subsystem.markHealthy();
+
+    long keepaliveMillis = config.keepaliveSeconds * 1000L;
+    std::string input;
+    char buffer[512];
+    while (true) {
+        subsystem.checkForFault();
+
+        std::deque<Message> sendable;
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            while (!queue.empty() && inFlight.size() < MQTT_INFLIGHT_WINDOW) {
+                Message message = std::move(queue.front());
+                queue.pop_front();
+                message.packetId = nextPacketId;
+                nextPacketId = nextPacketId == UINT16_MAX ? 1 : nextPacketId + 1;
+                inFlight.push_back(message);
+                sendable.push_back(std::move(message));
+            }
+        }
+        for (const Message &message : sendable) {
+            sendPublish(message, false);
+        }
+
+        long now = heartbeatClockInMillis();
+        if (pingSentAt >= 0 && now - pingSentAt > keepaliveMillis) {
+            throw SubsystemFault("The MQTT broker stopped answering pings.");
+        } else if (keepaliveMillis > 0 && pingSentAt < 0 && now - lastSentAt >= keepaliveMillis / 2) {
+            sendPacket(std::string { (char) MQTT_PINGREQ, 0 });
+            pingSentAt = now;
+        }
+
+        pollfd pollFds[] = { { socketFd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+        int ready = poll(pollFds, 2, MQTT_TICK_MILLIS);
+        if (ready < 0 && errno != EINTR) {
+            throw SubsystemFault(std::string("Failed waiting on the MQTT broker: ") + strerror(errno));
+        } else if (ready <= 0) {
+            continue;
+        }
+        if (pollFds[1].revents & POLLIN) {
+            uint64_t wakeups;
+            while (read(wakeFd, &wakeups, sizeof(wakeups)) > 0);
+        }
+        if (pollFds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t count = recv(socketFd, buffer, sizeof(buffer), 0);
+            if (count <= 0) {
+                throw SubsystemFault("The MQTT broker closed the connection.");
+            }
+            input.append(buffer, count);
+            while (handlePacket(input));
+        }
+    }
+}
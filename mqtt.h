@@ -0,0 +1,66 @@
+#ifndef HIKBRIDGE_MQTT_H
+#define HIKBRIDGE_MQTT_H
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include "config.h"
+#include "supervisor.h"
+
+#define MQTT_SUBSYSTEM "mqtt"
+// QoS 1 publishes sent but not yet acknowledged.
+#define MQTT_INFLIGHT_WINDOW 16
+// Publishes waiting for the broker. The oldest are dropped past this.
+#define MQTT_OFFLINE_QUEUE_CAPACITY 1024
+
+// One persistent MQTT 3.1.1 connection. Publishes are always QoS 1 and pipelined up to the
+// in-flight window; whatever the broker hasn't acknowledged is resent after a reconnect, and the
+// session isn't clean, so the broker keeps its half too. The availability topic is retained, with
+// "offline" left behind as the will.
+class MqttClient {
+public:
+    MqttClient();
+    ~MqttClient();
+
+    // Never blocks, so it's safe from SDK callbacks.
+    void publish(const std::string &topic, const std::string &payload, bool retain);
+
+    // Connects and publishes until the connection breaks or a restart is requested. An empty host
+    // turns MQTT off, and publishes are thrown away while it is.
+    [[noreturn]] void run(SupervisedSubsystem &subsystem, const MqttConfig &config);
+
+private:
+    struct Message {
+        std::string topic;
+        std::string payload;
+        bool retain;
+        long queuedAt;
+        uint16_t packetId = 0;
+    };
+
+    void connect(const MqttConfig &config);
+    void sendConnect(const MqttConfig &config);
+    void awaitConnack(SupervisedSubsystem &subsystem);
+    void sendPublish(const Message &message, bool duplicate);
+    void sendPacket(const std::string &packet);
+    // Returns false once the buffered input holds no more whole packets.
+    bool handlePacket(std::string &input);
+    void acknowledge(uint16_t packetId);
+    void updateQueueDepth();
+    void disconnect();
+
+    std::mutex mutex;
+    std::deque<Message> queue;
+    std::deque<Message> inFlight;
+    uint16_t nextPacketId = 1;
+    bool enabled = true;
+
+    int socketFd = -1;
+    // Written by publish() to wake run() out of poll().
+    int wakeFd = -1;
+    long lastSentAt = 0;
+    long pingSentAt = -1;
+};
+
+#endif //HIKBRIDGE_MQTT_H
@@ -0,0 +1,25 @@
+#ifndef HIKBRIDGE_PROBES_H
+#define HIKBRIDGE_PROBES_H
+
+// USDT probes at the hot-path boundaries, for the bpftrace scripts in tracing/. Each one is a
+// single nop in the binary until a tracer attaches, so they stay in production builds. They need
+// systemtap's sys/sdt.h (systemtap-sdt-dev) and compile away entirely without it. CMake warns
+// when it's missing, and refuses a release or remote build without it.
+#if defined(__has_include) && !defined(HIKBRIDGE_NO_PROBES)
+    #if __has_include(<sys/sdt.h>)
+        #include <sys/sdt.h>
+        #define HIKBRIDGE_PROBES_ENABLED
+    #endif
+#endif
+
+#ifdef HIKBRIDGE_PROBES_ENABLED
+    #define HIKBRIDGE_PROBE(name) DTRACE_PROBE(hikbridge, name)
+    #define HIKBRIDGE_PROBE1(name, a) DTRACE_PROBE1(hikbridge, name, a)
+    #define HIKBRIDGE_PROBE2(name, a, b) DTRACE_PROBE2(hikbridge, name, a, b)
+#else
+    #define HIKBRIDGE_PROBE(name) do {} while (0)
+    #define HIKBRIDGE_PROBE1(name, a) do {} while (0)
+    #define HIKBRIDGE_PROBE2(name, a, b) do {} while (0)
+#endif
+
+#endif //HIKBRIDGE_PROBES_H
@@ -0,0 +1,412 @@
+#include "recorder.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <plog/Log.h>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include "allocationAudit.h"
+#include "heartbeat.h"
+#include "metrics.h"
+
+#define RECORDER_DRAIN_MILLIS 50
+#define RECORDER_SWEEP_INTERVAL_MILLIS 3600000
+// Where O_DIRECT wants buffers and file offsets aligned.
+#define RECORDER_BLOCK_ALIGNMENT 4096
+// A direction that's quiet for longer than this gets a fresh index entry when it resumes.
+#define RECORDER_GAP_MILLIS 100
+#define WAV_HEADER_BYTES 46
+
+static Counter &droppedFrames() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_recorder_dropped_frames_total",
+        "Voice talk frames left out of the recording because the writer fell behind."
+    );
+    return counter;
+}
+
+static Counter &writtenBytes() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_recorder_written_bytes_total",
+        "Bytes of recorded audio written to disk."
+    );
+    return counter;
+}
+
+static void putLittleEndian32(unsigned char *bytes, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static void putLittleEndian16(unsigned char *bytes, uint16_t value) {
+    bytes[0] = (unsigned char) value;
+    bytes[1] = (unsigned char) (value >> 8);
+}
+
+static uint16_t wavFormatTag(VoiceCodec codec) {
+    switch (codec) {
+        case VoiceCodec::g711MuLaw: return 0x0007;
+        case VoiceCodec::g711ALaw: return 0x0006;
+        case VoiceCodec::g722: return 0x0065;
+        case VoiceCodec::g726: return 0x0064;
+    }
+    return 0;
+}
+
+// A non-PCM WAV header, so the fmt chunk carries an (empty) cbSize.
+static void writeWavHeader(unsigned char *header, const CodecProfile &codec, uint32_t dataBytes) {
+    uint32_t byteRate = (uint32_t) (codec.encodedFrameBytes * 1000 / codec.frameMillis());
+    memcpy(header, "RIFF", 4);
+    putLittleEndian32(header + 4, WAV_HEADER_BYTES - 8 + dataBytes);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    putLittleEndian32(header + 16, 18);
+    putLittleEndian16(header + 20, wavFormatTag(codec.codec));
+    putLittleEndian16(header + 22, 1);
+    putLittleEndian32(header + 24, codec.sampleRate);
+    putLittleEndian32(header + 28, byteRate);
+    putLittleEndian16(header + 32, 1);
+    putLittleEndian16(header + 34, (uint16_t) (byteRate * 8 / codec.sampleRate));
+    putLittleEndian16(header + 36, 0);
+    memcpy(header + 38, "data", 4);
+    putLittleEndian32(header + 42, dataBytes);
+}
+
+// One direction's WAV file. Audio collects in an aligned buffer that's written a whole block at a
+// time; the header goes in front of the first block as a placeholder, so every block lands on an
+// aligned offset, and is rewritten with the real sizes once the session ends.
+class RecordingTrack {
+public:
+    RecordingTrack(const std::string &path, const CodecProfile &codec, bool directIo) : path(path), codec(codec) {
+        if (posix_memalign(reinterpret_cast<void **>(&buffer), RECORDER_BLOCK_ALIGNMENT, RECORDER_BATCH_BYTES) != 0) {
+            throw SubsystemFault("Failed to allocate a recording buffer.");
+        }
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        fd = directIo ? open(path.c_str(), flags | O_DIRECT, 0640) : -1;
+        if (directIo && fd < 0) {
+            PLOG_WARNING << "Can't record to " << path << " with O_DIRECT (" << strerror(errno) << "). Going through the page cache.";
+        }
+        if (fd < 0) {
+            fd = open(path.c_str(), flags, 0640);
+        }
+        if (fd < 0) {
+            std::string error = strerror(errno);
+            free(buffer);
+            throw SubsystemFault("Can't record to " + path + ": " + error);
+        }
+        memset(buffer, 0, WAV_HEADER_BYTES);
+        filled = WAV_HEADER_BYTES;
+    }
+
+    RecordingTrack(const RecordingTrack &) = delete;
+    RecordingTrack &operator=(const RecordingTrack &) = delete;
+
+    ~RecordingTrack() {
+        close(fd);
+        free(buffer);
+    }
+
+    // True when this frame starts or resumes the direction, so it deserves an index entry.
+    bool append(const char *frame, size_t size, long at) {
+        bool resumed = lastFrameAt < 0 || at - lastFrameAt > RECORDER_GAP_MILLIS;
+        lastFrameAt = at;
+        while (size > 0) {
+            size_t chunk = std::min(size, (size_t) RECORDER_BATCH_BYTES - filled);
+            memcpy(buffer + filled, frame, chunk);
+            filled += chunk;
+            frame += chunk;
+            size -= chunk;
+            dataBytes += chunk;
+            if (filled == RECORDER_BATCH_BYTES) {
+                writeBlock(RECORDER_BATCH_BYTES);
+            }
+        }
+        return resumed;
+    }
+
+    // Where the next frame's audio starts, counted from the start of the WAV's data.
+    uint32_t dataOffset() const { return dataBytes; }
+
+    void finish() {
+        // The tail is shorter than a block, which O_DIRECT won't take.
+        int flags = fcntl(fd, F_GETFL);
+        if (flags >= 0 && (flags & O_DIRECT)) {
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+        }
+        if (filled > 0) {
+            writeBlock(filled);
+        }
+        unsigned char header[WAV_HEADER_BYTES];
+        writeWavHeader(header, codec, dataBytes);
+        if (pwrite(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+            PLOG_WARNING << "Failed to finish the WAV header of " << path << ": " << strerror(errno);
+        }
+    }
+
+private:
+    void writeBlock(size_t size) {
+        ssize_t written = pwrite(fd, buffer, size, (off_t) fileOffset);
+        if (written != (ssize_t) size) {
+            throw SubsystemFault("Failed writing the recording " + path + ": " + strerror(errno));
+        }
+        writtenBytes().increment((long) size);
+        fileOffset += size;
+        filled = 0;
+    }
+
+    std::string path;
+    const CodecProfile &codec;
+    int fd;
+    unsigned char *buffer = nullptr;
+    size_t filled = 0;
+    size_t fileOffset = 0;
+    uint32_t dataBytes = 0;
+    long lastFrameAt = -1;
+};
+
+ConversationRecorder::ConversationRecorder() {
+    for (unsigned long i = 0; i < cells.size(); i++) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+ConversationRecorder::~ConversationRecorder() = default;
+
+ConversationRecorder::Item *ConversationRecorder::claim(unsigned long &position) {
+    position = enqueuePosition.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+        cell = &cells[position & (RECORDER_QUEUE_CAPACITY - 1)];
+        long lag = (long) (cell->sequence.load(std::memory_order_acquire) - position);
+        if (lag == 0) {
+            if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (lag < 0) {
+            return nullptr;
+        } else {
+            position = enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+    return &cell->item;
+}
+
+void ConversationRecorder::commit(unsigned long position) {
+    cells[position & (RECORDER_QUEUE_CAPACITY - 1)].sequence.store(position + 1, std::memory_order_release);
+}
+
+// The writer is the only consumer, so there's no race for the cell.
+bool ConversationRecorder::pop(Item &item) {
+    unsigned long position = dequeuePosition.load(std::memory_order_relaxed);
+    Cell &cell = cells[position & (RECORDER_QUEUE_CAPACITY - 1)];
+    if (cell.sequence.load(std::memory_order_acquire) != position + 1) {
+        return false;
+    }
+    item.kind = cell.item.kind;
+    item.direction = cell.item.direction;
+    item.codec = cell.item.codec;
+    item.at = cell.item.at;
+    item.size = cell.item.size;
+    memcpy(item.data, cell.item.data, cell.item.size);
+    dequeuePosition.store(position + 1, std::memory_order_relaxed);
+    cell.sequence.store(position + RECORDER_QUEUE_CAPACITY, std::memory_order_release);
+    return true;
+}
+
+void ConversationRecorder::beginSession(const CodecProfile &codec) {
+    unsigned long position;
+    Item *item;
+    if (!enabled.load(std::memory_order_relaxed) || (item = claim(position)) == nullptr) {
+        return;
+    }
+    item->kind = Item::begin;
+    item->codec = &codec;
+    item->at = heartbeatClockInMillis();
+    item->size = 0;
+    commit(position);
+}
+
+void ConversationRecorder::record(RecordedDirection direction, const char *frame, size_t size) {
+    if (!enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    unsigned long position;
+    Item *item = claim(position);
+    if (item == nullptr) {
+        droppedFrames().increment();
+        return;
+    }
+    item->kind = Item::frame;
+    item->direction = direction;
+    item->at = heartbeatClockInMillis();
+    item->size = std::min(size, (size_t) MAX_RECORDED_FRAME_BYTES);
+    memcpy(item->data, frame, item->size);
+    commit(position);
+}
+
+void ConversationRecorder::endSession() {
+    unsigned long position;
+    Item *item;
+    if (!enabled.load(std::memory_order_relaxed) || (item = claim(position)) == nullptr) {
+        return;
+    }
+    item->kind = Item::end;
+    item->at = heartbeatClockInMillis();
+    item->size = 0;
+    commit(position);
+}
+
+static void appendIndex(int indexFd, std::string_view line) {
+    if (indexFd >= 0 && write(indexFd, line.data(), line.size()) != (ssize_t) line.size()) {
+        PLOG_WARNING << "Failed to write the recording index: " << strerror(errno);
+    }
+}
+
+void ConversationRecorder::openSession(const Item &begin, const RecordingConfig &config) {
+    char stamp[32];
+    time_t now = time(nullptr);
+    tm local {};
+    localtime_r(&now, &local);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+    std::string base = config.directory + "/" + stamp;
+
+    outgoing = std::make_unique<RecordingTrack>(base + "-out.wav", *begin.codec, config.directIo);
+    incoming = std::make_unique<RecordingTrack>(base + "-in.wav", *begin.codec, config.directIo);
+    indexFd = open((base + ".index").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0640);
+    if (indexFd < 0) {
+        PLOG_WARNING << "Recording without an index, since " << base << ".index can't be opened: " << strerror(errno);
+    }
+    sessionStartedAt = begin.at;
+
+    char startedAt[32];
+    strftime(startedAt, sizeof(startedAt), "%Y-%m-%dT%H:%M:%S", &local);
+    std::stringstream header;
+    header << "# <millis into the session> <direction> <byte offset into that direction's WAV data>" << std::endl
+           << "started " << startedAt << std::endl
+           << "codec " << begin.codec->name << " " << begin.codec->sampleRate << std::endl;
+    appendIndex(indexFd, header.str());
+    PLOG_INFO << "Recording voice talk to " << base;
+}
+
+void ConversationRecorder::closeSession(long at) {
+    if (!outgoing) {
+        return;
+    }
+    std::stringstream footer;
+    footer << "ended " << at - sessionStartedAt << std::endl;
+    appendIndex(indexFd, footer.str());
+    if (indexFd >= 0) {
+        close(indexFd);
+        indexFd = -1;
+    }
+    outgoing->finish();
+    incoming->finish();
+    outgoing.reset();
+    incoming.reset();
+}
+
+static bool endsWith(const std::string &text, const char *suffix) {
+    size_t length = strlen(suffix);
+    return text.size() > length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+void ConversationRecorder::sweep(const RecordingConfig &config) {
+    if (config.retentionDays == 0) {
+        return;
+    }
+    DIR *dir = opendir(config.directory.c_str());
+    if (dir == nullptr) {
+        PLOG_WARNING << "Can't sweep old recordings from " << config.directory << ": " << strerror(errno);
+        return;
+    }
+    time_t cutoff = time(nullptr) - (time_t) config.retentionDays * 86400;
+    int removed = 0;
+    while (dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (!endsWith(name, "-out.wav") && !endsWith(name, "-in.wav") && !endsWith(name, ".index")) {
+            continue;
+        }
+        std::string path = config.directory + "/" + name;
+        struct stat fileStat {};
+        if (stat(path.c_str(), &fileStat) == 0 && fileStat.st_mtime < cutoff && unlink(path.c_str()) == 0) {
+            removed++;
+        }
+    }
+    closedir(dir);
+    if (removed > 0) {
+        PLOG_INFO << "Removed " << removed << " recording file(s) older than " << config.retentionDays << " days.";
+    }
+}
+
+[[noreturn]] void ConversationRecorder::run(SupervisedSubsystem &subsystem, const RecordingConfig &config) {
+    if (config.directory.empty()) {
+        PLOG_INFO << "Voice talk isn't being recorded.";
+        subsystem.markHealthy();
+        subsystem.awaitFault();
+    }
+    if (access(config.directory.c_str(), W_OK) != 0) {
+        throw SubsystemFault("Can't record to " + config.directory + ": " + strerror(errno));
+    }
+
+    // Whatever was queued before this writer started belongs to no session it knows of.
+    Item item;
+    while (pop(item)) {}
+    // Registered here rather than on the first drop, which would allocate on the voice talk thread.
+    droppedFrames();
+    enabled = true;
+    subsystem.markHealthy();
+    long nextSweepAt = heartbeatClockInMillis();
+    try {
+        while (true) {
+            subsystem.checkForFault();
+            while (pop(item)) {
+                if (item.kind == Item::begin) {
+                    closeSession(item.at);
+                    openSession(item, config);
+                } else if (item.kind == Item::end) {
+                    closeSession(item.at);
+                } else if (outgoing) {
+                    ALLOCATION_STAGE(recorder);
+                    RecordingTrack &track = item.direction == RecordedDirection::outgoing ? *outgoing : *incoming;
+                    uint32_t offset = track.dataOffset();
+                    if (track.append(item.data, item.size, item.at)) {
+                        char entry[64];
+                        int length = snprintf(
+                            entry, sizeof(entry), "%ld %s %u\n", item.at - sessionStartedAt,
+                            item.direction == RecordedDirection::outgoing ? "out" : "in", offset
+                        );
+                        appendIndex(indexFd, std::string_view(entry, (size_t) length));
+                    }
+                }
+            }
+            if (heartbeatClockInMillis() >= nextSweepAt) {
+                sweep(config);
+                nextSweepAt = heartbeatClockInMillis() + RECORDER_SWEEP_INTERVAL_MILLIS;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(RECORDER_DRAIN_MILLIS));
+        }
+    } catch (...) {
+        enabled = false;
+        try {
+            closeSession(heartbeatClockInMillis());
+        } catch (const SubsystemFault &fault) {
+            PLOG_WARNING << "Lost the end of the recording: " << fault.what();
+        }
+        outgoing.reset();
+        incoming.reset();
+        if (indexFd >= 0) {
+            close(indexFd);
+            indexFd = -1;
+        }
+        throw;
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef HIKBRIDGE_RECORDER_H
+#define HIKBRIDGE_RECORDER_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "codec.h"
+#include "config.h"
+#include "supervisor.h"
+
+#define RECORDER_SUBSYSTEM "recorder"
+// Must be a power of two. About ten seconds of both directions at 20 ms frames.
+#define RECORDER_QUEUE_CAPACITY 1024
+// The SDK hands over whole codec frames, the largest being G.722's.
+#define MAX_RECORDED_FRAME_BYTES 640
+// Each track is written in blocks of this size, which keeps O_DIRECT's alignment.
+#define RECORDER_BATCH_BYTES 65536
+
+enum class RecordedDirection { outgoing, incoming };
+
+class RecordingTrack;
+
+// Records both directions of every voice talk session, each to a WAV file in the codec the
+// device talks, along with an index of when each direction's audio starts and resumes. The audio
+// threads only copy frames into a lock-free queue; a writer thread of its own does all the I/O.
+class ConversationRecorder {
+public:
+    ConversationRecorder();
+    ~ConversationRecorder();
+
+    // These never block or allocate, and drop what doesn't fit in the queue.
+    void beginSession(const CodecProfile &codec);
+    void record(RecordedDirection direction, const char *frame, size_t size);
+    void endSession();
+
+    [[noreturn]] void run(SupervisedSubsystem &subsystem, const RecordingConfig &config);
+
+private:
+    struct Item {
+        enum { begin, frame, end } kind;
+        RecordedDirection direction;
+        const CodecProfile *codec;
+        long at;
+        size_t size;
+        char data[MAX_RECORDED_FRAME_BYTES];
+    };
+    struct Cell {
+        std::atomic<unsigned long> sequence;
+        Item item;
+    };
+
+    // Same scheme as IntercomEventQueue: claim a cell, fill it in place, then publish it.
+    Item *claim(unsigned long &position);
+    void commit(unsigned long position);
+    bool pop(Item &item);
+
+    void openSession(const Item &begin, const RecordingConfig &config);
+    void closeSession(long at);
+    void sweep(const RecordingConfig &config);
+
+    std::array<Cell, RECORDER_QUEUE_CAPACITY> cells;
+    alignas(64) std::atomic<unsigned long> enqueuePosition {0};
+    alignas(64) std::atomic<unsigned long> dequeuePosition {0};
+    // Nothing is queued while no writer is running.
+    std::atomic<bool> enabled {false};
+
+    std::unique_ptr<RecordingTrack> outgoing;
+    std::unique_ptr<RecordingTrack> incoming;
+    int indexFd = -1;
+    long sessionStartedAt = 0;
+};
+
+#endif //HIKBRIDGE_RECORDER_H
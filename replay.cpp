@@ -0,0 +1,366 @@
+#include "replay.h"
+#include "audioPipeline.h"
+#include "eventStream.h"
+
+#include <plog/Log.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#ifdef REMOTE
+    #include <alsa/asoundlib.h>
+#else
+    #include "alsa-lib-1.2.6.1/include/asoundlib.h"
+#endif
+
+#define REPLAY_VOICE_COM_HANDLE 0
+#define REPLAY_LISTEN_HANDLE 0
+
+struct ReplayVadTransition {
+    long atMillis;
+    bool isSilence;
+};
+
+struct ReplayFrameDrop {
+    long atMillis;
+    long errCode;
+};
+
+struct ReplayAlarm {
+    long atMillis;
+    std::string device;
+    int alarmType;
+    bool acted;
+};
+
+struct ReplayState {
+    bool active = false;
+    bool virtualClock = false;
+    std::string capturePath;
+    unsigned int periodMillis = 0;
+    long totalPeriods = 0;
+    std::atomic<long> periodsRead {0};
+    std::chrono::steady_clock::time_point wallStart;
+    std::function<void()> wakeVoiceCallback;
+
+    std::mutex reportMutex;
+    long silentPeriods = 0;
+    long voicedPeriods = 0;
+    int lastVadDecision = -1;
+    std::vector<ReplayVadTransition> vadTransitions;
+    std::vector<long> voiceTalkStarts;
+    std::vector<long> voiceTalkStops;
+    std::vector<ReplayFrameDrop> frameDrops;
+    long framesSent = 0;
+    long alarmsPushed = 0;
+    std::vector<ReplayAlarm> routedAlarms;
+
+    std::atomic<bool> voiceComActive {false};
+    std::atomic<bool> voiceComThreadDone {true};
+    std::thread voiceComThread;
+
+    std::atomic<bool> listenActive {false};
+    std::thread listenThread;
+};
+
+static ReplayState replay;
+
+static long replayPositionInMillis() {
+    return replay.periodsRead * (long) replay.periodMillis;
+}
+
+static void loadReplayAlsaConfig(const std::string &asoundrcPath) {
+    int errCode = snd_config_update();
+    if (errCode < 0) {
+        PLOG_ERROR << "Failed to load the ALSA configuration: " << snd_strerror(errCode);
+        return;
+    }
+    snd_input_t *input;
+    errCode = snd_input_stdio_open(&input, asoundrcPath.c_str(), "r");
+    if (errCode < 0) {
+        PLOG_ERROR << "Failed to open replay ALSA config @ " << asoundrcPath << ": " << snd_strerror(errCode);
+        return;
+    }
+    errCode = snd_config_load(snd_config, input);
+    snd_input_close(input);
+    if (errCode < 0) {
+        PLOG_ERROR << "Failed to parse replay ALSA config @ " << asoundrcPath << ": " << snd_strerror(errCode);
+    } else {
+        PLOG_INFO << "Loaded replay ALSA config from " << asoundrcPath;
+    }
+}
+
+void beginReplay(
+    const std::string &capturePath,
+    const std::string &asoundrcPath,
+    bool virtualClock,
+    unsigned int bytesPerPeriod,
+    unsigned int periodMillis,
+    std::function<void()> wakeVoiceCallback
+) {
+    // The path is spliced into a quoted ALSA config string, which would need these escaped.
+    if (capturePath.find_first_of("\"\\") != std::string::npos) {
+        throw std::runtime_error("The replay capture path can't contain quotes or backslashes: " + capturePath);
+    }
+    struct stat captureStat {};
+    if (stat(capturePath.c_str(), &captureStat) != 0) {
+        throw std::runtime_error("Unable to stat replay capture @ " + capturePath + ": " + strerror(errno));
+    }
+    replay.active = true;
+    replay.virtualClock = virtualClock;
+    replay.capturePath = capturePath;
+    replay.periodMillis = periodMillis;
+    replay.totalPeriods = captureStat.st_size / bytesPerPeriod;
+    replay.wakeVoiceCallback = std::move(wakeVoiceCallback);
+    replay.wallStart = std::chrono::steady_clock::now();
+
+    PLOG_INFO << "Replaying " << replay.totalPeriods << " periods (" << replay.totalPeriods * periodMillis
+              << " ms) from " << capturePath << (virtualClock ? " on a virtual clock" : " in real time");
+    loadReplayAlsaConfig(asoundrcPath);
+}
+
+bool isReplaying() {
+    return replay.active;
+}
+
+std::string replayCaptureCoordinates() {
+    std::stringstream ss;
+    ss << "hikbridge_replay:CAPTURE=\"" << replay.capturePath << "\"";
+    return ss.str();
+}
+
+bool replayHasMorePeriods() {
+    return replay.periodsRead < replay.totalPeriods;
+}
+
+void replayPacePeriod() {
+    if (!replay.virtualClock) {
+        std::this_thread::sleep_until(
+            replay.wallStart + std::chrono::milliseconds(replayPositionInMillis() + replay.periodMillis)
+        );
+    }
+    replay.periodsRead++;
+}
+
+long replayVirtualTimeInMillis() {
+    if (!replay.active || !replay.virtualClock) {
+        return -1;
+    }
+    return replayPositionInMillis();
+}
+
+void replayRecordVadDecision(bool isSilence) {
+    std::lock_guard<std::mutex> lk(replay.reportMutex);
+    if (isSilence) {
+        replay.silentPeriods++;
+    } else {
+        replay.voicedPeriods++;
+    }
+    if (replay.lastVadDecision != (int) isSilence) {
+        replay.vadTransitions.push_back({ replayPositionInMillis(), isSilence });
+        replay.lastVadDecision = isSilence;
+    }
+}
+
+void replayRecordFrameDrop(long errCode) {
+    std::lock_guard<std::mutex> lk(replay.reportMutex);
+    replay.frameDrops.push_back({ replayPositionInMillis(), errCode });
+}
+
+LONG replayStartVoiceCom(HikVoiceDataCallback voiceDataCallback) {
+    if (replay.voiceComActive) {
+        replayStopVoiceCom(REPLAY_VOICE_COM_HANDLE);
+    }
+    {
+        std::lock_guard<std::mutex> lk(replay.reportMutex);
+        replay.voiceTalkStarts.push_back(replayPositionInMillis());
+    }
+    PLOG_INFO << "Replay voice talk started @ " << replayPositionInMillis() << " ms";
+
+    // Plays the part of the SDK's voice talk thread, which pulls one period per callback.
+    replay.voiceComActive = true;
+    replay.voiceComThreadDone = false;
+    replay.voiceComThread = std::thread([voiceDataCallback]() {
+        char sendBuffer[SOUNDCARD_PERIOD_BYTES];
+        auto nextCallback = std::chrono::steady_clock::now();
+        while (replay.voiceComActive) {
+            voiceDataCallback(REPLAY_VOICE_COM_HANDLE, sendBuffer, sizeof(sendBuffer), 0, nullptr);
+            if (!replay.virtualClock) {
+                nextCallback += std::chrono::milliseconds(replay.periodMillis);
+                std::this_thread::sleep_until(nextCallback);
+            }
+        }
+        replay.voiceComThreadDone = true;
+    });
+    return REPLAY_VOICE_COM_HANDLE;
+}
+
+BOOL replayStopVoiceCom([[maybe_unused]] LONG voiceComHandle) {
+    if (!replay.voiceComActive) {
+        return false;
+    }
+    replay.voiceComActive = false;
+    // The stand-in SDK thread may be parked inside the voice callback's CV wait.
+    while (!replay.voiceComThreadDone) {
+        replay.wakeVoiceCallback();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    replay.voiceComThread.join();
+    std::lock_guard<std::mutex> lk(replay.reportMutex);
+    replay.voiceTalkStops.push_back(replayPositionInMillis());
+    PLOG_INFO << "Replay voice talk stopped @ " << replayPositionInMillis() << " ms";
+    return true;
+}
+
+BOOL replayVoiceComSendData(
+    [[maybe_unused]] LONG voiceComHandle,
+    [[maybe_unused]] char *sendBuffer,
+    [[maybe_unused]] DWORD bufferSize
+) {
+    std::lock_guard<std::mutex> lk(replay.reportMutex);
+    replay.framesSent++;
+    return true;
+}
+
+static std::vector<ReplayAlarm> loadReplayAlarms(const std::string &alarmsPath) {
+    std::vector<ReplayAlarm> alarms;
+    std::ifstream file(alarmsPath);
+    if (!file) {
+        PLOG_ERROR << "Unable to read replay alarms @ " << alarmsPath;
+        return alarms;
+    }
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+        std::stringstream fields(line.substr(0, line.find('#')));
+        ReplayAlarm alarm { 0, "", 0, false };
+        std::string alarmType;
+        if (!(fields >> alarm.atMillis)) {
+            continue;
+        } else if (!(fields >> alarm.device >> alarmType)) {
+            PLOG_ERROR << alarmsPath << ":" << lineNumber << ": expected <millis> <device IP> <alarm type>";
+            continue;
+        }
+        alarm.alarmType = (int) std::stol(alarmType, nullptr, 0);
+        alarms.push_back(alarm);
+    }
+    std::stable_sort(alarms.begin(), alarms.end(), [](const ReplayAlarm &a, const ReplayAlarm &b) {
+        return a.atMillis < b.atMillis;
+    });
+    return alarms;
+}
+
+LONG replayStartListen(const std::string &alarmsPath, MSGCallBack callback) {
+    std::vector<ReplayAlarm> alarms = loadReplayAlarms(alarmsPath);
+    PLOG_INFO << "Replaying " << alarms.size() << " pushed alarms from " << alarmsPath;
+
+    // Plays the part of the SDK's listener thread, which calls back once per pushed alarm.
+    replay.listenActive = true;
+    replay.listenThread = std::thread([alarms, callback]() {
+        for (const ReplayAlarm &scripted : alarms) {
+            while (replay.listenActive && replayPositionInMillis() < scripted.atMillis) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            if (!replay.listenActive) {
+                return;
+            }
+            NET_DVR_ALARMER alarmer {};
+            alarmer.lUserID = -1;
+            alarmer.byDeviceIPValid = 1;
+            strncpy(alarmer.sDeviceIP, scripted.device.c_str(), sizeof(alarmer.sDeviceIP) - 1);
+            NET_DVR_VIDEO_INTERCOM_ALARM alarm {};
+            alarm.dwSize = sizeof(alarm);
+            alarm.byAlarmType = (BYTE) scripted.alarmType;
+            callback(COMM_ALARM_VIDEO_INTERCOM, &alarmer, reinterpret_cast<char *>(&alarm), sizeof(alarm), nullptr);
+            std::lock_guard<std::mutex> lk(replay.reportMutex);
+            replay.alarmsPushed++;
+        }
+    });
+    return REPLAY_LISTEN_HANDLE;
+}
+
+BOOL replayStopListen([[maybe_unused]] LONG listenHandle) {
+    if (!replay.listenThread.joinable()) {
+        return false;
+    }
+    replay.listenActive = false;
+    replay.listenThread.join();
+    return true;
+}
+
+void replayRecordRoutedAlarm(const char *device, int alarmType, bool acted) {
+    std::lock_guard<std::mutex> lk(replay.reportMutex);
+    replay.routedAlarms.push_back({ replayPositionInMillis(), device, alarmType, acted });
+}
+
+static void writeMillisArray(std::ostream &out, const std::vector<long> &values) {
+    out << "[";
+    for (size_t i = 0; i < values.size(); i++) {
+        out << (i > 0 ? ", " : "") << values[i];
+    }
+    out << "]";
+}
+
+void writeReplayReport(const std::string &reportPath) {
+    std::lock_guard<std::mutex> lk(replay.reportMutex);
+    auto wallMillis = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - replay.wallStart
+    ).count();
+
+    std::stringstream report;
+    report << "{" << std::endl
+           << "  \"capture\": \"" << jsonEscape(replay.capturePath) << "\"," << std::endl
+           << "  \"virtualClock\": " << (replay.virtualClock ? "true" : "false") << "," << std::endl
+           << "  \"periodsRead\": " << replay.periodsRead << "," << std::endl
+           << "  \"audioMillis\": " << replayPositionInMillis() << "," << std::endl
+           << "  \"wallMillis\": " << wallMillis << "," << std::endl
+           << "  \"vad\": {" << std::endl
+           << "    \"silentPeriods\": " << replay.silentPeriods << "," << std::endl
+           << "    \"voicedPeriods\": " << replay.voicedPeriods << "," << std::endl
+           << "    \"transitions\": [";
+    for (size_t i = 0; i < replay.vadTransitions.size(); i++) {
+        report << (i > 0 ? ", " : "") << "{\"atMillis\": " << replay.vadTransitions[i].atMillis
+               << ", \"isSilence\": " << (replay.vadTransitions[i].isSilence ? "true" : "false") << "}";
+    }
+    report << "]" << std::endl
+           << "  }," << std::endl
+           << "  \"voiceTalk\": {" << std::endl
+           << "    \"starts\": ";
+    writeMillisArray(report, replay.voiceTalkStarts);
+    report << "," << std::endl << "    \"stops\": ";
+    writeMillisArray(report, replay.voiceTalkStops);
+    report << "," << std::endl
+           << "    \"framesSent\": " << replay.framesSent << std::endl
+           << "  }," << std::endl
+           << "  \"listener\": {" << std::endl
+           << "    \"alarmsPushed\": " << replay.alarmsPushed << "," << std::endl
+           << "    \"routed\": [";
+    for (size_t i = 0; i < replay.routedAlarms.size(); i++) {
+        const ReplayAlarm &alarm = replay.routedAlarms[i];
+        report << (i > 0 ? ", " : "") << "{\"atMillis\": " << alarm.atMillis << ", \"device\": \"" << jsonEscape(alarm.device)
+               << "\", \"alarmType\": " << alarm.alarmType << ", \"acted\": " << (alarm.acted ? "true" : "false") << "}";
+    }
+    report << "]" << std::endl
+           << "  }," << std::endl
+           << "  \"frameDrops\": [";
+    for (size_t i = 0; i < replay.frameDrops.size(); i++) {
+        report << (i > 0 ? ", " : "") << "{\"atMillis\": " << replay.frameDrops[i].atMillis
+               << ", \"errCode\": " << replay.frameDrops[i].errCode << "}";
+    }
+    report << "]" << std::endl << "}" << std::endl;
+
+    if (reportPath.empty()) {
+        PLOG_INFO << "Replay report:" << std::endl << report.str();
+        return;
+    }
+    std::ofstream reportFile(reportPath);
+    reportFile << report.str();
+    PLOG_INFO << "Wrote replay report to " << reportPath;
+}
@@ -0,0 +1,49 @@
+#ifndef HIKBRIDGE_REPLAY_H
+#define HIKBRIDGE_REPLAY_H
+
+#include <functional>
+#include <string>
+#include <HCNetSDK.h>
+
+typedef void (*HikVoiceDataCallback)(LONG, char *, DWORD, BYTE, void *);
+
+// Replay mode feeds a recorded mu-law capture through soundcardReadLoop via the ALSA
+// `file`/`null` plugins described in replay.asoundrc, and stands in for the SDK's voice talk
+// calls so no Hik device is needed. Throws std::runtime_error if the capture can't be replayed.
+void beginReplay(
+    const std::string &capturePath,
+    const std::string &asoundrcPath,
+    bool virtualClock,
+    unsigned int bytesPerPeriod,
+    unsigned int periodMillis,
+    std::function<void()> wakeVoiceCallback
+);
+bool isReplaying();
+std::string replayCaptureCoordinates();
+bool replayHasMorePeriods();
+
+// Blocks like a real soundcard would until the next period is due. With the virtual clock
+// it returns immediately and advances virtual time by one period instead.
+void replayPacePeriod();
+// -1 unless the virtual clock is in use.
+long replayVirtualTimeInMillis();
+
+void replayRecordVadDecision(bool isSilence);
+void replayRecordFrameDrop(long errCode);
+
+LONG replayStartVoiceCom(HikVoiceDataCallback voiceDataCallback);
+BOOL replayStopVoiceCom(LONG voiceComHandle);
+BOOL replayVoiceComSendData(LONG voiceComHandle, char *sendBuffer, DWORD bufferSize);
+
+// Stands in for NET_DVR_StartListen_V30. Pushes the alarms scripted in alarmsPath through callback
+// on the replay clock, as though the devices named there were pushing them to the listening port.
+// Each line is "<millis into the replay> <device IP> <byAlarmType>", and # starts a comment.
+LONG replayStartListen(const std::string &alarmsPath, MSGCallBack callback);
+BOOL replayStopListen(LONG listenHandle);
+void replayRecordRoutedAlarm(const char *device, int alarmType, bool acted);
+
+// Writes a JSON report of VAD decisions, voice talk starts/stops and frame drops.
+// An empty path logs the report instead.
+void writeReplayReport(const std::string &reportPath);
+
+#endif //HIKBRIDGE_REPLAY_H
@@ -0,0 +1,130 @@
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#if defined(__ARM_NEON)
+    #include <arm_neon.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+// Sinc zero crossings on each side of the centre tap. 16 with a Kaiser beta of 8 gives roughly
+// 80 dB of stopband, well past what an 8-bit G.711 sample can resolve.
+#define RESAMPLER_ZERO_CROSSINGS 16
+#define RESAMPLER_KAISER_BETA 8.0
+// Passband edge as a fraction of the output Nyquist frequency.
+#define RESAMPLER_ROLLOFF 0.9
+// Taps per phase are padded to this so the SIMD dot product never needs a scalar tail.
+#define RESAMPLER_TAP_ALIGNMENT 8
+
+static double besselI0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+static int32_t dotProduct(const int16_t *__restrict samples, const int16_t *__restrict taps, unsigned int count) {
+#if defined(__ARM_NEON)
+    int32x4_t accumulator = vdupq_n_s32(0);
+    for (unsigned int i = 0; i < count; i += 8) {
+        int16x8_t s = vld1q_s16(samples + i);
+        int16x8_t t = vld1q_s16(taps + i);
+        accumulator = vmlal_s16(accumulator, vget_low_s16(s), vget_low_s16(t));
+        accumulator = vmlal_s16(accumulator, vget_high_s16(s), vget_high_s16(t));
+    }
+    int32x2_t pairs = vadd_s32(vget_low_s32(accumulator), vget_high_s32(accumulator));
+    return vget_lane_s32(vpadd_s32(pairs, pairs), 0);
+#elif defined(__SSE2__)
+    __m128i accumulator = _mm_setzero_si128();
+    for (unsigned int i = 0; i < count; i += 8) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(samples + i));
+        __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i *>(taps + i));
+        accumulator = _mm_add_epi32(accumulator, _mm_madd_epi16(s, t));
+    }
+    accumulator = _mm_add_epi32(accumulator, _mm_shuffle_epi32(accumulator, _MM_SHUFFLE(1, 0, 3, 2)));
+    accumulator = _mm_add_epi32(accumulator, _mm_shuffle_epi32(accumulator, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(accumulator);
+#else
+    int32_t accumulator = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        accumulator += (int32_t) samples[i] * taps[i];
+    }
+    return accumulator;
+#endif
+}
+
+PolyphaseResampler::PolyphaseResampler(unsigned int inputRate, unsigned int outputRate) {
+    unsigned int divisor = std::gcd(inputRate, outputRate);
+    upFactor = outputRate / divisor;
+    downFactor = inputRate / divisor;
+
+    // The prototype filter runs at inputRate * upFactor and has to cut at the lower Nyquist.
+    double cutoff = RESAMPLER_ROLLOFF * 0.5 / std::max(upFactor, downFactor);
+    double zeroCrossingSpacing = 0.5 / cutoff;
+    auto prototypeLength = (unsigned int) std::ceil(2 * RESAMPLER_ZERO_CROSSINGS * zeroCrossingSpacing);
+    tapsPerPhase = (prototypeLength + upFactor - 1) / upFactor;
+    tapsPerPhase = (tapsPerPhase + RESAMPLER_TAP_ALIGNMENT - 1) / RESAMPLER_TAP_ALIGNMENT * RESAMPLER_TAP_ALIGNMENT;
+    prototypeLength = tapsPerPhase * upFactor;
+
+    std::vector<double> prototype(prototypeLength);
+    double centre = (prototypeLength - 1) / 2.0;
+    for (unsigned int n = 0; n < prototypeLength; n++) {
+        double x = n - centre;
+        double sinc = x == 0 ? 1 : std::sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+        double ratio = x / (centre + 1);
+        double kaiser = besselI0(RESAMPLER_KAISER_BETA * std::sqrt(1 - ratio * ratio)) / besselI0(RESAMPLER_KAISER_BETA);
+        prototype[n] = sinc * kaiser;
+    }
+
+    // Each phase is normalised to unity DC gain on its own, so no phase adds a gain ripple.
+    taps.resize(prototypeLength);
+    for (unsigned int p = 0; p < upFactor; p++) {
+        double phaseGain = 0;
+        for (unsigned int k = 0; k < tapsPerPhase; k++) {
+            phaseGain += prototype[p + k * upFactor];
+        }
+        for (unsigned int k = 0; k < tapsPerPhase; k++) {
+            double tap = prototype[p + k * upFactor] / phaseGain;
+            taps[p * tapsPerPhase + (tapsPerPhase - 1 - k)] = (int16_t) std::lround(std::clamp(tap * 32768.0, -32768.0, 32767.0));
+        }
+    }
+    reset();
+}
+
+void PolyphaseResampler::reset() {
+    window.assign(tapsPerPhase - 1, 0);
+    position = tapsPerPhase - 1;
+    phase = 0;
+}
+
+size_t PolyphaseResampler::maxOutputFor(size_t inputCount) const {
+    return (inputCount * upFactor + downFactor - 1) / downFactor + 1;
+}
+
+size_t PolyphaseResampler::process(const int16_t *input, size_t inputCount, int16_t *output) {
+    size_t history = tapsPerPhase - 1;
+    window.resize(history + inputCount);
+    std::copy(input, input + inputCount, window.begin() + (long) history);
+
+    size_t produced = 0;
+    size_t end = history + inputCount;
+    while (position < end) {
+        int32_t accumulator = dotProduct(&window[position - history], &taps[phase * tapsPerPhase], tapsPerPhase);
+        output[produced++] = (int16_t) std::clamp((accumulator + (1 << 14)) >> 15, -32768, 32767);
+        phase += downFactor;
+        position += phase / upFactor;
+        phase %= upFactor;
+    }
+
+    position -= inputCount;
+    std::copy(window.end() - (long) history, window.end(), window.begin());
+    window.resize(history);
+    return produced;
+}
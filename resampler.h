@@ -0,0 +1,36 @@
+#ifndef HIKBRIDGE_RESAMPLER_H
+#define HIKBRIDGE_RESAMPLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Streaming rational-ratio resampler for mono S16, so the card can be opened at its native rate
+// (usually 48 kHz) instead of leaving the conversion to ALSA's linear rate plugin. The anti-alias
+// filter is a Kaiser-windowed sinc split into upFactor phases of Q15 taps.
+class PolyphaseResampler {
+public:
+    PolyphaseResampler(unsigned int inputRate, unsigned int outputRate);
+
+    // Writes at most maxOutputFor(inputCount) samples and returns how many were written. A
+    // block whose length is a multiple of inputRate / gcd always yields exactly
+    // inputCount * outputRate / inputRate samples.
+    size_t process(const int16_t *input, size_t inputCount, int16_t *output);
+    size_t maxOutputFor(size_t inputCount) const;
+    void reset();
+
+    unsigned int getTapsPerPhase() const { return tapsPerPhase; }
+
+private:
+    unsigned int upFactor;
+    unsigned int downFactor;
+    unsigned int tapsPerPhase;
+    // Phase-major, each phase's taps reversed so they line up with the oldest-first input window.
+    std::vector<int16_t> taps;
+    // The previous tapsPerPhase - 1 input samples followed by the current block.
+    std::vector<int16_t> window;
+    size_t position;
+    unsigned int phase = 0;
+};
+
+#endif //HIKBRIDGE_RESAMPLER_H
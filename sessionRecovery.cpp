@@ -0,0 +1,193 @@
+#include "sessionRecovery.h"
+
+#include <plog/Log.h>
+#include <iterator>
+#include "heartbeat.h"
+
+static const SdkExceptionRoute SDK_EXCEPTION_ROUTES[] = {
+    { EXCEPTION_ALARM, "alarm", RecoveryAction::rearmAlarmChannel },
+    { EXCEPTION_ALARMRECONNECT, "alarm-reconnect", RecoveryAction::alarmChannelDown },
+    { ALARM_RECONNECTSUCCESS, "alarm-reconnect-success", RecoveryAction::alarmChannelRestored },
+    { EXCEPTION_ALARM_RECONNECT_CLOSED, "alarm-reconnect-closed", RecoveryAction::rearmAlarmChannel },
+    { EXCEPTION_LOST_ALARM, "lost-alarm", RecoveryAction::none },
+    { EXCEPTION_AUDIOEXCHANGE, "audio-exchange", RecoveryAction::restartVoiceTalk },
+    { EXCEPTION_EXCHANGE, "exchange", RecoveryAction::none },
+    { EXCEPTION_RELOGIN, "relogin", RecoveryAction::alarmChannelDown },
+    { RELOGIN_SUCCESS, "relogin-success", RecoveryAction::sessionRestored },
+    { EXCEPTION_RELOGIN_FAILED, "relogin-failed", RecoveryAction::relogin },
+};
+
+static const char *PENDING_RECOVERY_NAMES[] = { "rearm-alarm-channel", "restart-voice-talk", "relogin" };
+
+RecoveryEngine::RecoveryEngine(
+    Supervisor &supervisor,
+    std::function<void()> restartVoiceTalk,
+    std::function<bool()> voiceTalkRestarted,
+    long alarmChannelAlertThresholdMillis
+) : supervisor(supervisor),
+    restartVoiceTalk(std::move(restartVoiceTalk)),
+    voiceTalkRestarted(std::move(voiceTalkRestarted)),
+    alarmChannelAlertThresholdMillis(alarmChannelAlertThresholdMillis) {
+    for (int id = 0; id < pendingRecoveryCount; id++) {
+        std::string label = std::string("{action=\"") + PENDING_RECOVERY_NAMES[id] + "\"}";
+        pending[id].attempts = &metrics().counter(
+            "hikbridge_recoveries_total" + label,
+            "Recoveries started in response to SDK exceptions."
+        );
+        pending[id].durationInMillis = &metrics().histogram(
+            "hikbridge_recovery_duration_ms" + label,
+            "Time from an SDK exception until the affected subsystem was back.",
+            LATENCY_BUCKETS_IN_MILLIS
+        );
+    }
+    for (auto &route : SDK_EXCEPTION_ROUTES) {
+        routedExceptions.push_back(&metrics().counter(
+            std::string("hikbridge_sdk_exceptions_total{type=\"") + route.name + "\"}",
+            "Exceptions reported by the Hik SDK exception callback."
+        ));
+    }
+    unroutedExceptions = &metrics().counter(
+        "hikbridge_sdk_exceptions_total{type=\"other\"}",
+        "Exceptions reported by the Hik SDK exception callback."
+    );
+    alarmChannelDownSeconds = &metrics().gauge(
+        "hikbridge_alarm_channel_down_seconds",
+        "How long the alarm channel has been down. 0 while it is armed."
+    );
+    alarmChannelAlert = &metrics().gauge(
+        "hikbridge_alarm_channel_alert",
+        "1 while the alarm channel has been down longer than the alert threshold."
+    );
+}
+
+void RecoveryEngine::markAlarmChannelDown() {
+    alarmChannelDownReportedBySdk = true;
+    long expected = -1;
+    alarmChannelDownSince.compare_exchange_strong(expected, heartbeatClockInMillis());
+}
+
+void RecoveryEngine::begin(PendingRecoveryId id, const std::string &cause) {
+    long expected = -1;
+    if (!pending[id].startedAt.compare_exchange_strong(expected, heartbeatClockInMillis())) {
+        PLOG_INFO << "Recovery <" << PENDING_RECOVERY_NAMES[id] << "> is already in progress.";
+        return;
+    }
+    pending[id].attempts->increment();
+    PLOG_WARNING << "Starting recovery <" << PENDING_RECOVERY_NAMES[id] << "> because of " << cause;
+
+    const char *subsystemName = id == pendingRelogin ? DEVICE_SESSION_SUBSYSTEM : ALARM_CHANNEL_SUBSYSTEM;
+    if (auto subsystem = supervisor.find(subsystemName)) {
+        pending[id].baselineRestarts = subsystem->getRestartCount();
+    }
+    switch (id) {
+        case pendingRearm:
+            markAlarmChannelDown();
+            supervisor.reportFault(ALARM_CHANNEL_SUBSYSTEM, cause);
+            break;
+        case pendingRelogin:
+            markAlarmChannelDown();
+            supervisor.reportFault(DEVICE_SESSION_SUBSYSTEM, cause);
+            break;
+        case pendingVoiceTalk:
+            restartVoiceTalk();
+            break;
+        default:
+            break;
+    }
+}
+
+void RecoveryEngine::onSdkException(DWORD exceptionType, LONG userId, LONG handle) {
+    const SdkExceptionRoute *route = nullptr;
+    for (size_t i = 0; i < std::size(SDK_EXCEPTION_ROUTES); i++) {
+        if (SDK_EXCEPTION_ROUTES[i].exceptionType == exceptionType) {
+            route = &SDK_EXCEPTION_ROUTES[i];
+            routedExceptions[i]->increment();
+        }
+    }
+    if (route == nullptr) {
+        unroutedExceptions->increment();
+        PLOG_INFO << "Received unhandled Hik SDK exception <0x" << std::hex << exceptionType << std::dec
+                  << "> for user id <" << userId << "> and handle <" << handle << ">";
+        return;
+    }
+
+    PLOG_WARNING << "Received Hik SDK exception <" << route->name << "> for user id <" << userId
+                 << "> and handle <" << handle << ">";
+    std::string cause = std::string("SDK exception <") + route->name + ">";
+    switch (route->action) {
+        case RecoveryAction::rearmAlarmChannel:
+            begin(pendingRearm, cause);
+            break;
+        case RecoveryAction::restartVoiceTalk:
+            begin(pendingVoiceTalk, cause);
+            break;
+        case RecoveryAction::relogin:
+            begin(pendingRelogin, cause);
+            break;
+        case RecoveryAction::alarmChannelDown:
+            markAlarmChannelDown();
+            break;
+        case RecoveryAction::alarmChannelRestored:
+            PLOG_INFO << "The SDK re-established the alarm channel on its own.";
+            alarmChannelDownReportedBySdk = false;
+            break;
+        case RecoveryAction::sessionRestored:
+            PLOG_INFO << "The SDK re-established the device session on its own.";
+            break;
+        case RecoveryAction::none:
+            break;
+    }
+}
+
+bool RecoveryEngine::isComplete(PendingRecoveryId id) {
+    if (id == pendingVoiceTalk) {
+        return voiceTalkRestarted();
+    }
+    auto subsystem = supervisor.find(id == pendingRelogin ? DEVICE_SESSION_SUBSYSTEM : ALARM_CHANNEL_SUBSYSTEM);
+    return subsystem != nullptr &&
+        subsystem->getRestartCount() > pending[id].baselineRestarts &&
+        subsystem->getHealth() == SubsystemHealth::healthy &&
+        supervisor.isHealthy(ALARM_CHANNEL_SUBSYSTEM);
+}
+
+void RecoveryEngine::poll() {
+    long now = heartbeatClockInMillis();
+    for (int id = 0; id < pendingRecoveryCount; id++) {
+        long startedAt = pending[id].startedAt;
+        if (startedAt < 0 || !isComplete((PendingRecoveryId) id)) {
+            continue;
+        }
+        pending[id].durationInMillis->observe((double) (now - startedAt));
+        pending[id].startedAt = -1;
+        if (id != pendingVoiceTalk) {
+            alarmChannelDownReportedBySdk = false;
+        }
+        PLOG_INFO << "Recovery <" << PENDING_RECOVERY_NAMES[id] << "> completed in " << now - startedAt << " ms";
+    }
+
+    bool alarmChannelDown = alarmChannelDownReportedBySdk || !supervisor.isHealthy(ALARM_CHANNEL_SUBSYSTEM);
+    if (!alarmChannelDown) {
+        long downSince = alarmChannelDownSince.exchange(-1);
+        if (alarmChannelAlertRaised) {
+            PLOG_INFO << "Alarm channel is armed again after " << now - downSince << " ms. Clearing the health alert.";
+            alarmChannelAlertRaised = false;
+        }
+        alarmChannelDownSeconds->set(0);
+        alarmChannelAlert->set(0);
+        return;
+    }
+
+    long expected = -1;
+    alarmChannelDownSince.compare_exchange_strong(expected, now);
+    long downForMillis = now - alarmChannelDownSince;
+    alarmChannelDownSeconds->set((double) downForMillis / 1000.0);
+    if (downForMillis > alarmChannelAlertThresholdMillis && !alarmChannelAlertRaised) {
+        alarmChannelAlertRaised = true;
+        alarmChannelAlert->set(1);
+        PLOG_ERROR << "HEALTH ALERT: the alarm channel has been down for " << downForMillis
+                   << " ms. Bell presses are not being received.";
+        if (pending[pendingRearm].startedAt < 0 && pending[pendingRelogin].startedAt < 0) {
+            begin(pendingRearm, "the alarm channel being down past the alert threshold");
+        }
+    }
+}
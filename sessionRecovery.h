@@ -0,0 +1,75 @@
+#ifndef HIKBRIDGE_SESSION_RECOVERY_H
+#define HIKBRIDGE_SESSION_RECOVERY_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+#include <HCNetSDK.h>
+#include "metrics.h"
+#include "supervisor.h"
+
+enum class RecoveryAction {
+    none,
+    rearmAlarmChannel,
+    restartVoiceTalk,
+    relogin,
+    alarmChannelDown,
+    alarmChannelRestored,
+    sessionRestored
+};
+
+struct SdkExceptionRoute {
+    DWORD exceptionType;
+    const char *name;
+    RecoveryAction action;
+};
+
+// Turns NET_DVR_SetExceptionCallBack_V30 notifications into recoveries: re-arming the alarm
+// channel, restarting voice talk or a full re-login. Each recovery is timed until the affected
+// subsystem is back, and an alert is raised when the alarm channel stays down too long, since
+// that's when bell presses silently stop arriving.
+class RecoveryEngine {
+public:
+    RecoveryEngine(
+        Supervisor &supervisor,
+        std::function<void()> restartVoiceTalk,
+        std::function<bool()> voiceTalkRestarted,
+        long alarmChannelAlertThresholdMillis
+    );
+
+    // Called on the SDK's exception thread; only flips flags and signals subsystems.
+    void onSdkException(DWORD exceptionType, LONG userId, LONG handle);
+    // Called periodically by the watchdog to finish timing recoveries and raise alerts.
+    void poll();
+
+private:
+    enum PendingRecoveryId { pendingRearm, pendingVoiceTalk, pendingRelogin, pendingRecoveryCount };
+    struct PendingRecovery {
+        std::atomic<long> startedAt {-1};
+        std::atomic<unsigned int> baselineRestarts {0};
+        Counter *attempts = nullptr;
+        Histogram *durationInMillis = nullptr;
+    };
+
+    void begin(PendingRecoveryId id, const std::string &cause);
+    bool isComplete(PendingRecoveryId id);
+    void markAlarmChannelDown();
+
+    Supervisor &supervisor;
+    std::function<void()> restartVoiceTalk;
+    std::function<bool()> voiceTalkRestarted;
+    long alarmChannelAlertThresholdMillis;
+
+    PendingRecovery pending[pendingRecoveryCount];
+    std::atomic<bool> alarmChannelDownReportedBySdk {false};
+    std::atomic<long> alarmChannelDownSince {-1};
+    bool alarmChannelAlertRaised = false;
+
+    Gauge *alarmChannelDownSeconds;
+    Gauge *alarmChannelAlert;
+    Counter *unroutedExceptions;
+    std::vector<Counter *> routedExceptions;
+};
+
+#endif //HIKBRIDGE_SESSION_RECOVERY_H
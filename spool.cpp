@@ -0,0 +1,409 @@
+#include "spool.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <plog/Log.h>
+#include <sstream>
+#include "heartbeat.h"
+#include "metrics.h"
+
+#define SPOOL_SEGMENT_BYTES (64 * 1024)
+// Older segments are dropped past this, so a target that never comes back can't fill the disk.
+#define SPOOL_MAX_SEGMENTS 64
+// Records never get near this, so a line without a newline in the first read is a torn write.
+#define SPOOL_MAX_RECORD_BYTES 4096
+#define SPOOL_TICK_MILLIS 200
+#define SPOOL_INITIAL_BACKOFF_MILLIS 1000
+#define SPOOL_MAX_BACKOFF_MILLIS 60000
+
+static Counter &appendedDeliveries() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_spool_appended_total",
+        "Webhook deliveries written to the spool because the target was down or backlogged."
+    );
+    return counter;
+}
+
+static Counter &redeliveredDeliveries() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_spool_redelivered_total",
+        "Spooled webhook deliveries the target has since accepted."
+    );
+    return counter;
+}
+
+static Counter &droppedSegments() {
+    static Counter &counter = metrics().counter(
+        "hikbridge_spool_dropped_segments_total",
+        "Spool segments thrown away undelivered because a target's backlog hit its limit."
+    );
+    return counter;
+}
+
+static Gauge &backlogBytes() {
+    static Gauge &gauge = metrics().gauge(
+        "hikbridge_spool_backlog_bytes",
+        "Approximate size of the spooled webhook deliveries still waiting for their targets."
+    );
+    return gauge;
+}
+
+// FNV-1a, so a target maps to the same directory across restarts and builds.
+static std::string targetLogName(const WebhookTarget &target) {
+    std::string key = target.host + ":" + std::to_string(target.port) + target.path;
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    char name[17];
+    snprintf(name, sizeof(name), "%016" PRIx64, hash);
+    return name;
+}
+
+static bool makeDirectories(const std::string &path) {
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        std::string prefix = path.substr(0, slash);
+        if (mkdir(prefix.c_str(), 0700) != 0 && errno != EEXIST) {
+            PLOG_ERROR << "Failed to create " << prefix << ": " << strerror(errno);
+            return false;
+        }
+        if (slash == std::string::npos) {
+            return true;
+        }
+    }
+}
+
+static bool writeFully(int fd, const std::string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t result = write(fd, data.data() + written, data.size() - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result <= 0) {
+            return false;
+        }
+        written += (size_t) result;
+    }
+    return true;
+}
+
+static std::optional<SpooledDelivery> parseRecord(const std::string &line) {
+    std::stringstream ss(line);
+    std::string ringAt, host, port, path;
+    if (
+        !std::getline(ss, ringAt, '\t') ||
+        !std::getline(ss, host, '\t') ||
+        !std::getline(ss, port, '\t') ||
+        !std::getline(ss, path)
+    ) {
+        return std::nullopt;
+    }
+    try {
+        return SpooledDelivery { { host, (unsigned short) std::stoul(port), path }, std::stol(ringAt) };
+    } catch (const std::exception &) {
+        return std::nullopt;
+    }
+}
+
+WebhookSpool::WebhookSpool(std::string directory) : directory(std::move(directory)) {}
+
+WebhookSpool::~WebhookSpool() {
+    for (auto &entry : logs) {
+        if (entry.second->writeFd >= 0) {
+            close(entry.second->writeFd);
+        }
+    }
+}
+
+std::string WebhookSpool::segmentPath(const TargetLog &log, unsigned long segment) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016lu.log", segment);
+    return log.directory + name;
+}
+
+// Picks a target's log back up from disk: the ack says where delivery got to, and anything
+// after the last newline of the newest segment is a torn write from a crash.
+WebhookSpool::TargetLog *WebhookSpool::openLog(const std::string &name) {
+    auto existing = logs.find(name);
+    if (existing != logs.end()) {
+        return existing->second.get();
+    }
+    auto log = std::make_unique<TargetLog>();
+    log->directory = directory + "/" + name;
+    if (!makeDirectories(log->directory)) {
+        return nullptr;
+    }
+
+    unsigned long oldestSegment = 0, newestSegment = 0;
+    if (DIR *dir = opendir(log->directory.c_str())) {
+        while (dirent *entry = readdir(dir)) {
+            unsigned long segment;
+            char suffix[8];
+            if (sscanf(entry->d_name, "%lu.%7s", &segment, suffix) == 2 && strcmp(suffix, "log") == 0) {
+                oldestSegment = oldestSegment == 0 ? segment : std::min(oldestSegment, segment);
+                newestSegment = std::max(newestSegment, segment);
+            }
+        }
+        closedir(dir);
+    }
+    log->ackSegment = std::max(oldestSegment, 1UL);
+    if (FILE *ack = fopen((log->directory + "/ack").c_str(), "r")) {
+        long offset;
+        if (fscanf(ack, "%lu %ld", &log->ackSegment, &offset) == 2) {
+            log->ackOffset = (off_t) offset;
+        }
+        fclose(ack);
+    }
+    for (unsigned long segment = oldestSegment; segment != 0 && segment < log->ackSegment; segment++) {
+        unlink(segmentPath(*log, segment).c_str());
+    }
+    log->writeSegment = std::max(newestSegment, log->ackSegment);
+
+    TargetLog *opened = log.get();
+    logs.emplace(name, std::move(log));
+    if (openWriteSegment(*opened) && opened->writeSize > 0) {
+        char tail[SPOOL_MAX_RECORD_BYTES];
+        off_t tailStart = std::max<off_t>(0, opened->writeSize - SPOOL_MAX_RECORD_BYTES);
+        ssize_t tailSize = pread(opened->writeFd, tail, sizeof(tail), tailStart);
+        auto *lastNewline = tailSize > 0 ? (char *) memrchr(tail, '\n', (size_t) tailSize) : nullptr;
+        off_t intactSize = lastNewline != nullptr ? tailStart + (lastNewline - tail) + 1 : tailStart;
+        if (intactSize < opened->writeSize && ftruncate(opened->writeFd, intactSize) == 0) {
+            PLOG_WARNING << "Dropped a torn record from the end of " << segmentPath(*opened, opened->writeSegment);
+            opened->writeSize = intactSize;
+        }
+    }
+    return opened;
+}
+
+bool WebhookSpool::openWriteSegment(TargetLog &log) {
+    std::string path = segmentPath(log, log.writeSegment);
+    log.writeFd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (log.writeFd < 0) {
+        PLOG_ERROR << "Failed to open spool segment " << path << ": " << strerror(errno);
+        return false;
+    }
+    struct stat st {};
+    fstat(log.writeFd, &st);
+    log.writeSize = st.st_size;
+    return true;
+}
+
+bool WebhookSpool::append(const SpooledDelivery &delivery) {
+    const WebhookTarget &target = delivery.target;
+    if (target.host.find_first_of("\t\n") != std::string::npos || target.path.find_first_of("\t\n") != std::string::npos) {
+        PLOG_ERROR << "Can't spool a delivery to a target with a tab or newline in it.";
+        return false;
+    }
+    std::stringstream record;
+    record << delivery.ringAtMillis << '\t' << target.host << '\t' << target.port << '\t' << target.path << '\n';
+    if (record.str().size() >= SPOOL_MAX_RECORD_BYTES) {
+        PLOG_ERROR << "Can't spool a delivery to a target this long.";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lk(mutex);
+    TargetLog *log = openLog(targetLogName(target));
+    if (log == nullptr) {
+        return false;
+    }
+    if (log->writeFd >= 0 && log->writeSize >= SPOOL_SEGMENT_BYTES) {
+        fdatasync(log->writeFd);
+        close(log->writeFd);
+        log->writeFd = -1;
+        log->unsynced = false;
+        log->writeSegment++;
+        if (log->writeSegment - log->ackSegment >= SPOOL_MAX_SEGMENTS) {
+            PLOG_ERROR << "The spool for http://" << target.host << ":" << target.port << target.path
+                       << " is full. Dropping its oldest undelivered segment.";
+            unlink(segmentPath(*log, log->ackSegment).c_str());
+            log->ackSegment++;
+            log->ackOffset = 0;
+            persistAck(*log);
+            droppedSegments().increment();
+        }
+    }
+    if (log->writeFd < 0 && !openWriteSegment(*log)) {
+        return false;
+    }
+    if (!writeFully(log->writeFd, record.str())) {
+        PLOG_ERROR << "Failed to write to the spool: " << strerror(errno);
+        if (ftruncate(log->writeFd, log->writeSize) != 0) {
+            PLOG_ERROR << "Failed to trim a partial spool record: " << strerror(errno);
+        }
+        return false;
+    }
+    log->writeSize += (off_t) record.str().size();
+    log->unsynced = true;
+    appendedDeliveries().increment();
+    return true;
+}
+
+// Loads the target's log from disk if need be, since a ring can arrive after a restart before the
+// replayer has scanned the spool for what the last run left behind.
+bool WebhookSpool::hasBacklog(const WebhookTarget &target) {
+    std::lock_guard<std::mutex> lk(mutex);
+    TargetLog *log = openLog(targetLogName(target));
+    if (log == nullptr) {
+        return false;
+    }
+    return log->ackSegment < log->writeSegment || log->ackOffset < log->writeSize;
+}
+
+// Reads the oldest unacknowledged record, stepping over (and deleting) segments it has finished.
+std::optional<WebhookSpool::HeadRecord> WebhookSpool::readHead(TargetLog &log) {
+    while (log.ackSegment < log.writeSegment || log.ackOffset < log.writeSize) {
+        char buffer[SPOOL_MAX_RECORD_BYTES];
+        ssize_t size = -1;
+        std::string path = segmentPath(log, log.ackSegment);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            size = pread(fd, buffer, sizeof(buffer), log.ackOffset);
+            close(fd);
+        }
+        auto *newline = size > 0 ? (char *) memchr(buffer, '\n', (size_t) size) : nullptr;
+        if (newline == nullptr) {
+            if (log.ackSegment == log.writeSegment) {
+                return std::nullopt;
+            }
+            unlink(path.c_str());
+            log.ackSegment++;
+            log.ackOffset = 0;
+            persistAck(log);
+            continue;
+        }
+
+        off_t nextOffset = log.ackOffset + (newline - buffer) + 1;
+        if (auto delivery = parseRecord(std::string(buffer, newline))) {
+            return HeadRecord { *delivery, log.ackSegment, log.ackOffset, nextOffset };
+        }
+        PLOG_ERROR << "Skipping an unreadable spool record in " << path << " @ " << log.ackOffset;
+        log.ackOffset = nextOffset;
+        persistAck(log);
+    }
+    return std::nullopt;
+}
+
+void WebhookSpool::acknowledge(TargetLog &log, const HeadRecord &head) {
+    // The record may have been dropped with its segment while it was being delivered.
+    if (log.ackSegment != head.segment || log.ackOffset != head.offset) {
+        return;
+    }
+    log.ackOffset = head.nextOffset;
+    // Caught up: start the target on a fresh segment rather than leaving the old one around.
+    if (log.ackSegment == log.writeSegment && log.ackOffset >= log.writeSize) {
+        if (log.writeFd >= 0) {
+            close(log.writeFd);
+            log.writeFd = -1;
+        }
+        unlink(segmentPath(log, log.writeSegment).c_str());
+        log.unsynced = false;
+        log.writeSegment++;
+        log.writeSize = 0;
+        log.ackSegment = log.writeSegment;
+        log.ackOffset = 0;
+    }
+    persistAck(log);
+}
+
+// Written aside and renamed so the ack is never torn. It isn't fsynced: losing the latest ack to a
+// crash only means redelivering a ring, and delivery is at-least-once anyway.
+void WebhookSpool::persistAck(TargetLog &log) {
+    std::string path = log.directory + "/ack";
+    std::string staging = path + ".tmp";
+    if (FILE *ack = fopen(staging.c_str(), "w")) {
+        fprintf(ack, "%lu %ld\n", log.ackSegment, (long) log.ackOffset);
+        fclose(ack);
+        rename(staging.c_str(), path.c_str());
+    } else {
+        PLOG_WARNING << "Failed to record spool progress in " << path << ": " << strerror(errno);
+    }
+}
+
+void WebhookSpool::syncAppends() {
+    double backlog = 0;
+    for (auto &entry : logs) {
+        TargetLog &log = *entry.second;
+        if (log.unsynced && log.writeFd >= 0) {
+            fdatasync(log.writeFd);
+            log.unsynced = false;
+        }
+        backlog += (double) (log.writeSegment - log.ackSegment) * SPOOL_SEGMENT_BYTES +
+            (double) (log.writeSize - log.ackOffset);
+    }
+    backlogBytes().set(backlog);
+}
+
+[[noreturn]] void WebhookSpool::runReplayer(
+    SupervisedSubsystem &subsystem,
+    const std::function<bool(const SpooledDelivery &)> &deliver
+) {
+    std::vector<TargetLog *> targets;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (!makeDirectories(directory)) {
+            throw SubsystemFault("Can't create the webhook spool at " + directory);
+        }
+        // Backlogs left behind by an earlier run.
+        if (DIR *dir = opendir(directory.c_str())) {
+            while (dirent *entry = readdir(dir)) {
+                if (entry->d_name[0] != '.') {
+                    openLog(entry->d_name);
+                }
+            }
+            closedir(dir);
+        }
+    }
+    subsystem.markHealthy();
+
+    while (true) {
+        subsystem.checkForFault();
+        usleep(SPOOL_TICK_MILLIS * 1000);
+
+        targets.clear();
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            syncAppends();
+            for (auto &entry : logs) {
+                targets.push_back(entry.second.get());
+            }
+        }
+
+        // A target that's back gets its whole backlog in one go; one that's still down is left
+        // alone until its backoff runs out.
+        for (TargetLog *log : targets) {
+            while (true) {
+                std::optional<HeadRecord> head;
+                {
+                    std::lock_guard<std::mutex> lk(mutex);
+                    if (heartbeatClockInMillis() < log->nextAttemptAt) {
+                        break;
+                    }
+                    head = readHead(*log);
+                }
+                if (!head) {
+                    break;
+                }
+
+                bool delivered = deliver(head->delivery);
+                std::lock_guard<std::mutex> lk(mutex);
+                if (delivered) {
+                    acknowledge(*log, *head);
+                    log->backoffMillis = 0;
+                    redeliveredDeliveries().increment();
+                } else {
+                    log->backoffMillis = log->backoffMillis == 0
+                        ? SPOOL_INITIAL_BACKOFF_MILLIS
+                        : std::min(log->backoffMillis * 2, (long) SPOOL_MAX_BACKOFF_MILLIS);
+                    log->nextAttemptAt = heartbeatClockInMillis() + log->backoffMillis;
+                    break;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef HIKBRIDGE_SPOOL_H
+#define HIKBRIDGE_SPOOL_H
+
+#include <sys/types.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include "config.h"
+#include "supervisor.h"
+
+#define WEBHOOK_SPOOL_DIRECTORY "/var/lib/hikbridge/spool"
+#define SPOOL_SUBSYSTEM "webhook-spool"
+
+struct SpooledDelivery {
+    WebhookTarget target;
+    long ringAtMillis;
+};
+
+// Webhook deliveries that failed, kept on disk until the target takes them. Every target gets a
+// directory of numbered segment files that are only ever appended to, plus an ack file recording
+// how far the replayer got. Segments wholly behind the ack are deleted, and only the head record
+// is ever read back, so memory doesn't grow with the outage. Appends are fsynced in batches by the
+// replayer thread rather than one at a time.
+class WebhookSpool {
+public:
+    explicit WebhookSpool(std::string directory);
+    ~WebhookSpool();
+
+    // False if the delivery couldn't be written, in which case it's lost.
+    bool append(const SpooledDelivery &delivery);
+    // New deliveries to a target with a backlog have to queue behind it to keep their order.
+    bool hasBacklog(const WebhookTarget &target);
+
+    // Redelivers each target's backlog oldest first, backing off while the target is still down.
+    [[noreturn]] void runReplayer(
+        SupervisedSubsystem &subsystem,
+        const std::function<bool(const SpooledDelivery &)> &deliver
+    );
+
+private:
+    struct TargetLog {
+        std::string directory;
+        unsigned long writeSegment = 1;
+        int writeFd = -1;
+        off_t writeSize = 0;
+        bool unsynced = false;
+        unsigned long ackSegment = 1;
+        off_t ackOffset = 0;
+        long nextAttemptAt = 0;
+        long backoffMillis = 0;
+    };
+    struct HeadRecord {
+        SpooledDelivery delivery;
+        unsigned long segment;
+        off_t offset;
+        off_t nextOffset;
+    };
+
+    TargetLog *openLog(const std::string &name);
+    bool openWriteSegment(TargetLog &log);
+    std::optional<HeadRecord> readHead(TargetLog &log);
+    void acknowledge(TargetLog &log, const HeadRecord &head);
+    void persistAck(TargetLog &log);
+    void syncAppends();
+    static std::string segmentPath(const TargetLog &log, unsigned long segment);
+
+    std::string directory;
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<TargetLog>> logs;
+};
+
+#endif //HIKBRIDGE_SPOOL_H
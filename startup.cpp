@@ -0,0 +1,92 @@
+#include "startup.h"
+
+#include <plog/Log.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "heartbeat.h"
+#include "metrics.h"
+
+StartupTimeline::StartupTimeline() : startedAt(heartbeatClockInMillis()) {}
+
+void StartupTimeline::mark(const char *phase) {
+    long elapsed = heartbeatClockInMillis() - startedAt;
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!armed) {
+        record(phase, elapsed);
+    }
+}
+
+void StartupTimeline::markArmed() {
+    long elapsed = heartbeatClockInMillis() - startedAt;
+    std::lock_guard<std::mutex> lk(mutex);
+    if (armed) {
+        return;
+    }
+    record("armed", elapsed);
+    armed = true;
+    std::stringstream ss;
+    ss << "Armed " << elapsed << " ms after starting up:";
+    for (auto &phase : phases) {
+        ss << " " << phase.first << " @ " << phase.second << " ms;";
+    }
+    PLOG_INFO << ss.str();
+}
+
+void StartupTimeline::record(const char *phase, long elapsed) {
+    if (std::any_of(phases.begin(), phases.end(), [phase](const auto &p) { return p.first == phase; })) {
+        return;
+    }
+    phases.emplace_back(phase, elapsed);
+    metrics().gauge(
+        std::string("hikbridge_startup_phase_ms{phase=\"") + phase + "\"}",
+        "When each startup phase first completed, in millis after HikBridge started."
+    ).set((double) elapsed);
+}
+
+StartupTimeline &startupTimeline() {
+    static StartupTimeline timeline;
+    return timeline;
+}
+
+// One "<device> <encoding>" line per device.
+int loadCachedAudioEncType(const std::string &deviceKey) {
+    std::ifstream cache(STARTUP_CACHE_PATH);
+    std::string key;
+    int audioEncType;
+    while (cache >> key >> audioEncType) {
+        if (key == deviceKey) {
+            return audioEncType;
+        }
+    }
+    return -1;
+}
+
+void storeCachedAudioEncType(const std::string &deviceKey, int audioEncType) {
+    std::stringstream updated;
+    {
+        std::ifstream cache(STARTUP_CACHE_PATH);
+        std::string key;
+        int cachedType;
+        while (cache >> key >> cachedType) {
+            if (key != deviceKey) {
+                updated << key << " " << cachedType << "\n";
+            }
+        }
+    }
+    updated << deviceKey << " " << audioEncType << "\n";
+
+    // Written aside and renamed, so a crash mid-write can't leave a torn cache behind.
+    std::string staging = std::string(STARTUP_CACHE_PATH) + ".tmp";
+    {
+        std::ofstream cache(staging, std::ios::trunc);
+        if (!(cache << updated.str()) || !cache.flush()) {
+            PLOG_WARNING << "Couldn't write the startup cache to " << staging << ". The next start will be slower.";
+            return;
+        }
+    }
+    if (std::rename(staging.c_str(), STARTUP_CACHE_PATH) != 0) {
+        PLOG_WARNING << "Couldn't move the startup cache into " << STARTUP_CACHE_PATH << ". The next start will be slower.";
+    }
+}
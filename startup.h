@@ -0,0 +1,37 @@
+#ifndef HIKBRIDGE_STARTUP_H
+#define HIKBRIDGE_STARTUP_H
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define STARTUP_CACHE_PATH "/var/lib/hikbridge/startup-cache"
+
+// When each startup phase first completed, relative to the timeline's creation at the top of
+// main(). Phases that complete again after a subsystem restarts don't move.
+class StartupTimeline {
+public:
+    StartupTimeline();
+
+    void mark(const char *phase);
+    // Marks the bridge as armed, then logs and exports the timeline. Only the first call counts.
+    void markArmed();
+
+private:
+    void record(const char *phase, long elapsed);
+
+    std::mutex mutex;
+    long startedAt;
+    bool armed = false;
+    std::vector<std::pair<std::string, long>> phases;
+};
+
+StartupTimeline &startupTimeline();
+
+// The device's voice talk encoding from the last run, so capture can open the card for the
+// right codec while login is still in flight. -1 when there's nothing cached for this device.
+int loadCachedAudioEncType(const std::string &deviceKey);
+void storeCachedAudioEncType(const std::string &deviceKey, int audioEncType);
+
+#endif //HIKBRIDGE_STARTUP_H
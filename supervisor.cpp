@@ -0,0 +1,208 @@
+#include "supervisor.h"
+
+#include <plog/Log.h>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+static long steadyTimeInMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+const char *subsystemHealthName(SubsystemHealth health) {
+    switch (health) {
+        case SubsystemHealth::starting:
+            return "starting";
+        case SubsystemHealth::healthy:
+            return "healthy";
+        case SubsystemHealth::degraded:
+            return "degraded";
+        case SubsystemHealth::restarting:
+            return "restarting";
+    }
+    return "unknown";
+}
+
+SupervisedSubsystem::SupervisedSubsystem(std::string name, RestartPolicy policy, SupervisedSubsystem *parent)
+    : name(std::move(name)), policy(policy), parent(parent) {
+    healthChangedAt = steadyTimeInMillis();
+}
+
+void SupervisedSubsystem::setHealth(SubsystemHealth newHealth) {
+    if (health.exchange(newHealth) != newHealth) {
+        healthChangedAt = steadyTimeInMillis();
+    }
+}
+
+void SupervisedSubsystem::markHealthy() {
+    if (health != SubsystemHealth::healthy) {
+        PLOG_INFO << "Subsystem <" << name << "> is healthy.";
+    }
+    setHealth(SubsystemHealth::healthy);
+}
+
+void SupervisedSubsystem::markDegraded(const std::string &reason) {
+    PLOG_WARNING << "Subsystem <" << name << "> is degraded: " << reason;
+    setHealth(SubsystemHealth::degraded);
+}
+
+long SupervisedSubsystem::getMillisSinceHealthChange() const {
+    return steadyTimeInMillis() - healthChangedAt;
+}
+
+void SupervisedSubsystem::checkForFault() {
+    std::lock_guard<std::mutex> lk(faultMutex);
+    if (restartRequested) {
+        throw SubsystemFault(restartReason);
+    }
+}
+
+void SupervisedSubsystem::awaitFault() {
+    std::unique_lock<std::mutex> lk(faultMutex);
+    faultCV.wait(lk, [this] { return restartRequested; });
+    throw SubsystemFault(restartReason);
+}
+
+void SupervisedSubsystem::requestRestart(const std::string &reason) {
+    {
+        std::lock_guard<std::mutex> lk(faultMutex);
+        if (restartRequested) {
+            return;
+        }
+        restartRequested = true;
+        restartReason = reason;
+    }
+    PLOG_WARNING << "Restart of subsystem <" << name << "> requested: " << reason;
+    faultCV.notify_all();
+}
+
+void SupervisedSubsystem::waitForParent() {
+    if (parent == nullptr) {
+        return;
+    }
+    while (parent->getHealth() != SubsystemHealth::healthy && parent->getHealth() != SubsystemHealth::degraded) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+void SupervisedSubsystem::superviseLoop(
+    const std::function<void(SupervisedSubsystem &)> &run,
+    const std::function<void(const std::string &)> &escalate
+) {
+    long backoffMillis = policy.initialBackoffMillis;
+    unsigned int consecutiveFailures = 0;
+    while (true) {
+        waitForParent();
+        {
+            std::lock_guard<std::mutex> lk(faultMutex);
+            restartRequested = false;
+        }
+        setHealth(SubsystemHealth::starting);
+        long startedAt = steadyTimeInMillis();
+
+        std::string reason = "exited unexpectedly";
+        bool recoverable = true;
+        try {
+            run(*this);
+        } catch (const SubsystemFault &fault) {
+            reason = fault.what();
+            recoverable = fault.isRecoverable();
+        } catch (const std::exception &e) {
+            reason = e.what();
+        }
+
+        setHealth(SubsystemHealth::restarting);
+        restartCount++;
+        std::vector<SupervisedSubsystem *> childrenToRestart;
+        {
+            std::lock_guard<std::mutex> lk(childrenMutex);
+            childrenToRestart = children;
+        }
+        for (auto child : childrenToRestart) {
+            child->requestRestart("parent subsystem <" + name + "> is restarting");
+        }
+
+        std::stringstream ss;
+        ss << "Subsystem <" << name << "> faulted: " << reason;
+        if (!recoverable) {
+            escalate(ss.str());
+        }
+        if (steadyTimeInMillis() - startedAt >= policy.stableAfterMillis) {
+            consecutiveFailures = 0;
+            backoffMillis = policy.initialBackoffMillis;
+        } else {
+            consecutiveFailures++;
+        }
+        if (policy.maxConsecutiveFailures > 0 && consecutiveFailures >= policy.maxConsecutiveFailures) {
+            ss << " (" << consecutiveFailures << " failures in a row)";
+            escalate(ss.str());
+        }
+
+        PLOG_WARNING << ss.str() << ". Restart #" << restartCount << " in " << backoffMillis << " ms.";
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoffMillis));
+        backoffMillis = std::min(backoffMillis * 2, policy.maxBackoffMillis);
+    }
+}
+
+Supervisor::Supervisor(std::function<void(const std::string &)> escalate) : escalate(std::move(escalate)) {}
+
+SupervisedSubsystem &Supervisor::supervise(
+    const std::string &name,
+    RestartPolicy policy,
+    std::function<void(SupervisedSubsystem &)> run,
+    const std::string &parentName
+) {
+    SupervisedSubsystem *parent = parentName.empty() ? nullptr : find(parentName);
+    std::unique_lock<std::mutex> lk(subsystemsMutex);
+    subsystems.push_back(std::make_unique<SupervisedSubsystem>(name, policy, parent));
+    SupervisedSubsystem &subsystem = *subsystems.back();
+    if (parent != nullptr) {
+        std::lock_guard<std::mutex> childrenLock(parent->childrenMutex);
+        parent->children.push_back(&subsystem);
+    }
+    lk.unlock();
+    PLOG_INFO << "Supervising subsystem <" << name << ">"
+              << (parent != nullptr ? " under <" + parentName + ">" : std::string());
+    subsystem.thread = std::thread([&subsystem, run = std::move(run), this]() {
+        subsystem.superviseLoop(run, escalate);
+    });
+    subsystem.thread.detach();
+    return subsystem;
+}
+
+SupervisedSubsystem *Supervisor::find(const std::string &name) const {
+    std::lock_guard<std::mutex> lk(subsystemsMutex);
+    for (auto &subsystem : subsystems) {
+        if (subsystem->getName() == name) {
+            return subsystem.get();
+        }
+    }
+    return nullptr;
+}
+
+void Supervisor::reportFault(const std::string &name, const std::string &reason) {
+    if (auto subsystem = find(name)) {
+        subsystem->requestRestart(reason);
+    } else {
+        PLOG_ERROR << "Fault reported for unsupervised subsystem <" << name << ">: " << reason;
+    }
+}
+
+bool Supervisor::isHealthy(const std::string &name) const {
+    auto subsystem = find(name);
+    return subsystem != nullptr && subsystem->getHealth() == SubsystemHealth::healthy;
+}
+
+std::string Supervisor::describe() const {
+    std::lock_guard<std::mutex> lk(subsystemsMutex);
+    std::stringstream ss;
+    bool first = true;
+    for (auto &subsystem : subsystems) {
+        ss << (first ? "" : ", ") << subsystem->getName() << "=" << subsystemHealthName(subsystem->getHealth())
+           << " (restarts: " << subsystem->getRestartCount() << ")";
+        first = false;
+    }
+    return ss.str();
+}
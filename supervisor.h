@@ -0,0 +1,120 @@
+#ifndef HIKBRIDGE_SUPERVISOR_H
+#define HIKBRIDGE_SUPERVISOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// HikBridge's supervision tree: the alarm channel hangs off the device session, while capture,
+// the notifier, the HTTP server and the config watcher stand on their own.
+#define DEVICE_SESSION_SUBSYSTEM "device-session"
+#define ALARM_CHANNEL_SUBSYSTEM "alarm-channel"
+#define CAPTURE_SUBSYSTEM "capture"
+// Capture sources after the first, by index.
+#define CAPTURE_SUBSYSTEM_PREFIX "capture-"
+#define NOTIFIER_SUBSYSTEM "notifier"
+#define CONFIG_SUBSYSTEM "config"
+#define HTTP_SUBSYSTEM "http"
+#define ALARM_LISTENER_SUBSYSTEM "alarm-listener"
+
+enum class SubsystemHealth { starting, healthy, degraded, restarting };
+
+const char *subsystemHealthName(SubsystemHealth health);
+
+// Thrown out of a subsystem to have its supervisor restart it. Unrecoverable faults escalate
+// straight to the supervisor's escalation handler instead.
+class SubsystemFault : public std::runtime_error {
+public:
+    explicit SubsystemFault(const std::string &reason, bool recoverable = true)
+        : std::runtime_error(reason), recoverable(recoverable) {}
+
+    bool isRecoverable() const { return recoverable; }
+
+private:
+    bool recoverable;
+};
+
+struct RestartPolicy {
+    long initialBackoffMillis;
+    long maxBackoffMillis;
+    // A run that stayed up at least this long resets the backoff and the failure streak.
+    long stableAfterMillis;
+    // Escalate once this many runs in a row fail before becoming stable. 0 never escalates.
+    unsigned int maxConsecutiveFailures;
+};
+
+class SupervisedSubsystem {
+public:
+    SupervisedSubsystem(std::string name, RestartPolicy policy, SupervisedSubsystem *parent);
+
+    void markHealthy();
+    void markDegraded(const std::string &reason);
+    // Throws SubsystemFault if a restart was requested from elsewhere.
+    void checkForFault();
+    // Blocks until a restart is requested, then throws SubsystemFault.
+    [[noreturn]] void awaitFault();
+    void requestRestart(const std::string &reason);
+
+    const std::string &getName() const { return name; }
+    SubsystemHealth getHealth() const { return health; }
+    unsigned int getRestartCount() const { return restartCount; }
+    long getMillisSinceHealthChange() const;
+
+private:
+    friend class Supervisor;
+
+    void superviseLoop(
+        const std::function<void(SupervisedSubsystem &)> &run,
+        const std::function<void(const std::string &)> &escalate
+    );
+    void setHealth(SubsystemHealth newHealth);
+    void waitForParent();
+
+    std::string name;
+    RestartPolicy policy;
+    SupervisedSubsystem *parent;
+    // Children can be registered while this subsystem's own thread is already restarting it.
+    std::mutex childrenMutex;
+    std::vector<SupervisedSubsystem *> children;
+
+    std::atomic<SubsystemHealth> health {SubsystemHealth::starting};
+    std::atomic<unsigned int> restartCount {0};
+    std::atomic<long> healthChangedAt {0};
+    std::mutex faultMutex;
+    std::condition_variable faultCV;
+    bool restartRequested = false;
+    std::string restartReason;
+    std::thread thread;
+};
+
+// Runs each subsystem on its own thread and restarts it with exponential backoff whenever it
+// faults. Restarting a subsystem restarts its children too, once the parent is healthy again.
+class Supervisor {
+public:
+    explicit Supervisor(std::function<void(const std::string &)> escalate);
+
+    SupervisedSubsystem &supervise(
+        const std::string &name,
+        RestartPolicy policy,
+        std::function<void(SupervisedSubsystem &)> run,
+        const std::string &parentName = ""
+    );
+    void reportFault(const std::string &name, const std::string &reason);
+    bool isHealthy(const std::string &name) const;
+    SupervisedSubsystem *find(const std::string &name) const;
+    std::string describe() const;
+
+private:
+    std::function<void(const std::string &)> escalate;
+    mutable std::mutex subsystemsMutex;
+    std::list<std::unique_ptr<SupervisedSubsystem>> subsystems;
+};
+
+#endif //HIKBRIDGE_SUPERVISOR_H
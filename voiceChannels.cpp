@@ -0,0 +1,44 @@
+#include "voiceChannels.h"
+
+#include <algorithm>
+#include <array>
+#include <utility>
+
+// Each channel is built on its slot, so the slot never changes once the SDK can see it.
+template <size_t... Slots>
+static std::array<VoiceChannel, sizeof...(Slots)> numberedVoiceChannels(std::index_sequence<Slots...>) {
+    return {{ VoiceChannel((int) Slots)... }};
+}
+
+static std::array<VoiceChannel, MAX_VOICE_ROUTES> voiceChannels =
+    numberedVoiceChannels(std::make_index_sequence<MAX_VOICE_ROUTES>());
+
+VoiceChannel &voiceChannel(int slot) {
+    return voiceChannels[slot];
+}
+
+std::vector<CaptureGroup> groupVoiceRoutes(const std::vector<VoiceRoute> &routes) {
+    std::vector<CaptureGroup> groups;
+    for (size_t slot = 0; slot < routes.size(); slot++) {
+        const VoiceRoute &route = routes[slot];
+        auto group = std::find_if(groups.begin(), groups.end(), [&](const CaptureGroup &g) {
+            return g.source == route.source;
+        });
+        if (group == groups.end()) {
+            group = groups.insert(groups.end(), { route.source, 1, {} });
+        }
+        group->routes.push_back({ (int) slot, route.voiceChannel, route.sourceChannel });
+        if (route.sourceChannel >= 0) {
+            group->channelCount = std::max(group->channelCount, (unsigned int) route.sourceChannel + 1);
+        }
+    }
+    return groups;
+}
+
+void deinterleave(const int16_t *interleaved, size_t frames, unsigned int channels, int16_t *planar) {
+    for (size_t frame = 0; frame < frames; frame++) {
+        for (unsigned int channel = 0; channel < channels; channel++) {
+            planar[channel * frames + frame] = *interleaved++;
+        }
+    }
+}
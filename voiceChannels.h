@@ -0,0 +1,53 @@
+#ifndef HIKBRIDGE_VOICE_CHANNELS_H
+#define HIKBRIDGE_VOICE_CHANNELS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "audioPipeline.h"
+#include "config.h"
+
+// The session state for one routed voice talk channel. Slots are fixed for the life of the
+// process, so the SDK can be handed a pointer to one as its callback's pUser; which device voice
+// channel a slot talks on follows the routing table.
+struct VoiceChannel {
+    explicit VoiceChannel(int slot) : slot(slot) {}
+
+    const int slot;
+    std::atomic<unsigned int> number {1};
+    AudioHandoff handoff;
+    std::mutex handleMutex;
+    int handle = -1;
+    std::atomic<bool> relayEnabled {false};
+    // Set by tamper alarms and recovery, cleared by the capture thread once it's acted on it.
+    std::atomic<bool> restartRequested {false};
+};
+
+// Slot 0 is the primary channel, the lowest routed voice channel.
+VoiceChannel &voiceChannel(int slot);
+
+struct RoutedVoiceChannel {
+    int slot;
+    unsigned int voiceChannel;
+    // -1 when the source is opened mono.
+    int sourceChannel;
+};
+
+// One capture source and the voice channels it feeds, in slot order.
+struct CaptureGroup {
+    std::string source;
+    unsigned int channelCount;
+    std::vector<RoutedVoiceChannel> routes;
+};
+
+// Routes take slots in voice channel order; groups come in the order their first route does.
+std::vector<CaptureGroup> groupVoiceRoutes(const std::vector<VoiceRoute> &routes);
+
+// Splits a period of interleaved frames into one run per channel, channel c's starting at
+// c * frames, in a single pass over the card's buffer.
+void deinterleave(const int16_t *interleaved, size_t frames, unsigned int channels, int16_t *planar);
+
+#endif //HIKBRIDGE_VOICE_CHANNELS_H